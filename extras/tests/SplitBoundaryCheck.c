@@ -0,0 +1,318 @@
+/*
+The MIT License(MIT)
+
+Cayenne MQTT Client Library
+Copyright (c) 2016 myDevices
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated
+documentation files(the "Software"), to deal in the Software without restriction, including without limitation
+the rights to use, copy, modify, merge, publish, distribute, sublicense, and / or sell copies of the Software,
+and to permit persons to whom the Software is furnished to do so, subject to the following conditions :
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+/*
+* Feeds a stream of packets to the client split at every byte boundary, and then a byte at a time, through each way
+* the client receives data: MQTTYield reading with mqttread, MQTTPoll using mqttpeek and mqttskip, and MQTTFeed.
+* Each time every message must be delivered once with the right payload, the QoS1 publish acknowledged once and the
+* publish too big for the read buffer dropped, or streamed whole when a chunk handler is set. The stream is then sent
+* again over MQTT 5 with a malformed property block on the big publish, which must be dropped without stopping the
+* client from taking the packets after it. Last, the stream is fed in pieces of random length, from a seed that can be
+* given on the command line so a failure can be repeated, and the time taken is reported as parse throughput.
+* See README.md in this directory for how to build and run it.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "MQTTClient.h"
+
+#define READBUF_SIZE 64
+#define RANDOM_RUNS 20000 /* streams fed in random pieces through each path */
+#define MAX_PIECE 48 /* longest random piece, in bytes */
+
+enum Path { PATH_YIELD, PATH_POLL, PATH_FEED };
+enum Stream { STREAM_MQTT311, STREAM_MALFORMED };
+
+static const char* pathNames[] = { "MQTTYield", "MQTTPoll", "MQTTFeed" };
+static const char* streamNames[] = { "MQTT 3.1.1", "MQTT 5 malformed" };
+
+static unsigned char stream[512];
+static int streamLen;
+static int position; /* bytes of stream the client has taken */
+static int limit; /* bytes of stream that have arrived so far */
+
+static int delivered, wrongPayload, acks, chunkBytes;
+static char bigPayload[150];
+
+
+static int fakeRead(Network* network, unsigned char* buffer, int len, int timeout_ms)
+{
+	if (len > limit - position)
+		len = limit - position;
+	memcpy(buffer, &stream[position], len);
+	position += len;
+	return len; /* 0 when nothing more has arrived, as a read that timed out */
+}
+
+
+static int fakePeek(Network* network, unsigned char** data, int timeout_ms)
+{
+	*data = &stream[position];
+	return limit - position;
+}
+
+
+static void fakeSkip(Network* network, int len)
+{
+	position += len;
+}
+
+
+static int fakeWrite(Network* network, unsigned char* buffer, int len, int timeout_ms)
+{
+	if (len == 4 && buffer[0] == 0x40)
+		acks++;
+	return len;
+}
+
+
+static void messageArrived(MessageData* md, void* userData)
+{
+	MQTTMessage* m = md->message;
+	const char* expected = (m->qos == QOS0) ? "first" : "second";
+
+	delivered++;
+	if (m->payloadlen != strlen(expected) || memcmp(m->payload, expected, m->payloadlen) != 0)
+		wrongPayload++;
+}
+
+
+static void chunkArrived(MessageData* md, size_t offset, size_t total, void* userData)
+{
+	MQTTMessage* m = md->message;
+
+	if (total != sizeof(bigPayload) || offset != (size_t)chunkBytes ||
+		memcmp(m->payload, &bigPayload[offset], m->payloadlen) != 0)
+		wrongPayload++;
+	chunkBytes += m->payloadlen;
+}
+
+
+static int appendPublish(const char* topic, int qos, unsigned short id, const unsigned char* properties, int propertieslen,
+	const char* payload, int payloadlen)
+{
+	int topiclen = strlen(topic), len = 2 + topiclen + (qos > 0 ? 2 : 0) + propertieslen + payloadlen;
+
+	if (len > 16383 || streamLen + 3 + len > (int)sizeof(stream))
+		return 0;
+	stream[streamLen++] = 0x30 | (qos << 1);
+	if (len > 127) {
+		stream[streamLen++] = (len % 128) | 128;
+		stream[streamLen++] = len / 128;
+	}
+	else
+		stream[streamLen++] = len;
+	stream[streamLen++] = topiclen >> 8;
+	stream[streamLen++] = topiclen & 0xff;
+	memcpy(&stream[streamLen], topic, topiclen);
+	streamLen += topiclen;
+	if (qos > 0) {
+		stream[streamLen++] = id >> 8;
+		stream[streamLen++] = id & 0xff;
+	}
+	memcpy(&stream[streamLen], properties, propertieslen);
+	streamLen += propertieslen;
+	memcpy(&stream[streamLen], payload, payloadlen);
+	streamLen += payloadlen;
+	return 1;
+}
+
+
+/**
+* Build the stream: a QoS0 publish, a PINGRESP, a publish too big for the read buffer, and a QoS1 publish.
+* @param[in] which The stream to build, over MQTT 5 each publish has an empty property block, except that the big
+* publish's holds an unknown property
+* @return 1 if successful, 0 otherwise
+*/
+static int buildStream(enum Stream which)
+{
+	static const unsigned char none[] = { 0 }, malformed[] = { 2, 0xff, 0 };
+	int propertieslen = (which == STREAM_MQTT311) ? 0 : (int)sizeof(none);
+	const unsigned char* bigProperties = (which == STREAM_MALFORMED) ? malformed : none;
+	int bigPropertieslen = (which == STREAM_MALFORMED) ? (int)sizeof(malformed) : propertieslen;
+
+	memset(bigPayload, 'x', sizeof(bigPayload));
+	bigPayload[0] = 'a';
+	bigPayload[sizeof(bigPayload) - 1] = 'z';
+	streamLen = 0;
+	if (!appendPublish("a/b", QOS0, 0, none, propertieslen, "first", 5))
+		return 0;
+	stream[streamLen++] = 0xd0;
+	stream[streamLen++] = 0;
+	return appendPublish("big/topic", QOS0, 0, bigProperties, bigPropertieslen, bigPayload, sizeof(bigPayload)) &&
+		appendPublish("c/d", QOS1, 7, none, propertieslen, "second", 6);
+}
+
+
+/**
+* Hand the client the bytes of the stream from position up to the given limit, calling again after a failure as a
+* caller would, since the client stops at the end of a malformed packet.
+*/
+static void receive(MQTTClient* c, enum Path path, int to)
+{
+	int used = 0, taken, i;
+
+	limit = to;
+	switch (path) {
+	case PATH_YIELD:
+		do {
+			taken = position;
+			MQTTYield(c, 0);
+		} while (position != taken);
+		break;
+	case PATH_POLL:
+		for (i = 0; i < 4 && MQTTPoll(c, NULL) < 0; ++i)
+			;
+		break;
+	case PATH_FEED:
+		do {
+			MQTTFeed(c, &stream[position], limit - position, &used);
+			position += used;
+		} while (used > 0 && position < limit);
+		break;
+	}
+}
+
+
+/**
+* Deliver the stream in pieces ending at each of the given boundaries and check what the client made of it.
+* @return 1 if the check passed, 0 otherwise
+*/
+static int check(Network* network, enum Stream which, enum Path path, int chunked, const int* boundaries, int count)
+{
+	static unsigned char sendbuf[128], readbuf[READBUF_SIZE];
+	MQTTClient c;
+	int i;
+
+	MQTTClientInit(&c, network, 1000, sendbuf, sizeof(sendbuf), readbuf, sizeof(readbuf));
+	c.isconnected = 1;
+	c.MQTTVersion = (which == STREAM_MQTT311) ? 4 : 5;
+	c.defaultMessageHandler = messageArrived;
+	if (chunked)
+		MQTTSetChunkHandler(&c, chunkArrived);
+	position = limit = 0;
+	delivered = wrongPayload = acks = chunkBytes = 0;
+	for (i = 0; i < count; ++i)
+		receive(&c, path, boundaries[i]);
+	return position == streamLen && delivered == 2 && wrongPayload == 0 && acks == 1 &&
+		(chunked && which != STREAM_MALFORMED ? chunkBytes == sizeof(bigPayload) && MQTTDropped(&c) == 0 :
+		chunkBytes == 0 && MQTTDropped(&c) == 1);
+}
+
+
+static unsigned long nextRandom(unsigned long* state)
+{
+	// xorshift, so a seed gives the same splits everywhere
+	*state ^= *state << 13;
+	*state ^= *state >> 7;
+	*state ^= *state << 17;
+	return *state;
+}
+
+
+/**
+* Split the stream into pieces of random length.
+* @param[in] state The random number generator state
+* @param[out] boundaries Set to the end of each piece
+* @return Number of pieces
+*/
+static int randomBoundaries(unsigned long* state, int* boundaries)
+{
+	int count = 0, end = 0;
+
+	while (end < streamLen) {
+		end += 1 + nextRandom(state) % MAX_PIECE;
+		boundaries[count++] = (end < streamLen) ? end : streamLen;
+	}
+	return count;
+}
+
+
+int main(int argc, char** argv)
+{
+	Network network;
+	int boundaries[sizeof(stream)];
+	int which, path, chunked, split, i, failures = 0, checks = 0;
+	unsigned long seed = (argc > 1) ? strtoul(argv[1], NULL, 0) : 1;
+
+	NetworkInit(&network);
+	network.mqttread = fakeRead;
+	network.mqttwrite = fakeWrite;
+	network.mqttwritev = NULL;
+	network.mqttpeek = fakePeek;
+	network.mqttskip = fakeSkip;
+
+	for (which = STREAM_MQTT311; which <= STREAM_MALFORMED; ++which) {
+		if (!buildStream((enum Stream)which)) {
+			printf("FAIL: building the %s stream\n", streamNames[which]);
+			return 1;
+		}
+		for (path = PATH_YIELD; path <= PATH_FEED; ++path) {
+			for (chunked = 0; chunked <= 1; ++chunked) {
+				// in two pieces, split at every byte boundary
+				for (split = 1; split < streamLen; ++split) {
+					boundaries[0] = split;
+					boundaries[1] = streamLen;
+					checks++;
+					if (!check(&network, (enum Stream)which, (enum Path)path, chunked, boundaries, 2)) {
+						printf("FAIL: %s %s%s split at byte %d of %d\n", streamNames[which], pathNames[path],
+							chunked ? " with chunks" : "", split, streamLen);
+						failures++;
+					}
+				}
+				// a byte at a time
+				for (i = 0; i < streamLen; ++i)
+					boundaries[i] = i + 1;
+				checks++;
+				if (!check(&network, (enum Stream)which, (enum Path)path, chunked, boundaries, streamLen)) {
+					printf("FAIL: %s %s%s a byte at a time\n", streamNames[which], pathNames[path],
+						chunked ? " with chunks" : "");
+					failures++;
+				}
+			}
+		}
+		printf("%s: %d byte stream checked at every split\n", streamNames[which], streamLen);
+	}
+	// random pieces, timed
+	buildStream(STREAM_MQTT311);
+	for (path = PATH_YIELD; path <= PATH_FEED; ++path) {
+		unsigned long state = seed ? seed : 1;
+		struct timespec start, end;
+		double seconds;
+		int run;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (run = 0; run < RANDOM_RUNS; ++run) {
+			int count = randomBoundaries(&state, boundaries);
+			checks++;
+			if (!check(&network, STREAM_MQTT311, (enum Path)path, 1, boundaries, count)) {
+				printf("FAIL: %s random pieces, run %d with seed %lu\n", pathNames[path], run, seed);
+				failures++;
+			}
+		}
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+		printf("%s random pieces of 1 to %d bytes, seed %lu: %d streams, %.1f MB/s, %.0f packets/s\n", pathNames[path],
+			MAX_PIECE, seed, RANDOM_RUNS, (double)RANDOM_RUNS * streamLen / seconds / 1e6, RANDOM_RUNS * 4 / seconds);
+	}
+	printf("%d of %d splits handled\n", checks - failures, checks);
+	if (failures > 0)
+		return 1;
+	printf("PASS\n");
+	return 0;
+}
@@ -0,0 +1,176 @@
+/*
+The MIT License(MIT)
+
+Cayenne MQTT Client Library
+Copyright (c) 2016 myDevices
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated
+documentation files(the "Software"), to deal in the Software without restriction, including without limitation
+the rights to use, copy, modify, merge, publish, distribute, sublicense, and / or sell copies of the Software,
+and to permit persons to whom the Software is furnished to do so, subject to the following conditions :
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+/*
+* Publishes from several threads while the MQTT_TASK thread waits for incoming data, and while the broker sends
+* messages to the client. Every publish must succeed and every message must arrive, and no publish may be held up by
+* the task thread's wait for data, which lasts up to 500 ms when the connection is idle.
+* See README.md in this directory for how to build and run it.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "MQTTClient.h"
+#include "TestBroker.h"
+
+#define PUBLISHERS 4
+#define PUBLISHES 200
+#define PUSHES 200
+#define MAX_LATENCY_MS 100
+
+typedef struct Publisher
+{
+	pthread_t thread;
+	int failures;
+	double maxLatencyMs[2]; /* slowest QoS0 and QoS1 publish */
+	double totalLatencyMs[2];
+} Publisher;
+
+static TestBroker broker;
+static Network network;
+static MQTTClient client;
+static unsigned char sendbuf[256], readbuf[256];
+static pthread_mutex_t arrivedLock = PTHREAD_MUTEX_INITIALIZER;
+static int arrived;
+
+
+static double nowMs(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000.0 + now.tv_nsec / 1000000.0;
+}
+
+
+static void sleepUs(long us)
+{
+	struct timespec pause = { 0, us * 1000 };
+	nanosleep(&pause, NULL);
+}
+
+
+static void messageArrived(MessageData* md, void* userData)
+{
+	pthread_mutex_lock(&arrivedLock);
+	arrived++;
+	pthread_mutex_unlock(&arrivedLock);
+}
+
+
+static int arrivedCount(void)
+{
+	int count;
+
+	pthread_mutex_lock(&arrivedLock);
+	count = arrived;
+	pthread_mutex_unlock(&arrivedLock);
+	return count;
+}
+
+
+static void* publish(void* arg)
+{
+	Publisher* publisher = (Publisher*)arg;
+	char payload[32];
+	int i;
+
+	for (i = 0; i < PUBLISHES; ++i) {
+		MQTTMessage message;
+		int qos = i % 2;
+		double start, latency;
+
+		memset(&message, 0, sizeof(message));
+		message.qos = (enum QoS)qos;
+		message.payloadlen = snprintf(payload, sizeof(payload), "%d", i);
+		message.payload = payload;
+		// leave the connection idle now and then, so the task thread is waiting for data when the publish starts
+		if (i % 10 == 0)
+			sleepUs(20000);
+		start = nowMs();
+		if (MQTTPublish(&client, "stress/out", &message) != MQTT_SUCCESS)
+			publisher->failures++;
+		latency = nowMs() - start;
+		publisher->totalLatencyMs[qos] += latency;
+		if (latency > publisher->maxLatencyMs[qos])
+			publisher->maxLatencyMs[qos] = latency;
+	}
+	return NULL;
+}
+
+
+int main(void)
+{
+	MQTTPacket_connectData options = MQTTPacket_connectData_initializer;
+	Publisher publishers[PUBLISHERS];
+	double maxLatencyMs[2] = { 0, 0 }, totalLatencyMs[2] = { 0, 0 };
+	int i, qos, failures = 0, waits;
+
+	memset(publishers, 0, sizeof(publishers));
+	if (!TestBrokerStart(&broker)) {
+		printf("FAIL: starting the broker\n");
+		return 1;
+	}
+	NetworkInit(&network);
+	MQTTClientInit(&client, &network, 2000, sendbuf, sizeof(sendbuf), readbuf, sizeof(readbuf));
+	client.defaultMessageHandler = messageArrived;
+	options.MQTTVersion = 4;
+	options.clientID.cstring = "stress";
+	if (!NetworkConnect(&network, "127.0.0.1", broker.port) || MQTTConnect(&client, &options) != MQTT_SUCCESS ||
+		MQTTStartTask(&client) != MQTT_SUCCESS) {
+		printf("FAIL: connecting\n");
+		return 1;
+	}
+
+	for (i = 0; i < PUBLISHERS; ++i)
+		pthread_create(&publishers[i].thread, NULL, publish, &publishers[i]);
+	// the broker sends to the client while the publishers run, in bursts with idle gaps between them
+	for (i = 0; i < PUSHES; ++i) {
+		if (!TestBrokerPublish(&broker, "stress/in", "message"))
+			failures++;
+		if (i % 10 == 9)
+			sleepUs(15000);
+	}
+	for (i = 0; i < PUBLISHERS; ++i) {
+		pthread_join(publishers[i].thread, NULL);
+		failures += publishers[i].failures;
+		for (qos = 0; qos < 2; ++qos) {
+			totalLatencyMs[qos] += publishers[i].totalLatencyMs[qos];
+			if (publishers[i].maxLatencyMs[qos] > maxLatencyMs[qos])
+				maxLatencyMs[qos] = publishers[i].maxLatencyMs[qos];
+		}
+	}
+	for (waits = 0; waits < 200 && (arrivedCount() < PUSHES || TestBrokerPublishes(&broker) < PUBLISHERS * PUBLISHES); ++waits)
+		sleepUs(10000);
+
+	for (qos = 0; qos < 2; ++qos)
+		printf("QoS%d publish: mean %.3f ms, max %.3f ms\n", qos, totalLatencyMs[qos] / (PUBLISHERS * PUBLISHES / 2),
+			maxLatencyMs[qos]);
+	printf("%lu of %d publishes reached the broker, %d of %d messages arrived, %d failures\n",
+		TestBrokerPublishes(&broker), PUBLISHERS * PUBLISHES, arrivedCount(), PUSHES, failures);
+	if (failures > 0 || arrivedCount() != PUSHES || TestBrokerPublishes(&broker) != PUBLISHERS * PUBLISHES) {
+		printf("FAIL: lost publishes or messages\n");
+		return 1;
+	}
+	if (maxLatencyMs[0] > MAX_LATENCY_MS || maxLatencyMs[1] > MAX_LATENCY_MS) {
+		printf("FAIL: a publish waited on the task thread\n");
+		return 1;
+	}
+	printf("PASS\n");
+	return 0;
+}
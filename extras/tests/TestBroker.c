@@ -0,0 +1,224 @@
+/*
+The MIT License(MIT)
+
+Cayenne MQTT Client Library
+Copyright (c) 2016 myDevices
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated
+documentation files(the "Software"), to deal in the Software without restriction, including without limitation
+the rights to use, copy, modify, merge, publish, distribute, sublicense, and / or sell copies of the Software,
+and to permit persons to whom the Software is furnished to do so, subject to the following conditions :
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include "TestBroker.h"
+
+typedef struct TestConnection
+{
+	TestBroker* broker;
+	int sock;
+} TestConnection;
+
+
+static int broker_recv(int sock, unsigned char* buffer, int len)
+{
+	int got = 0;
+
+	while (got < len) {
+		ssize_t rc = recv(sock, buffer + got, len - got, 0);
+		if (rc <= 0)
+			return 0;
+		got += rc;
+	}
+	return 1;
+}
+
+
+static int broker_send(TestBroker* broker, int sock, const unsigned char* buffer, int len)
+{
+	int rc;
+
+	pthread_mutex_lock(&broker->lock);
+	rc = send(sock, buffer, len, MSG_NOSIGNAL) == len;
+	pthread_mutex_unlock(&broker->lock);
+	return rc;
+}
+
+
+static int broker_ack(TestBroker* broker, int sock, unsigned char type, const unsigned char* id)
+{
+	unsigned char ack[4] = { type, 2, id[0], id[1] };
+	return broker_send(broker, sock, ack, sizeof(ack));
+}
+
+
+static void* broker_connection(void* arg)
+{
+	TestConnection* connection = (TestConnection*)arg;
+	TestBroker* broker = connection->broker;
+	int sock = connection->sock;
+	unsigned char* body = NULL;
+
+	free(connection);
+	while (1) {
+		unsigned char header, byte;
+		int len = 0, multiplier = 1, qos;
+
+		if (!broker_recv(sock, &header, 1))
+			break;
+		do {
+			if (!broker_recv(sock, &byte, 1))
+				goto exit;
+			len += (byte & 127) * multiplier;
+			multiplier *= 128;
+		} while (byte & 128);
+		body = realloc(body, len + 1);
+		if (!broker_recv(sock, body, len))
+			break;
+		pthread_mutex_lock(&broker->lock);
+		broker->packets++;
+		if (header >> 4 == 3)
+			broker->publishes++;
+		pthread_mutex_unlock(&broker->lock);
+
+		switch (header >> 4) {
+		case 1: {
+			unsigned char connack[4] = { 0x20, 2, 0, 0 };
+			broker_send(broker, sock, connack, sizeof(connack));
+			break;
+		}
+		case 3:
+			qos = (header >> 1) & 3;
+			if (qos > 0) {
+				int topiclen = body[0] * 256 + body[1];
+				broker_ack(broker, sock, qos == 1 ? 0x40 : 0x50, &body[2 + topiclen]);
+			}
+			break;
+		case 6:
+			broker_ack(broker, sock, 0x70, body);
+			break;
+		case 8: {
+			unsigned char suback[2 + 2 + 16];
+			int i = 2, count = 0;
+			while (i < len && count < 16) {
+				i += 2 + body[i] * 256 + body[i + 1];
+				suback[4 + count++] = body[i++];
+			}
+			suback[0] = 0x90;
+			suback[1] = 2 + count;
+			suback[2] = body[0];
+			suback[3] = body[1];
+			broker_send(broker, sock, suback, 4 + count);
+			break;
+		}
+		case 10:
+			broker_ack(broker, sock, 0xb0, body);
+			break;
+		case 12: {
+			unsigned char pingresp[2] = { 0xd0, 0 };
+			broker_send(broker, sock, pingresp, sizeof(pingresp));
+			break;
+		}
+		case 14:
+			goto exit;
+		}
+	}
+exit:
+	free(body);
+	pthread_mutex_lock(&broker->lock);
+	if (broker->client == sock)
+		broker->client = -1;
+	close(sock);
+	pthread_mutex_unlock(&broker->lock);
+	return NULL;
+}
+
+
+static void* broker_accept(void* arg)
+{
+	TestBroker* broker = (TestBroker*)arg;
+
+	while (1) {
+		pthread_t thread;
+		int one = 1;
+		TestConnection* connection;
+		int sock = accept(broker->listener, NULL, NULL);
+		if (sock < 0)
+			break;
+		setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		connection = (TestConnection*)malloc(sizeof(TestConnection));
+		connection->broker = broker;
+		connection->sock = sock;
+		pthread_mutex_lock(&broker->lock);
+		broker->client = sock;
+		pthread_mutex_unlock(&broker->lock);
+		if (pthread_create(&thread, NULL, broker_connection, connection) == 0)
+			pthread_detach(thread);
+	}
+	return NULL;
+}
+
+
+int TestBrokerStart(TestBroker* broker)
+{
+	struct sockaddr_in address;
+	socklen_t length = sizeof(address);
+	int one = 1;
+
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	broker->client = -1;
+	broker->publishes = broker->packets = 0;
+	pthread_mutex_init(&broker->lock, NULL);
+	if ((broker->listener = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+		return 0;
+	setsockopt(broker->listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	if (bind(broker->listener, (struct sockaddr*)&address, sizeof(address)) < 0 || listen(broker->listener, 64) < 0 ||
+		getsockname(broker->listener, (struct sockaddr*)&address, &length) < 0)
+		return 0;
+	broker->port = ntohs(address.sin_port);
+	return pthread_create(&broker->thread, NULL, broker_accept, broker) == 0;
+}
+
+
+int TestBrokerPublish(TestBroker* broker, const char* topic, const char* payload)
+{
+	unsigned char packet[256];
+	int topiclen = strlen(topic), payloadlen = strlen(payload), len = 2 + topiclen + payloadlen, rc;
+
+	if (len > 127)
+		return 0;
+	packet[0] = 0x30;
+	packet[1] = len;
+	packet[2] = topiclen >> 8;
+	packet[3] = topiclen & 0xff;
+	memcpy(&packet[4], topic, topiclen);
+	memcpy(&packet[4 + topiclen], payload, payloadlen);
+	pthread_mutex_lock(&broker->lock);
+	rc = broker->client >= 0 && send(broker->client, packet, 2 + len, MSG_NOSIGNAL) == 2 + len;
+	pthread_mutex_unlock(&broker->lock);
+	return rc;
+}
+
+
+unsigned long TestBrokerPublishes(TestBroker* broker)
+{
+	unsigned long count;
+
+	pthread_mutex_lock(&broker->lock);
+	count = broker->publishes;
+	pthread_mutex_unlock(&broker->lock);
+	return count;
+}
@@ -0,0 +1,70 @@
+/*
+The MIT License(MIT)
+
+Cayenne MQTT Client Library
+Copyright (c) 2016 myDevices
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated
+documentation files(the "Software"), to deal in the Software without restriction, including without limitation
+the rights to use, copy, modify, merge, publish, distribute, sublicense, and / or sell copies of the Software,
+and to permit persons to whom the Software is furnished to do so, subject to the following conditions :
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef _TESTBROKER_h
+#define _TESTBROKER_h
+
+#include <pthread.h>
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+	/**
+	* A minimal MQTT 3.1.1 broker on the loopback interface, for the host checks in this directory. It acknowledges
+	* CONNECT, SUBSCRIBE, QoS1 and QoS2 publishes and pings, and can push QoS0 publishes to the last client that
+	* connected. It doesn't route messages between clients.
+	*/
+	typedef struct TestBroker
+	{
+		int listener; /**< The listening socket. */
+		int port; /**< The port it listens on, picked by the kernel. */
+		int client; /**< Socket of the last client that connected, -1 if none. */
+		pthread_t thread; /**< Thread accepting connections. */
+		pthread_mutex_t lock; /**< Guards the counters and writes to client sockets. */
+		unsigned long publishes; /**< Number of PUBLISH packets received from clients. */
+		unsigned long packets; /**< Number of packets received from clients. */
+	} TestBroker;
+
+	/**
+	* Start the broker on a free loopback port.
+	* @param[in] broker Pointer to the TestBroker struct
+	* @return 1 if successful, 0 otherwise
+	*/
+	int TestBrokerStart(TestBroker* broker);
+
+	/**
+	* Send a QoS0 PUBLISH to the last client that connected.
+	* @param[in] broker Pointer to the TestBroker struct
+	* @param[in] topic Topic of the message
+	* @param[in] payload Payload of the message
+	* @return 1 if it was sent, 0 otherwise
+	*/
+	int TestBrokerPublish(TestBroker* broker, const char* topic, const char* payload);
+
+	/**
+	* Get the number of PUBLISH packets received from clients so far.
+	* @param[in] broker Pointer to the TestBroker struct
+	* @return Number of publishes
+	*/
+	unsigned long TestBrokerPublishes(TestBroker* broker);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif
@@ -0,0 +1,279 @@
+/*
+The MIT License(MIT)
+
+Cayenne MQTT Client Library
+Copyright (c) 2016 myDevices
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated
+documentation files(the "Software"), to deal in the Software without restriction, including without limitation
+the rights to use, copy, modify, merge, publish, distribute, sublicense, and / or sell copies of the Software,
+and to permit persons to whom the Software is furnished to do so, subject to the following conditions :
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+/*
+* Measures the system calls and CPU time the client needs per published message, with every client on epoll and then
+* with every client attached to one NetworkUring. System calls are counted by wrapping the libc functions the
+* transport calls, on the publishing thread only, so the broker's calls aren't counted. CPU time is the publishing
+* thread's, plus that of any io_uring worker threads. A gateway publishing one message on each of its clients per
+* round should need far less than one call per message on the ring.
+* See README.md in this directory for how to build and run it.
+*/
+
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <dlfcn.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include "CayenneMQTTClient.h"
+#include "TestBroker.h"
+
+#define CLIENTS 8
+#define ROUNDS 2500
+
+static TestBroker broker;
+static Network networks[CLIENTS];
+static CayenneMQTTClient clients[CLIENTS];
+static __thread int counting; /* set on the publishing thread while it is measured */
+static unsigned long calls;
+
+
+#define COUNT_CALL() do { if (counting) calls++; } while (0)
+
+ssize_t send(int sock, const void* buffer, size_t len, int flags)
+{
+	static ssize_t (*real)(int, const void*, size_t, int);
+	COUNT_CALL();
+	if (!real)
+		real = (ssize_t (*)(int, const void*, size_t, int))dlsym(RTLD_NEXT, "send");
+	return real(sock, buffer, len, flags);
+}
+
+
+ssize_t sendmsg(int sock, const struct msghdr* msg, int flags)
+{
+	static ssize_t (*real)(int, const struct msghdr*, int);
+	COUNT_CALL();
+	if (!real)
+		real = (ssize_t (*)(int, const struct msghdr*, int))dlsym(RTLD_NEXT, "sendmsg");
+	return real(sock, msg, flags);
+}
+
+
+ssize_t recv(int sock, void* buffer, size_t len, int flags)
+{
+	static ssize_t (*real)(int, void*, size_t, int);
+	COUNT_CALL();
+	if (!real)
+		real = (ssize_t (*)(int, void*, size_t, int))dlsym(RTLD_NEXT, "recv");
+	return real(sock, buffer, len, flags);
+}
+
+
+int epoll_wait(int epfd, struct epoll_event* events, int maxevents, int timeout)
+{
+	static int (*real)(int, struct epoll_event*, int, int);
+	COUNT_CALL();
+	if (!real)
+		real = (int (*)(int, struct epoll_event*, int, int))dlsym(RTLD_NEXT, "epoll_wait");
+	return real(epfd, events, maxevents, timeout);
+}
+
+
+int epoll_ctl(int epfd, int op, int fd, struct epoll_event* event)
+{
+	static int (*real)(int, int, int, struct epoll_event*);
+	COUNT_CALL();
+	if (!real)
+		real = (int (*)(int, int, int, struct epoll_event*))dlsym(RTLD_NEXT, "epoll_ctl");
+	return real(epfd, op, fd, event);
+}
+
+
+int poll(struct pollfd* fds, nfds_t nfds, int timeout)
+{
+	static int (*real)(struct pollfd*, nfds_t, int);
+	COUNT_CALL();
+	if (!real)
+		real = (int (*)(struct pollfd*, nfds_t, int))dlsym(RTLD_NEXT, "poll");
+	return real(fds, nfds, timeout);
+}
+
+
+long syscall(long number, ...)
+{
+	static long (*real)(long, ...);
+	long args[6];
+	va_list ap;
+	int i;
+
+	COUNT_CALL();
+	if (!real)
+		real = (long (*)(long, ...))dlsym(RTLD_NEXT, "syscall");
+	va_start(ap, number);
+	for (i = 0; i < 6; ++i)
+		args[i] = va_arg(ap, long);
+	va_end(ap);
+	return real(number, args[0], args[1], args[2], args[3], args[4], args[5]);
+}
+
+
+/**
+* Get the CPU time used by the calling thread and by any io_uring worker threads of the process.
+* @return CPU time in seconds
+*/
+static double cpuSeconds(void)
+{
+	struct rusage usage;
+	double seconds = 0;
+	DIR* tasks;
+	struct dirent* task;
+
+	getrusage(RUSAGE_THREAD, &usage);
+	seconds = usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+	if ((tasks = opendir("/proc/self/task")) == NULL)
+		return seconds;
+	while ((task = readdir(tasks)) != NULL) {
+		char path[300], stat[512];
+		unsigned long utime, stime;
+		FILE* file;
+		char* fields;
+		snprintf(path, sizeof(path), "/proc/self/task/%s/stat", task->d_name);
+		if (task->d_name[0] == '.' || (file = fopen(path, "r")) == NULL)
+			continue;
+		// the thread name is in parentheses, utime and stime are the 12th and 13th fields after it
+		if (fgets(stat, sizeof(stat), file) && strstr(stat, "(iou-") && (fields = strrchr(stat, ')')) &&
+			sscanf(fields + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) == 2)
+			seconds += (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+		fclose(file);
+	}
+	closedir(tasks);
+	return seconds;
+}
+
+
+static int connectClients(NetworkUring* uring)
+{
+	int i;
+
+	for (i = 0; i < CLIENTS; ++i) {
+		NetworkInit(&networks[i]);
+		if (uring && !NetworkUringAttach(uring, &networks[i]))
+			return 0;
+		if (!NetworkConnect(&networks[i], "127.0.0.1", broker.port))
+			return 0;
+		CayenneMQTTClientInit(&clients[i], &networks[i], "user", "pass", "client", NULL);
+		if (CayenneMQTTConnect(&clients[i]) != MQTT_SUCCESS)
+			return 0;
+	}
+	return 1;
+}
+
+
+static void disconnectClients(void)
+{
+	int i;
+
+	for (i = 0; i < CLIENTS; ++i) {
+		CayenneMQTTDisconnect(&clients[i]);
+		NetworkDisconnect(&networks[i]);
+		if (networks[i].uring)
+			NetworkUringDetach(&networks[i]);
+	}
+}
+
+
+/**
+* Publish one message per client per round and wait for the broker to have them all.
+* @param[in] uring The ring the clients are attached to, NULL for epoll
+* @param[out] syscalls Set to the number of system calls made for the publishes, including waiting for them to be sent
+* @param[out] seconds Set to the CPU time used for the publishes
+* @return 1 if every message arrived, 0 otherwise
+*/
+static int publishRounds(NetworkUring* uring, unsigned long* syscalls, double* seconds)
+{
+	unsigned long before = TestBrokerPublishes(&broker);
+	double start = cpuSeconds();
+	int round, i, waits;
+
+	calls = 0;
+	counting = 1;
+	for (round = 0; round < ROUNDS; ++round) {
+		for (i = 0; i < CLIENTS; ++i) {
+			if (CayenneMQTTPublishDataInt(&clients[i], NULL, DATA_TOPIC, 1, TYPE_TEMPERATURE, UNIT_CELSIUS, round) < 0) {
+				counting = 0;
+				return 0;
+			}
+		}
+		if (uring)
+			NetworkUringSubmit(uring, 0);
+	}
+	// on the ring, reaping the send completions is part of the cost, so keep counting while waiting for them
+	for (waits = 0; waits < 200 && TestBrokerPublishes(&broker) - before < CLIENTS * ROUNDS; ++waits) {
+		struct timespec pause = { 0, 10000000 };
+		if (uring)
+			NetworkUringSubmit(uring, 10);
+		else
+			nanosleep(&pause, NULL);
+	}
+	counting = 0;
+	*syscalls = calls;
+	*seconds = cpuSeconds() - start;
+	return TestBrokerPublishes(&broker) - before == CLIENTS * ROUNDS;
+}
+
+
+static void report(const char* name, unsigned long syscalls, double seconds)
+{
+	const int messages = CLIENTS * ROUNDS;
+
+	printf("%s: %d messages, %lu system calls, %.3f calls per message, %.3f s CPU, %.0f messages per second per core\n",
+		name, messages, syscalls, (double)syscalls / messages, seconds, seconds > 0 ? messages / seconds : 0);
+}
+
+
+int main(void)
+{
+	NetworkUring uring;
+	unsigned long epollCalls = 0, uringCalls = 0;
+	double epollSeconds = 0, uringSeconds = 0;
+
+	if (!TestBrokerStart(&broker) || !NetworkUringInit(&uring, CLIENTS)) {
+		printf("FAIL: setup\n");
+		return 1;
+	}
+
+	if (!connectClients(NULL) || !publishRounds(NULL, &epollCalls, &epollSeconds)) {
+		printf("FAIL: epoll publishes\n");
+		return 1;
+	}
+	disconnectClients();
+	report("epoll", epollCalls, epollSeconds);
+
+	if (!connectClients(&uring) || !publishRounds(&uring, &uringCalls, &uringSeconds)) {
+		printf("FAIL: io_uring publishes\n");
+		return 1;
+	}
+	disconnectClients();
+	report("io_uring", uringCalls, uringSeconds);
+	printf("io_uring read buffers registered: %d\n", uring.registered);
+	NetworkUringFree(&uring);
+
+	if (uringCalls * 4 > epollCalls) {
+		printf("FAIL: io_uring made more than a quarter of the system calls epoll did\n");
+		return 1;
+	}
+	printf("PASS\n");
+	return 0;
+}
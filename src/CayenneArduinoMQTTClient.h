@@ -23,6 +23,23 @@ ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEAL
 
 const int MAX_CHANNEL_ARRAY_SIZE = 4;
 
+/**
+* A broker the client can connect to, with the health measurements used to choose between brokers.
+* Latencies and the failure rate are moving averages, so recent connects count the most.
+*/
+struct CayenneEndpoint
+{
+	const char* host; /**< Broker host name or address. */
+	int port; /**< Broker port. */
+	unsigned long connectMs; /**< Average time to open the network connection, in milliseconds. */
+	unsigned long rttMs; /**< Average time from sending MQTT CONNECT to receiving CONNACK, in milliseconds. */
+	unsigned int failureRate; /**< Average share of connects that failed or connections that dropped, in parts per thousand. */
+	unsigned int attempts; /**< Number of connects made. */
+	unsigned int failures; /**< Number of connects that failed. */
+	unsigned int failStreak; /**< Number of consecutive connect failures. */
+	unsigned long downUntil; /**< millis() time until which the endpoint is skipped, valid while failStreak is not 0. */
+};
+
 void CayenneMessageArrived(CayenneMessageData* message);
 
 class CayenneArduinoMQTTClient
@@ -40,59 +57,152 @@ public:
 	* @param username Cayenne username
 	* @param password Cayenne password
 	* @param clientID Cayennne client ID
-	* @param chunkSize Size of chunks to use when writing the send buffer to the client, 0 to just send the full buffer.
+	* @param chunkSize Initial size of chunks to use when writing the send buffer to the client, 0 to just send the full buffer.
+	* The size adapts to what the client accepts, see getWriteChunkSize.
+	* @param port Cayenne port, CAYENNE_TLS_PORT if the client is a TLS client.
+	* If endpoints were added with addEndpoint before begin, they are used instead of CAYENNE_DOMAIN and port.
 	*/
-	void begin(Client& client, const char* username, const char* password, const char* clientID, int chunkSize = 0) {
+	void begin(Client& client, const char* username, const char* password, const char* clientID, int chunkSize = 0, int port = CAYENNE_PORT) {
+		if (_endpointCount == 0)
+			addEndpoint(CAYENNE_DOMAIN, port);
 		NetworkInit(&_network, &client, chunkSize);
+#if defined(CAYENNE_TLS)
+		// TLS clients need the host name for SNI and certificate checks, so don't connect them by cached address.
+		_network.addressTTL = 0;
+#endif
 		CayenneMQTTClientInit(&_mqttClient, &_network, username, password, clientID, CayenneMessageArrived);
+		_state = CAYENNE_STATE_DISCONNECTED;
+		_stateSince = millis();
+		_endpoint = -1;
+		_subscribed = false;
+		_deviceInfoSent = false;
+		_subscribeFailed = false;
+		_readyMs = 0;
+		TimerInit(&_retryTimer);
+		TimerInit(&_pollTimer);
+		TimerCountdownMS(&_pollTimer, 0); // poll the channels on the first loop
 		connect();
 	}
 
 	/**
-	* Connects to Cayenne
+	* Connects to Cayenne. One attempt is made right away, if it fails further attempts are made from loop()
+	* with an exponential backoff, so the caller is never blocked for longer than a single attempt.
 	*/
 	void connect() {
-		CAYENNE_LOG("Connecting to %s:%d", CAYENNE_DOMAIN, CAYENNE_PORT);
-		int error = MQTT_FAILURE;
-		do {
-			if (!NetworkConnect(&_network, CAYENNE_DOMAIN, CAYENNE_PORT)) {
-				CAYENNE_LOG("Network connect failed");
-				delay(1000);
-			}
-			else if ((error = CayenneMQTTConnect(&_mqttClient)) != MQTT_SUCCESS) {
-				CAYENNE_LOG("MQTT connect failed, error %d", error);
-				NetworkDisconnect(&_network);
-				delay(1000);
-			}
-		}
-		while (error != MQTT_SUCCESS);
+		_attempt = 0;
+		attemptConnect();
+	}
 
-		CAYENNE_LOG("Connected");
-		CayenneConnected();
-		CayenneMQTTSubscribe(&_mqttClient, NULL, COMMAND_TOPIC, CAYENNE_ALL_CHANNELS, NULL);
-#ifdef DIGITAL_AND_ANALOG_SUPPORT
-		CayenneMQTTSubscribe(&_mqttClient, NULL, DIGITAL_COMMAND_TOPIC, CAYENNE_ALL_CHANNELS, NULL);
-		CayenneMQTTSubscribe(&_mqttClient, NULL, DIGITAL_CONFIG_TOPIC, CAYENNE_ALL_CHANNELS, NULL);
-		CayenneMQTTSubscribe(&_mqttClient, NULL, ANALOG_COMMAND_TOPIC, CAYENNE_ALL_CHANNELS, NULL);
-		CayenneMQTTSubscribe(&_mqttClient, NULL, ANALOG_CONFIG_TOPIC, CAYENNE_ALL_CHANNELS, NULL);
-#endif
-		publishDeviceInfo();
+	/**
+	* Add a broker endpoint to fail over to. The healthiest endpoint, going by connect latency, round trip time and
+	* failure rate, is tried first, and an endpoint that failed is skipped for CAYENNE_ENDPOINT_HOLDDOWN_MS.
+	* @param host Broker host name or address, the string must stay valid while the client is in use
+	* @param port Broker port
+	* @return true if the endpoint was added, false if CAYENNE_MAX_ENDPOINTS endpoints were already added
+	*/
+	bool addEndpoint(const char* host, int port) {
+		if (_endpointCount >= CAYENNE_MAX_ENDPOINTS)
+			return false;
+		CayenneEndpoint& endpoint = _endpoints[_endpointCount++];
+		memset(&endpoint, 0, sizeof(endpoint));
+		endpoint.host = host;
+		endpoint.port = port;
+		return true;
+	}
+
+	/**
+	* Get the number of broker endpoints.
+	* @return Number of endpoints
+	*/
+	unsigned int getEndpointCount() {
+		return _endpointCount;
+	}
+
+	/**
+	* Get a broker endpoint and its health measurements.
+	* @param index Endpoint index, in the order the endpoints were added
+	* @return The endpoint
+	*/
+	const CayenneEndpoint& getEndpoint(unsigned int index) {
+		return _endpoints[index];
+	}
+
+	/**
+	* Get the endpoint used by the current or last connection.
+	* @return Endpoint index, or -1 if no connection has been made
+	*/
+	int getCurrentEndpoint() {
+		return _endpoint;
+	}
+
+	/**
+	* Get the connection state.
+	* @return The current state
+	*/
+	CayenneConnectionState getState() {
+		return _state;
+	}
+
+	/**
+	* Get how long the last connection took to become ready, from starting to connect to the server acknowledging
+	* the subscriptions.
+	* @return Time in milliseconds, 0 if the connection isn't ready yet
+	*/
+	unsigned long getTimeToReady() {
+		return _readyMs;
+	}
+
+	/**
+	* Get the time until loop() next has something to do: a keepalive ping, a resend, a timeout, polling the virtual
+	* channels or a reconnect attempt. Apart from messages arriving, nothing is missed by sleeping this long before
+	* calling loop() again.
+	* @return Time in milliseconds, 0 if loop() should be called now
+	*/
+	int getNextDeadline() {
+		if (_state == CAYENNE_STATE_WAITING)
+			return TimerLeftMS(&_retryTimer);
+		if (_state != CAYENNE_STATE_CONNECTED)
+			return 0;
+		int nextMs = CayenneMQTTNextDeadline(&_mqttClient);
+		int pollMs = TimerLeftMS(&_pollTimer);
+		return (pollMs < nextMs) ? pollMs : nextMs;
 	}
 
 	/**
 	* Main Cayenne loop
 	*
 	* @param yieldTime  Time in milliseconds to yield to allow processing of incoming MQTT messages and keep alive packets.
+	* Messages are handled as they arrive and the rest of the time is spent sleeping, 0 handles the messages that have
+	* already arrived and returns straight away.
 	* NOTE: Decreasing the yieldTime while calling write functions (e.g. virtualWrite) in your main loop could cause a 
 	* large number of messages to be sent to the Cayenne server. Use caution when adjusting this because sending too many 
 	* messages could cause your IP to be rate limited or even blocked. If you would like to reduce the yieldTime to cause your 
 	* main loop to run faster, make sure you use a timer for your write functions to prevent them from running too often. 
 	*/
 	void loop(int yieldTime = 1000) {
-		CayenneMQTTYield(&_mqttClient, yieldTime);
-		static unsigned long lastPoll = millis() - 15000;
-		if (millis() - lastPoll > 15000) {
-			lastPoll = millis();
+		if (_state != CAYENNE_STATE_CONNECTED) {
+			// Return straight away while waiting to reconnect so the application can keep running.
+			if (_state == CAYENNE_STATE_WAITING && TimerIsExpired(&_retryTimer))
+				attemptConnect();
+			return;
+		}
+
+		// Send the data published by the message and channel handlers together instead of one write per value.
+		CayenneMQTTCork(&_mqttClient);
+		// Sleep until data arrives or the client has something to do, rather than blocking in a read for the whole time.
+		unsigned long start = millis();
+		int nextMs = 0;
+		while (CayenneMQTTPoll(&_mqttClient, &nextMs) >= 0 && CayenneMQTTConnected(&_mqttClient)) {
+			long left = yieldTime - (long)(millis() - start);
+			if (left <= 0 || TimerIsExpired(&_pollTimer))
+				break;
+			unsigned char* data;
+			long wait = (left < nextMs) ? left : nextMs;
+			int pollMs = TimerLeftMS(&_pollTimer);
+			_network.mqttpeek(&_network, &data, (pollMs < wait) ? pollMs : wait);
+		}
+		if (TimerIsExpired(&_pollTimer)) {
+			TimerCountdownMS(&_pollTimer, 15000);
 			pollVirtualChannels();
 		}
 		
@@ -100,13 +210,18 @@ public:
 		pollChannels(digitalChannels);
 		pollChannels(analogChannels);
 #endif
-		if (!NetworkConnected(&_network) || !CayenneMQTTConnected(&_mqttClient))
+		CayenneMQTTUncork(&_mqttClient);
+		if (!NetworkConnected(&_network) || !CayenneMQTTConnected(&_mqttClient) || _subscribeFailed)
 		{
 			CayenneMQTTDisconnect(&_mqttClient);
 			NetworkDisconnect(&_network);
 			CayenneDisconnected();
 			CAYENNE_LOG("Disconnected");
-			connect();
+			// A dropped connection counts against the endpoint, so one that keeps dropping loses its preference.
+			_endpoints[_endpoint].failureRate = average(_endpoints[_endpoint].failureRate, 1000, false);
+			// Wait a random time before the first attempt too, so devices dropped together don't reconnect together.
+			_attempt = 0;
+			scheduleRetry();
 		}
 #ifdef CAYENNE_DEBUG
 		else
@@ -120,14 +235,65 @@ public:
 #endif
 	}
 
+	/**
+	* Make writes return without waiting on the network. Data that can't be queued in the transmit buffer is dropped,
+	* so check writable() before writing to drop or combine samples instead.
+	* @param nonblocking true to enable non-blocking mode, false to disable it
+	*/
+	void setNonBlocking(bool nonblocking) {
+		CayenneMQTTSetNonBlocking(&_mqttClient, nonblocking);
+	}
+
+	/**
+	* Get the room left in the transmit buffer.
+	* @return Number of bytes that can be written without blocking
+	*/
+	size_t writable() {
+		return CayenneMQTTWritable(&_mqttClient);
+	}
+
+	/**
+	* Get the amount of data waiting to be sent.
+	* @return Number of bytes waiting in the transmit buffer
+	*/
+	size_t queueDepth() {
+		return CayenneMQTTQueueDepth(&_mqttClient);
+	}
+
+	/**
+	* Get the chunk size currently used when writing to the client.
+	* @return Chunk size in bytes, 0 if data is not being sent in chunks
+	*/
+	int getWriteChunkSize() {
+		return _network.chunkSize;
+	}
+
+	/**
+	* Get the number of writes the client did not accept in full.
+	* @return Number of short writes since begin was called
+	*/
+	unsigned long getShortWrites() {
+		return _network.stats.partialWrites + _network.stats.zeroWrites;
+	}
+
+	/**
+	* Get the I/O counters for the network connection.
+	* @param stats Receives a copy of the counters
+	*/
+	void getNetworkStats(NetworkStats& stats) {
+		NetworkGetStats(&_network, &stats);
+	}
+
 	/**
 	* Send device info
 	*/
 	void publishDeviceInfo() {
+		CayenneMQTTCork(&_mqttClient);
 		publishData(SYS_MODEL_TOPIC, CAYENNE_NO_CHANNEL, CAYENNE_FLASH(INFO_DEVICE));
 		publishData(SYS_CPU_MODEL_TOPIC, CAYENNE_NO_CHANNEL, CAYENNE_FLASH(INFO_CPU));
 		publishData(SYS_CPU_SPEED_TOPIC, CAYENNE_NO_CHANNEL, F_CPU);
 		publishData(SYS_VERSION_TOPIC, CAYENNE_NO_CHANNEL, CAYENNE_FLASH(CAYENNE_VERSION));
+		CayenneMQTTUncork(&_mqttClient);
     }
 
 	/**
@@ -438,8 +604,233 @@ private:
 	}
 #endif
 
+	/**
+	* Make one attempt to connect, scheduling a retry if it fails. Endpoints are tried from the healthiest down, so a
+	* dead endpoint fails over to the next one straight away instead of waiting for the retry.
+	*/
+	void attemptConnect() {
+		bool tried[CAYENNE_MAX_ENDPOINTS] = { false };
+		int index;
+		_connectStart = millis();
+		_attempt++;
+		setState(CAYENNE_STATE_CONNECTING);
+		while ((index = pickEndpoint(tried)) >= 0) {
+			tried[index] = true;
+			if (connectEndpoint(index))
+				break;
+		}
+		if (index < 0) {
+			scheduleRetry();
+			return;
+		}
+
+		setState(CAYENNE_STATE_CONNECTED);
+		_attempt = 0;
+		CAYENNE_LOG("Connected");
+		CayenneConnected();
+		_readyMs = 0;
+		_subscribeFailed = false;
+		// Send the subscriptions and the device info in one write right after the CONNACK, the SUBACKs are picked up
+		// by loop() as they arrive. A resumed session still has what was acknowledged on the last connection, and the
+		// device info doesn't change while the sketch runs, so the parts the server already has are skipped.
+		bool resumed = CayenneMQTTSessionPresent(&_mqttClient);
+		CayenneMQTTCork(&_mqttClient);
+		if (!resumed || !_subscribed) {
+			static const CayenneTopic topics[] = { COMMAND_TOPIC,
+#ifdef DIGITAL_AND_ANALOG_SUPPORT
+				DIGITAL_COMMAND_TOPIC, DIGITAL_CONFIG_TOPIC, ANALOG_COMMAND_TOPIC, ANALOG_CONFIG_TOPIC,
+#endif
+			};
+			_subscribed = false;
+			if (CayenneMQTTSubscribeAsync(&_mqttClient, NULL, topics, sizeof(topics) / sizeof(topics[0]), CAYENNE_ALL_CHANNELS, subscribed, this) != CAYENNE_SUCCESS)
+				_subscribeFailed = true;
+		}
+		if (!resumed || !_deviceInfoSent) {
+			publishDeviceInfo();
+			_deviceInfoSent = true;
+		}
+		CayenneMQTTUncork(&_mqttClient);
+		if (_subscribed)
+			ready();
+	}
+
+	/**
+	* Handle the acknowledgement of the subscriptions made on connecting.
+	* @param result MQTT_SUCCESS if all the subscriptions were made
+	* @param context The client object
+	*/
+	static void subscribed(int result, void* context) {
+		CayenneArduinoMQTTClient* client = (CayenneArduinoMQTTClient*)context;
+		if (result != MQTT_SUCCESS) {
+			// Without the subscriptions no commands arrive, so loop() drops the connection to try again.
+			CAYENNE_LOG("Subscribe failed, error %d", result);
+			client->_subscribeFailed = true;
+		}
+		else if (!client->_subscribeFailed) {
+			client->_subscribed = true;
+			client->ready();
+		}
+	}
+
+	/**
+	* Record how long the connection took to become ready.
+	*/
+	void ready() {
+		_readyMs = millis() - _connectStart;
+		if (_readyMs == 0)
+			_readyMs = 1; // 0 means not ready
+		CAYENNE_LOG("Ready in %lu ms", _readyMs);
+	}
+
+	/**
+	* Choose the next endpoint to try. Endpoints that failed recently are skipped, unless every endpoint has, in
+	* which case the first try of an attempt goes to the one whose hold down ends first.
+	* @param tried Endpoints already tried in this attempt
+	* @return Endpoint index, or -1 if there is nothing left to try
+	*/
+	int pickEndpoint(const bool tried[]) {
+		unsigned long now = millis();
+		bool first = true;
+		int best = -1;
+		int soonest = -1;
+		for (unsigned int i = 0; i < _endpointCount; ++i) {
+			if (tried[i]) {
+				first = false;
+				continue;
+			}
+			const CayenneEndpoint& endpoint = _endpoints[i];
+			if (endpoint.failStreak && (long)(now - endpoint.downUntil) < 0) {
+				if (soonest < 0 || (long)(endpoint.downUntil - _endpoints[soonest].downUntil) < 0)
+					soonest = i;
+				continue;
+			}
+			if (best < 0 || endpointScore(endpoint) < endpointScore(_endpoints[best]))
+				best = i;
+		}
+		return (best < 0 && first) ? soonest : best;
+	}
+
+	/**
+	* Get the health score of an endpoint, lower is better.
+	* @param endpoint The endpoint
+	* @return Score, in milliseconds of expected connect delay
+	*/
+	unsigned long endpointScore(const CayenneEndpoint& endpoint) {
+		return endpoint.connectMs + endpoint.rttMs + (unsigned long)endpoint.failureRate * CAYENNE_ENDPOINT_FAILURE_COST_MS / 1000;
+	}
+
+	/**
+	* Connect to an endpoint and record how it went.
+	* @param index Endpoint index
+	* @return true if the MQTT connection was established
+	*/
+	bool connectEndpoint(int index) {
+		CayenneEndpoint& endpoint = _endpoints[index];
+		int error = MQTT_FAILURE;
+		unsigned long start = millis();
+		CAYENNE_LOG("Connecting to %s:%d", endpoint.host, endpoint.port);
+		if (!NetworkConnect(&_network, (char*)endpoint.host, endpoint.port)) {
+			CAYENNE_LOG("Network connect failed");
+			recordFailure(endpoint);
+			return false;
+		}
+		unsigned long connected = millis();
+		if ((error = CayenneMQTTConnect(&_mqttClient)) != MQTT_SUCCESS) {
+			CAYENNE_LOG("MQTT connect failed, error %d", error);
+			NetworkDisconnect(&_network);
+			recordFailure(endpoint);
+			return false;
+		}
+		endpoint.connectMs = average(endpoint.connectMs, connected - start, endpoint.attempts == endpoint.failures);
+		endpoint.rttMs = average(endpoint.rttMs, millis() - connected, endpoint.attempts == endpoint.failures);
+		endpoint.attempts++;
+		endpoint.failStreak = 0;
+		recordHealth(endpoint, false);
+		_endpoint = index;
+		return true;
+	}
+
+	/**
+	* Record a failed connect and hold the endpoint down, for longer each time it fails in a row.
+	* @param endpoint The endpoint
+	*/
+	void recordFailure(CayenneEndpoint& endpoint) {
+		unsigned long holddown = CAYENNE_ENDPOINT_HOLDDOWN_MS;
+		endpoint.attempts++;
+		endpoint.failures++;
+		endpoint.failStreak++;
+		for (unsigned int i = 1; i < endpoint.failStreak && holddown < CAYENNE_RECONNECT_MAX_MS; ++i)
+			holddown *= 2;
+		if (holddown > CAYENNE_RECONNECT_MAX_MS)
+			holddown = CAYENNE_RECONNECT_MAX_MS;
+		endpoint.downUntil = millis() + holddown;
+		recordHealth(endpoint, true);
+	}
+
+	/**
+	* Update the failure rate of an endpoint after a connect.
+	* @param endpoint The endpoint
+	* @param failed true if the connect failed
+	*/
+	void recordHealth(CayenneEndpoint& endpoint, bool failed) {
+		endpoint.failureRate = average(endpoint.failureRate, failed ? 1000 : 0, endpoint.attempts == 1);
+	}
+
+	/**
+	* Update a moving average, giving the new sample a weight of 1/8.
+	* @param average The current average
+	* @param sample The new sample
+	* @param first true if this is the first sample, which replaces the average
+	* @return The new average
+	*/
+	static unsigned long average(unsigned long average, unsigned long sample, bool first) {
+		return first ? sample : (average * 7 + sample) / 8;
+	}
+
+	/**
+	* Schedule the next connect attempt. The delay is picked at random between 0 and a ceiling that doubles with each
+	* failed attempt up to CAYENNE_RECONNECT_MAX_MS, so a fleet of devices spreads its reconnects out.
+	*/
+	void scheduleRetry() {
+		unsigned long ceiling = CAYENNE_RECONNECT_MIN_MS;
+		for (unsigned int i = 1; i < _attempt && ceiling < CAYENNE_RECONNECT_MAX_MS; ++i)
+			ceiling *= 2;
+		if (ceiling > CAYENNE_RECONNECT_MAX_MS)
+			ceiling = CAYENNE_RECONNECT_MAX_MS;
+		unsigned long wait = random(ceiling + 1);
+		TimerCountdownMS(&_retryTimer, wait);
+		setState(CAYENNE_STATE_WAITING);
+		CAYENNE_LOG("Reconnecting in %lu ms", wait);
+	}
+
+	/**
+	* Change the connection state and report the change to the CAYENNE_STATE_CHANGED handler.
+	* @param state The new state
+	*/
+	void setState(CayenneConnectionState state) {
+		unsigned long now = millis();
+		CayenneConnectionState previous = _state;
+		unsigned long duration = now - _stateSince;
+		_state = state;
+		_stateSince = now;
+		CayenneStateChanged(state, previous, duration, _attempt);
+	}
+
 	static CayenneMQTTClient _mqttClient;
 	Network _network;
+	CayenneEndpoint _endpoints[CAYENNE_MAX_ENDPOINTS];
+	unsigned int _endpointCount;
+	int _endpoint;
+	CayenneConnectionState _state;
+	unsigned long _stateSince;
+	Timer _retryTimer;
+	Timer _pollTimer;
+	unsigned int _attempt;
+	unsigned long _connectStart;
+	unsigned long _readyMs;
+	bool _subscribed;
+	bool _deviceInfoSent;
+	bool _subscribeFailed;
 };
 
 CayenneMQTTClient CayenneArduinoMQTTClient::_mqttClient;
@@ -38,6 +38,9 @@ void OutputHandler(Request& request)
 void EmptyHandler()
 {}
 
+void StateChangedHandler(CayenneConnectionState state, CayenneConnectionState previous, unsigned long duration, unsigned int attempt)
+{}
+
 #define CAYENNE_IN_IMPL(channel) void InputHandler ## channel (Request& req, CayenneMessage& getValue) \
           __attribute__((weak, alias("InputHandler")))
 
@@ -47,6 +50,7 @@ void EmptyHandler()
 
 CAYENNE_CONNECTED() __attribute__((weak, alias("EmptyHandler")));
 CAYENNE_DISCONNECTED() __attribute__((weak, alias("EmptyHandler")));
+CAYENNE_STATE_CHANGED() __attribute__((weak, alias("StateChangedHandler")));
 
 CAYENNE_IN_IMPL(Default);
 CAYENNE_OUT_DEFAULT() __attribute__((weak, alias("EmptyHandler")));;
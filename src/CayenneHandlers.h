@@ -76,6 +76,7 @@ Code adapted from Blynk library BlynkHandlers.h. Copyright info below.
 // Additional handlers
 #define CAYENNE_CONNECTED()    void CayenneConnected()
 #define CAYENNE_DISCONNECTED() void CayenneDisconnected()
+#define CAYENNE_STATE_CHANGED() void CayenneStateChanged(CayenneConnectionState state, CayenneConnectionState previous, unsigned long duration, unsigned int attempt)
 
 
 // Default read/write handlers (you can redefine them in your code)
@@ -88,6 +89,15 @@ struct Request
 	unsigned int channel;
 };
 
+// Connection states reported to the CAYENNE_STATE_CHANGED handler
+enum CayenneConnectionState
+{
+	CAYENNE_STATE_DISCONNECTED, // Not connected and no attempt scheduled
+	CAYENNE_STATE_CONNECTING,   // Connecting to the network and Cayenne
+	CAYENNE_STATE_WAITING,      // Waiting for the backoff delay before the next connect attempt
+	CAYENNE_STATE_CONNECTED     // Connected to Cayenne
+};
+
 typedef void (*InputHandlerFunction)(Request& request, CayenneMessage& getValue);
 typedef void(*OutputHandlerFunction)(Request& request);
 
@@ -98,10 +108,12 @@ OutputHandlerFunction GetOutputHandler(uint8_t channel);
 CAYENNE_OUT();
 CAYENNE_IN();
 void EmptyHandler();
+void StateChangedHandler(CayenneConnectionState state, CayenneConnectionState previous, unsigned long duration, unsigned int attempt);
 
 // Declare all channel handlers (you can redefine them in your code)
 CAYENNE_CONNECTED();
 CAYENNE_DISCONNECTED();
+CAYENNE_STATE_CHANGED();
 
 CAYENNE_IN_DEFAULT();
 CAYENNE_OUT_DEFAULT();
@@ -66,7 +66,16 @@ void MQTTMessageArrived(MessageData* md, void* userData)
 void CayenneMQTTClientInit(CayenneMQTTClient* client, Network* network, const char* username, const char* password, const char* clientID, CayenneMessageHandler defaultHandler)
 {
 	int i;
-	MQTTClientInit(&client->mqttClient, network, 30000, client->sendbuf, CAYENNE_MAX_MESSAGE_SIZE, client->readbuf, CAYENNE_MAX_MESSAGE_SIZE);
+	MQTTClientInit(&client->mqttClient, network, CAYENNE_COMMAND_TIMEOUT_MS, client->sendbuf, CAYENNE_MAX_MESSAGE_SIZE, client->readbuf, CAYENNE_MAX_MESSAGE_SIZE);
+#if CAYENNE_TX_BUFFER_SIZE > 0
+	MQTTSetTxBuffer(&client->mqttClient, client->txbuf, CAYENNE_TX_BUFFER_SIZE, CAYENNE_TX_FLUSH_MS);
+#endif
+#if CAYENNE_INFLIGHT_BUFFER_SIZE > 0
+	MQTTSetInflightBuffer(&client->mqttClient, client->inflightbuf, CAYENNE_INFLIGHT_BUFFER_SIZE);
+#endif
+#if CAYENNE_TOPIC_ALIAS_BUFFER_SIZE > 0
+	MQTTSetTopicAliasBuffer(&client->mqttClient, client->aliasbuf, CAYENNE_TOPIC_ALIAS_BUFFER_SIZE);
+#endif
 	for (i = 0; i < CAYENNE_MAX_MESSAGE_HANDLERS; ++i)
 	{
 		client->messageHandlers[i].clientID = NULL;
@@ -75,6 +84,10 @@ void CayenneMQTTClientInit(CayenneMQTTClient* client, Network* network, const ch
 		client->messageHandlers[i].fp = NULL;
 	}
 	client->defaultMessageHandler = defaultHandler;
+	client->subscribesPending = 0;
+	client->subscribeResult = MQTT_SUCCESS;
+	client->subscribeHandler = NULL;
+	client->subscribeContext = NULL;
 	client->mqttClient.defaultMessageHandler = MQTTMessageArrived;
 	client->mqttClient.userData = client;
 	client->username = username;
@@ -83,20 +96,33 @@ void CayenneMQTTClientInit(CayenneMQTTClient* client, Network* network, const ch
 }
 
 /**
-* Connect to the Cayenne server
+* Connect to the Cayenne server. With CAYENNE_PERSISTENT_SESSION the server is asked to keep the session, check
+* CayenneMQTTSessionPresent afterwards to see if the subscriptions need to be made again. The connection uses
+* CAYENNE_MQTT_VERSION of the protocol.
 * @param[in] client The client object
 * @return success code
 */
 int CayenneMQTTConnect(CayenneMQTTClient* client)
 {
 	MQTTPacket_connectData data = MQTTPacket_connectData_initializer;
-	data.MQTTVersion = 3;
+	data.MQTTVersion = CAYENNE_MQTT_VERSION;
+	data.cleansession = !CAYENNE_PERSISTENT_SESSION;
 	data.clientID.cstring = (char*)client->clientID;
 	data.username.cstring = (char*)client->username;
 	data.password.cstring = (char*)client->password;
 	return MQTTConnect(&client->mqttClient, &data);
 }
 
+/**
+* Check if the server kept the session from the previous connection, so its subscriptions are still in place.
+* @param[in] client The client object
+* @return 1 if the session was kept, 0 if it is a new session
+*/
+int CayenneMQTTSessionPresent(CayenneMQTTClient* client)
+{
+	return client->mqttClient.sessionPresent ? 1 : 0;
+}
+
 /**
 * Send data to Cayenne.
 * @param[in] client The client object
@@ -288,7 +314,8 @@ int CayenneMQTTPublishDataArray(CayenneMQTTClient* client, const char* clientID,
 }
 
 /**
-* Send a response to a channel.
+* Send a response to a channel. The response is sent without waiting for it to be acknowledged, so it can be sent
+* from a command handler, and it is resent if the acknowledgement doesn't arrive.
 * @param[in] client The client object
 * @param[in] clientID The client ID to use in the topic, NULL to use the clientID the client was initialized with
 * @param[in] id ID of message the response is for
@@ -311,7 +338,11 @@ int CayenneMQTTPublishResponse(CayenneMQTTClient* client, const char* clientID,
 			message.dup = 0;
 			message.payload = (void*)payload;
 			message.payloadlen = size;
+#if CAYENNE_INFLIGHT_BUFFER_SIZE > 0
+			result = MQTTPublishAsync(&client->mqttClient, buffer, &message, NULL, NULL);
+#else
 			result = MQTTPublish(&client->mqttClient, buffer, &message);
+#endif
 		}
 	}
 	return result;
@@ -352,6 +383,99 @@ int CayenneMQTTSubscribe(CayenneMQTTClient* client, const char* clientID, Cayenn
 	return result;
 }
 
+/**
+* Count down the SUBSCRIBE packets sent by CayenneMQTTSubscribeAsync as each is acknowledged, and call the handler
+* when the last one is.
+* @param[in] id Packet ID of the SUBSCRIBE
+* @param[in] rc MQTT_SUCCESS if all its topics were granted
+* @param[in] context The client object
+*/
+static void subscribeComplete(unsigned short id, int rc, void* context)
+{
+	CayenneMQTTClient* client = (CayenneMQTTClient*)context;
+	(void)id;
+	if (rc != MQTT_SUCCESS)
+		client->subscribeResult = rc;
+	if (--client->subscribesPending == 0 && client->subscribeHandler)
+		client->subscribeHandler(client->subscribeResult, client->subscribeContext);
+}
+
+/**
+* Send one SUBSCRIBE packet for CayenneMQTTSubscribeAsync.
+* @param[in] client The client object
+* @param[in] topicFilters Topic names
+* @param[in] count Number of topic names
+* @return success code
+*/
+static int subscribePacket(CayenneMQTTClient* client, const char* topicFilters[], int count)
+{
+	int result = MQTTSubscribeAsync(&client->mqttClient, count, topicFilters, QOS0, subscribeComplete, client);
+	if (result == MQTT_SUCCESS)
+		client->subscribesPending++;
+	else
+		client->subscribeResult = result; // the handler still reports failure if earlier packets were sent
+	return result;
+}
+
+/**
+* Subscribe to several topics without waiting for the server to acknowledge them. The topics are packed into as few
+* SUBSCRIBE packets as fit in the send buffer, and these are queued so they go out in the same write as the packets
+* around them while the client is corked. Messages on the topics go to the default handler. Only one call can be
+* waiting for its acknowledgements at a time.
+* @param[in] client The client object
+* @param[in] clientID The client ID to use in the topics, NULL to use the clientID the client was initialized with
+* @param[in] topics Cayenne topics
+* @param[in] count Number of topics
+* @param[in] channel The topic channel, CAYENNE_NO_CHANNEL for none, CAYENNE_ALL_CHANNELS for all
+* @param[in] handler Called from CayenneMQTTYield once every topic has been acknowledged, with MQTT_SUCCESS, or with
+* MQTT_FAILURE if one was refused or its acknowledgement didn't arrive, can be NULL
+* @param[in] context Passed to the handler
+* @return success code
+*/
+int CayenneMQTTSubscribeAsync(CayenneMQTTClient* client, const char* clientID, const CayenneTopic* topics, size_t count, unsigned int channel, CayenneSubscribeHandler handler, void* context)
+{
+	// The packet has to fit in the send buffer, so the topic names of one packet fit in a buffer of that size too.
+	char buffer[CAYENNE_MAX_MESSAGE_SIZE] = { 0 };
+	const char* topicFilters[MQTT_MAX_SUBSCRIBE_TOPICS];
+	size_t used = 0;
+	int length = 3; // packet ID, and the properties length of an MQTT 5 packet
+	int n = 0;
+	int result = CAYENNE_SUCCESS;
+
+	if (client->subscribesPending > 0)
+		return MQTT_FAILURE;
+	client->subscribeResult = MQTT_SUCCESS;
+	client->subscribeHandler = handler;
+	client->subscribeContext = context;
+	while (count > 0 && result == CAYENNE_SUCCESS) {
+		size_t size = 0;
+		result = CayenneBuildTopic(&buffer[used], sizeof(buffer) - used, client->username, clientID ? clientID : client->clientID, *topics, channel);
+		if (result == CAYENNE_SUCCESS)
+			size = strlen(&buffer[used]);
+		if (result == CAYENNE_SUCCESS && n < MQTT_MAX_SUBSCRIBE_TOPICS && MQTTPacket_len((int)(length + size + 3)) <= CAYENNE_MAX_MESSAGE_SIZE) {
+			topicFilters[n++] = &buffer[used];
+			used += size + 1;
+			length += size + 3; // name length, name and requested QoS
+			++topics;
+			--count;
+		}
+		else if (n == 0) {
+			// The topic doesn't fit in a packet by itself.
+			result = (result == CAYENNE_SUCCESS) ? MQTT_BUFFER_OVERFLOW : result;
+		}
+		else {
+			// Send what has been packed, then carry on with the topic that didn't fit.
+			result = subscribePacket(client, topicFilters, n);
+			used = 0;
+			length = 3;
+			n = 0;
+		}
+	}
+	if (result == CAYENNE_SUCCESS && n > 0)
+		result = subscribePacket(client, topicFilters, n);
+	return result;
+}
+
 /**
 * Unsubscribe from a topic.
 * @param[in] client The client object
@@ -406,6 +530,114 @@ int CayenneMQTTConnected(CayenneMQTTClient* client)
 }
 
 
+/**
+* Hold publishes so they are sent together in one write when CayenneMQTTUncork is called.
+* Calls can be nested, the data is sent when the last CayenneMQTTUncork is called.
+* @param[in] client The client object
+*/
+void CayenneMQTTCork(CayenneMQTTClient* client)
+{
+	MQTTCork(&client->mqttClient);
+}
+
+
+/**
+* Send the publishes held since CayenneMQTTCork was called.
+* @param[in] client The client object
+* @return success code
+*/
+int CayenneMQTTUncork(CayenneMQTTClient* client)
+{
+	return MQTTUncork(&client->mqttClient);
+}
+
+
+/**
+* Make data publishes return without waiting on the network. In non-blocking mode the publish functions return
+* MQTT_SUCCESS if the data was written, MQTT_QUEUED if it is waiting in the transmit buffer, or MQTT_WOULD_BLOCK
+* if the buffer is full and the data was dropped. Requires CAYENNE_TX_BUFFER_SIZE to be greater than 0.
+* @param[in] client The client object
+* @param[in] nonblocking 1 to enable non-blocking mode, 0 to disable it
+*/
+void CayenneMQTTSetNonBlocking(CayenneMQTTClient* client, int nonblocking)
+{
+	MQTTSetNonBlocking(&client->mqttClient, nonblocking);
+}
+
+
+/**
+* Get the room left in the transmit buffer.
+* @param[in] client The client object
+* @return Number of bytes that can be published without blocking
+*/
+size_t CayenneMQTTWritable(CayenneMQTTClient* client)
+{
+	return MQTTWritable(&client->mqttClient);
+}
+
+
+/**
+* Get the amount of data waiting to be written.
+* @param[in] client The client object
+* @return Number of bytes waiting in the transmit buffer
+*/
+size_t CayenneMQTTQueueDepth(CayenneMQTTClient* client)
+{
+	return MQTTQueueDepth(&client->mqttClient);
+}
+
+
+/**
+* Pass received data to the client, for transports that deliver data as it arrives. Complete packets are handled
+* straight away, so messages reach the handlers without waiting for CayenneMQTTYield. The data must already have
+* been taken off the network, and handlers called from here can't make blocking calls that wait on it.
+* @param[in] client The client object
+* @param[in] data The received data
+* @param[in] len The number of bytes of data
+* @param[out] used Set to the number of bytes used, which is all of them unless a packet failed, can be NULL
+* @return Number of packets handled, or a failure code
+*/
+int CayenneMQTTFeed(CayenneMQTTClient* client, const unsigned char* data, int len, int* used)
+{
+	return MQTTFeed(&client->mqttClient, data, len, used);
+}
+
+
+/**
+* Get the round trip time to the server, measured from keepalive pings and acknowledgements.
+* @param[in] client The client object
+* @param[out] srtt Set to the smoothed round trip time in milliseconds, can be NULL
+* @param[out] rttvar Set to the round trip time variation in milliseconds, can be NULL
+* @return 1 if a round trip has been measured, 0 if not
+*/
+int CayenneMQTTGetRTT(CayenneMQTTClient* client, unsigned long* srtt, unsigned long* rttvar)
+{
+	return MQTTGetRTT(&client->mqttClient, srtt, rttvar);
+}
+
+
+/**
+* Handle the messages that have already arrived and any keepalive or resend that is due, without waiting.
+* @param[in] client The client object
+* @param[out] nextMs Set to the time in milliseconds until the client next has something to do, can be NULL
+* @return Number of packets handled, or a failure code
+*/
+int CayenneMQTTPoll(CayenneMQTTClient* client, int* nextMs)
+{
+	return MQTTPoll(&client->mqttClient, nextMs);
+}
+
+/**
+* Get the time until the client next has something to do, a keepalive ping, a resend or a timeout, without handling anything.
+* @param[in] client The client object
+* @return Time in milliseconds, 0 if something is due now, INT_MAX if nothing is pending
+*/
+int CayenneMQTTNextDeadline(CayenneMQTTClient* client)
+{
+	return MQTTNextDeadline(&client->mqttClient);
+}
+
+
 /**
 * Yield to allow MQTT message processing.
 * @param[in] client The client object
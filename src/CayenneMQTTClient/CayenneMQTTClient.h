@@ -54,6 +54,8 @@ extern "C" {
 
 	typedef void(*CayenneMessageHandler)(CayenneMessageData*);
 
+	typedef void(*CayenneSubscribeHandler)(int result, void* context);
+
 	/**
 	* Cayenne MQTT client data.
 	*/
@@ -65,6 +67,15 @@ extern "C" {
 		const char* clientID; /**< Cayenne MQTT client ID. */
 		unsigned char sendbuf[CAYENNE_MAX_MESSAGE_SIZE + 1]; /**< Buffer used for sending data. */
 		unsigned char readbuf[CAYENNE_MAX_MESSAGE_SIZE + 1]; /**< Buffer used for receiving data. */
+#if CAYENNE_TX_BUFFER_SIZE > 0
+		unsigned char txbuf[CAYENNE_TX_BUFFER_SIZE]; /**< Buffer used for combining publishes into one write. */
+#endif
+#if CAYENNE_INFLIGHT_BUFFER_SIZE > 0
+		unsigned char inflightbuf[CAYENNE_INFLIGHT_BUFFER_SIZE]; /**< Buffer used for keeping responses until they are acknowledged. */
+#endif
+#if CAYENNE_TOPIC_ALIAS_BUFFER_SIZE > 0
+		unsigned char aliasbuf[CAYENNE_TOPIC_ALIAS_BUFFER_SIZE]; /**< Buffer used for remembering the topics that have an MQTT 5 topic alias. */
+#endif
 
 		/**
 		* Cayenne custom message handler data.
@@ -78,6 +89,10 @@ extern "C" {
 		} messageHandlers[CAYENNE_MAX_MESSAGE_HANDLERS];  /**< Custom message handler array. */
 
 		void(*defaultMessageHandler) (CayenneMessageData*); /**< Default message handler used if no custom handlers match the received message topic. */
+		int subscribesPending; /**< Number of SUBSCRIBE packets from CayenneMQTTSubscribeAsync waiting for their SUBACK. */
+		int subscribeResult; /**< Result of the CayenneMQTTSubscribeAsync SUBACKs that have arrived. */
+		CayenneSubscribeHandler subscribeHandler; /**< Handler called when the last CayenneMQTTSubscribeAsync SUBACK arrives. */
+		void* subscribeContext; /**< Passed to subscribeHandler. */
 	} CayenneMQTTClient;
 
 	/**
@@ -92,12 +107,21 @@ extern "C" {
 	DLLExport void CayenneMQTTClientInit(CayenneMQTTClient* client, Network* network, const char* username, const char* password, const char* clientID, CayenneMessageHandler defaultHandler);
 
 	/**
-	* Connect to the Cayenne server.
+	* Connect to the Cayenne server. With CAYENNE_PERSISTENT_SESSION the server is asked to keep the session, check
+	* CayenneMQTTSessionPresent afterwards to see if the subscriptions need to be made again. The connection uses
+	* CAYENNE_MQTT_VERSION of the protocol.
 	* @param[in] client The client object
 	* @return success code
 	*/
 	DLLExport int CayenneMQTTConnect(CayenneMQTTClient* client);
 
+	/**
+	* Check if the server kept the session from the previous connection, so its subscriptions are still in place.
+	* @param[in] client The client object
+	* @return 1 if the session was kept, 0 if it is a new session
+	*/
+	DLLExport int CayenneMQTTSessionPresent(CayenneMQTTClient* client);
+
 	/**
 	* Send data to Cayenne.
 	* @param[in] client The client object
@@ -203,7 +227,8 @@ extern "C" {
 	DLLExport int CayenneMQTTPublishDataArray(CayenneMQTTClient* client, const char* clientID, CayenneTopic topic, unsigned int channel, const char* type, const CayenneValuePair* values, size_t valueCount);
 
 	/**
-	* Send a response to a channel.
+	* Send a response to a channel. The response is sent without waiting for it to be acknowledged, so it can be sent
+	* from a command handler, and it is resent if the acknowledgement doesn't arrive.
 	* @param[in] client The client object
 	* @param[in] clientID The client ID to use in the topic, NULL to use the clientID the client was initialized with
 	* @param[in] id ID of message the response is for
@@ -223,6 +248,23 @@ extern "C" {
 	*/
 	DLLExport int CayenneMQTTSubscribe(CayenneMQTTClient* client, const char* clientID, CayenneTopic topic, unsigned int channel, CayenneMessageHandler handler);
 
+	/**
+	* Subscribe to several topics without waiting for the server to acknowledge them. The topics are packed into as few
+	* SUBSCRIBE packets as fit in the send buffer, and these are queued so they go out in the same write as the packets
+	* around them while the client is corked. Messages on the topics go to the default handler. Only one call can be
+	* waiting for its acknowledgements at a time.
+	* @param[in] client The client object
+	* @param[in] clientID The client ID to use in the topics, NULL to use the clientID the client was initialized with
+	* @param[in] topics Cayenne topics
+	* @param[in] count Number of topics
+	* @param[in] channel The topic channel, CAYENNE_NO_CHANNEL for none, CAYENNE_ALL_CHANNELS for all
+	* @param[in] handler Called from CayenneMQTTYield once every topic has been acknowledged, with MQTT_SUCCESS, or with
+	* MQTT_FAILURE if one was refused or its acknowledgement didn't arrive, can be NULL
+	* @param[in] context Passed to the handler
+	* @return success code
+	*/
+	DLLExport int CayenneMQTTSubscribeAsync(CayenneMQTTClient* client, const char* clientID, const CayenneTopic* topics, size_t count, unsigned int channel, CayenneSubscribeHandler handler, void* context);
+
 	/**
 	* Unsubscribe from a topic.
 	* @param[in] client The client object
@@ -247,6 +289,79 @@ extern "C" {
 	*/
 	DLLExport int CayenneMQTTConnected(CayenneMQTTClient* client);
 
+	/**
+	* Hold publishes so they are sent together in one write when CayenneMQTTUncork is called.
+	* Calls can be nested, the data is sent when the last CayenneMQTTUncork is called.
+	* @param[in] client The client object
+	*/
+	DLLExport void CayenneMQTTCork(CayenneMQTTClient* client);
+
+	/**
+	* Send the publishes held since CayenneMQTTCork was called.
+	* @param[in] client The client object
+	* @return success code
+	*/
+	DLLExport int CayenneMQTTUncork(CayenneMQTTClient* client);
+
+	/**
+	* Make data publishes return without waiting on the network. In non-blocking mode the publish functions return
+	* MQTT_SUCCESS if the data was written, MQTT_QUEUED if it is waiting in the transmit buffer, or MQTT_WOULD_BLOCK
+	* if the buffer is full and the data was dropped. Requires CAYENNE_TX_BUFFER_SIZE to be greater than 0.
+	* @param[in] client The client object
+	* @param[in] nonblocking 1 to enable non-blocking mode, 0 to disable it
+	*/
+	DLLExport void CayenneMQTTSetNonBlocking(CayenneMQTTClient* client, int nonblocking);
+
+	/**
+	* Get the room left in the transmit buffer.
+	* @param[in] client The client object
+	* @return Number of bytes that can be published without blocking
+	*/
+	DLLExport size_t CayenneMQTTWritable(CayenneMQTTClient* client);
+
+	/**
+	* Get the amount of data waiting to be written.
+	* @param[in] client The client object
+	* @return Number of bytes waiting in the transmit buffer
+	*/
+	DLLExport size_t CayenneMQTTQueueDepth(CayenneMQTTClient* client);
+
+	/**
+	* Pass received data to the client, for transports that deliver data as it arrives. Complete packets are handled
+	* straight away, so messages reach the handlers without waiting for CayenneMQTTYield. The data must already have
+	* been taken off the network, and handlers called from here can't make blocking calls that wait on it.
+	* @param[in] client The client object
+	* @param[in] data The received data
+	* @param[in] len The number of bytes of data
+	* @param[out] used Set to the number of bytes used, which is all of them unless a packet failed, can be NULL
+	* @return Number of packets handled, or a failure code
+	*/
+	DLLExport int CayenneMQTTFeed(CayenneMQTTClient* client, const unsigned char* data, int len, int* used);
+
+	/**
+	* Get the round trip time to the server, measured from keepalive pings and acknowledgements.
+	* @param[in] client The client object
+	* @param[out] srtt Set to the smoothed round trip time in milliseconds, can be NULL
+	* @param[out] rttvar Set to the round trip time variation in milliseconds, can be NULL
+	* @return 1 if a round trip has been measured, 0 if not
+	*/
+	DLLExport int CayenneMQTTGetRTT(CayenneMQTTClient* client, unsigned long* srtt, unsigned long* rttvar);
+
+	/**
+	* Handle the messages that have already arrived and any keepalive or resend that is due, without waiting.
+	* @param[in] client The client object
+	* @param[out] nextMs Set to the time in milliseconds until the client next has something to do, can be NULL
+	* @return Number of packets handled, or a failure code
+	*/
+	DLLExport int CayenneMQTTPoll(CayenneMQTTClient* client, int* nextMs);
+
+	/**
+	* Get the time until the client next has something to do, a keepalive ping, a resend or a timeout, without handling anything.
+	* @param[in] client The client object
+	* @return Time in milliseconds, 0 if something is due now, INT_MAX if nothing is pending
+	*/
+	DLLExport int CayenneMQTTNextDeadline(CayenneMQTTClient* client);
+
 	/**
 	* Yield to allow MQTT message processing.
 	* @param[in] client The client object
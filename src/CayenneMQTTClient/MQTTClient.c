@@ -15,6 +15,15 @@
  *******************************************************************************/
 
 #include "MQTTClient.h"
+#include <limits.h>
+#include <string.h>
+
+#define MAX_PACKET_VECTORS 4
+#define RX_CHUNK 16 /* not an MQTT packet type, a piece of a streamed payload is in readbuf */
+
+// Ways a packet is received. One that fits is read whole into readbuf. A PUBLISH that doesn't has its header and topic
+// read into readbuf, then its payload is passed on a bufferful at a time. Any other packet that doesn't fit is drained.
+enum RxMode { RX_PACKET, RX_TOPIC, RX_STREAM, RX_DRAIN };
 
 static void NewMessageData(MessageData* md, MQTTString* aTopicName, MQTTMessage* aMessage) {
     md->topicName = aTopicName;
@@ -22,26 +31,119 @@ static void NewMessageData(MessageData* md, MQTTString* aTopicName, MQTTMessage*
 }
 
 
+// Find the in-flight slot using a packet id, -1 if the id isn't in flight.
+static int inflightFind(MQTTClient* c, unsigned short id)
+{
+    int i;
+
+    for (i = 0; i < MAX_INFLIGHT_MESSAGES; ++i)
+    {
+        if ((c->inflight_used & (1UL << i)) && c->inflight[i].id == id)
+            return i;
+    }
+    return -1;
+}
+
+
+static int inflightCount(MQTTClient* c)
+{
+    int rc = 0;
+    unsigned long used;
+
+    for (used = c->inflight_used; used != 0; used &= used - 1)
+        ++rc;
+    return rc;
+}
+
+
 static int getNextPacketId(MQTTClient *c) {
-    return c->next_packetid = (c->next_packetid == MAX_PACKET_ID) ? 1 : c->next_packetid + 1;
+    do
+        c->next_packetid = (c->next_packetid == MAX_PACKET_ID) ? 1 : c->next_packetid + 1;
+    while (inflightFind(c, c->next_packetid) >= 0); // an id is only reused once its publish has been acknowledged
+    return c->next_packetid;
 }
 
 
-static int sendPacket(MQTTClient* c, int length, Timer* timer)
+// Seed the keepalive jitter with an FNV-1a hash of the client id, which differs between clients that start together.
+static void seedJitter(MQTTClient* c, MQTTString* clientID)
+{
+    const char* id = clientID->cstring ? clientID->cstring : clientID->lenstring.data;
+    int i,
+        len = MQTTstrlen(*clientID);
+
+    c->jitter_seed = 2166136261UL;
+    for (i = 0; i < len; ++i)
+        c->jitter_seed = ((c->jitter_seed ^ (unsigned char)id[i]) * 16777619UL) & 0xFFFFFFFFUL;
+    if (c->jitter_seed == 0)
+        c->jitter_seed = 1; // xorshift stays at 0
+}
+
+
+// Start a keepalive countdown with a random part of it cut off, so clients that connected together don't all ping
+// together.
+static void keepaliveCountdown(MQTTClient* c, Timer* timer)
+{
+    unsigned long ms = c->keepAliveInterval * 1000UL,
+        jitter = ms / 100 * MQTT_KEEPALIVE_JITTER_PERCENT;
+
+    if (jitter > 0)
+    {
+        // xorshift, seeded from the client id so each client gets its own sequence
+        c->jitter_seed ^= (c->jitter_seed << 13) & 0xFFFFFFFFUL;
+        c->jitter_seed ^= c->jitter_seed >> 17;
+        c->jitter_seed ^= (c->jitter_seed << 5) & 0xFFFFFFFFUL;
+        ms -= c->jitter_seed % (jitter + 1);
+    }
+    TimerCountdownMS(timer, ms);
+}
+
+
+static int sendPacketv(MQTTClient* c, NetworkVector* packet, int count, Timer* timer)
 {
-    int rc = MQTT_FAILURE, 
+    NetworkVector vectors[MAX_PACKET_VECTORS + 1];
+    int rc = MQTT_FAILURE,
+        i = 0,
+        total = 0,
+        length = 0,
         sent = 0;
-    
+
+    // anything waiting in the transmit buffer goes out first, in the same write
+    if (c->txlen > 0)
+    {
+        vectors[total].data = c->txbuf;
+        vectors[total++].len = c->txlen;
+        c->txlen = 0;
+    }
+    for (i = 0; i < count; ++i)
+        vectors[total++] = packet[i];
+    for (i = 0; i < total; ++i)
+        length += vectors[i].len;
+
+    i = 0;
     while (sent < length && !TimerIsExpired(timer))
     {
-        rc = c->ipstack->mqttwrite(c->ipstack, &c->buf[sent], length, TimerLeftMS(timer));
+        if (c->ipstack->mqttwritev)
+            rc = c->ipstack->mqttwritev(c->ipstack, &vectors[i], total - i, TimerLeftMS(timer));
+        else
+            rc = c->ipstack->mqttwrite(c->ipstack, vectors[i].data, vectors[i].len, TimerLeftMS(timer));
         if (rc < 0)  // there was an error writing the data
             break;
         sent += rc;
+        // step past the blocks that were written, and trim the one that was only partly written
+        while (i < total && rc >= vectors[i].len)
+        {
+            rc -= vectors[i].len;
+            ++i;
+        }
+        if (i < total)
+        {
+            vectors[i].data += rc;
+            vectors[i].len -= rc;
+        }
     }
     if (sent == length)
     {
-        TimerCountdown(&c->ping_timer, c->keepAliveInterval); // record the fact that we have successfully sent the packet
+        keepaliveCountdown(c, &c->ping_timer); // record the fact that we have successfully sent the packet
         rc = MQTT_SUCCESS;
     }
     else
@@ -50,535 +152,1908 @@ static int sendPacket(MQTTClient* c, int length, Timer* timer)
 }
 
 
-void MQTTClientInit(MQTTClient* c, Network* network, unsigned int command_timeout_ms,
-		unsigned char* sendbuf, size_t sendbuf_size, unsigned char* readbuf, size_t readbuf_size)
+static int sendPacket(MQTTClient* c, int length, Timer* timer)
 {
-    int i;
-    c->ipstack = network;
-    
-    for (i = 0; i < MAX_MESSAGE_HANDLERS; ++i)
-        c->messageHandlers[i].topicFilter = 0;
-    c->command_timeout_ms = command_timeout_ms;
-    c->buf = sendbuf;
-    c->buf_size = sendbuf_size;
-    c->readbuf = readbuf;
-    c->readbuf_size = readbuf_size;
-    c->isconnected = 0;
-	c->connAckReceived = 0;
-	c->subAckReceived = 0;
-	c->unsubAckReceived = 0;
-	c->pubAckReceived = 0;
-	c->pubCompReceived = 0;
-    c->ping_outstanding = 0;
-    c->defaultMessageHandler = NULL;
-	c->userData = NULL;
-	c->next_packetid = 1;
-    TimerInit(&c->ping_timer);
-	TimerInit(&c->last_received_timer);
-	TimerInit(&c->ping_response_timer);
-#if defined(MQTT_TASK)
-	MutexInit(&c->mutex);
-#endif
+    NetworkVector vector;
+    vector.data = c->buf;
+    vector.len = length;
+    return sendPacketv(c, &vector, 1, timer);
 }
 
 
-static int decodePacket(MQTTClient* c, int* value, int timeout)
+// Write as much of the transmit buffer as the network takes without waiting, and keep the rest queued.
+static int drainPackets(MQTTClient* c)
 {
-    unsigned char i;
-    int multiplier = 1;
-    int len = 0;
-    const int MAX_NO_OF_REMAINING_LENGTH_BYTES = 4;
+    int rc = 0;
 
-    *value = 0;
-    do
+    if (c->txlen == 0)
+        return MQTT_SUCCESS;
+    if (c->ipstack->mqttwritev)
     {
-        int rc = MQTTPACKET_READ_ERROR;
+        NetworkVector vector;
+        vector.data = c->txbuf;
+        vector.len = c->txlen;
+        rc = c->ipstack->mqttwritev(c->ipstack, &vector, 1, 0);
+    }
+    else
+        rc = c->ipstack->mqttwrite(c->ipstack, c->txbuf, c->txlen, 0);
+    if (rc < 0)
+        return MQTT_FAILURE;
+    if (rc > 0)
+    {
+        memmove(c->txbuf, &c->txbuf[rc], c->txlen - rc);
+        c->txlen -= rc;
+        keepaliveCountdown(c, &c->ping_timer);
+    }
+    return (c->txlen > 0) ? MQTT_QUEUED : MQTT_SUCCESS;
+}
 
-        if (++len > MAX_NO_OF_REMAINING_LENGTH_BYTES)
-        {
-            rc = MQTTPACKET_READ_ERROR; /* bad data */
-            goto exit;
-        }
-        rc = c->ipstack->mqttread(c->ipstack, &i, 1, timeout);
-        if (rc != 1)
-            goto exit;
-        *value += (i & 127) * multiplier;
-        multiplier *= 128;
-    } while ((i & 128) != 0);
-exit:
-    return len;
+
+static int flushPackets(MQTTClient* c)
+{
+    Timer timer;
+
+    if (c->txlen == 0)
+        return MQTT_SUCCESS;
+    TimerInit(&timer);
+    TimerCountdownMS(&timer, c->command_timeout_ms);
+    return sendPacketv(c, NULL, 0, &timer);
 }
 
 
-static int readPacket(MQTTClient* c, Timer* timer)
+static void copyPacketv(MQTTClient* c, NetworkVector* packet, int count)
 {
-    int rc = MQTT_FAILURE;
-    MQTTHeader header = {0};
-    int len = 0;
-    int rem_len = 0;
+    int i;
 
-    /* 1. read the header byte.  This has the packet type in it */
-    if (c->ipstack->mqttread(c->ipstack, c->readbuf, 1, TimerLeftMS(timer)) != 1)
-        goto exit;
+    if (c->txlen == 0)
+        TimerCountdownMS(&c->tx_flush_timer, c->tx_flush_ms);
+    for (i = 0; i < count; ++i)
+    {
+        memcpy(&c->txbuf[c->txlen], packet[i].data, packet[i].len);
+        c->txlen += packet[i].len;
+    }
+}
 
-    len = 1;
-    /* 2. read the remaining length.  This is variable in itself */
-    decodePacket(c, &rem_len, TimerLeftMS(timer));
-    len += MQTTPacket_encode(c->readbuf + 1, rem_len); /* put the original remaining length back into the buffer */
 
-    /* 3. read the rest of the buffer using a callback to supply the rest of the data */
-    if (rem_len > 0 && (c->ipstack->mqttread(c->ipstack, c->readbuf + len, rem_len, TimerLeftMS(timer)) != rem_len))
-        goto exit;
+// Add a packet to the transmit buffer so it can go out in the same write as the packets around it. The buffer is sent
+// when it fills, when a packet that can't wait is sent, when the client is uncorked, or once the flush deadline passes.
+static int queuePacketv(MQTTClient* c, NetworkVector* packet, int count, Timer* timer)
+{
+    int i,
+        length = 0;
 
-    header.byte = c->readbuf[0];
-    rc = header.bits.type;
+    for (i = 0; i < count; ++i)
+        length += packet[i].len;
+    if (c->txbuf == NULL || c->txlen + length > c->txbuf_size ||
+        (!c->corked && (c->tx_flush_ms == 0 || (c->txlen > 0 && TimerIsExpired(&c->tx_flush_timer)))))
+        return sendPacketv(c, packet, count, timer);
 
-	if (c->keepAliveInterval > 0) {
-		TimerCountdown(&c->last_received_timer, c->keepAliveInterval); // record the fact that we have successfully received a packet
-	}
-exit:
-    return rc;
+    copyPacketv(c, packet, count);
+    return MQTT_SUCCESS;
 }
 
 
-// assume topic filter and name is in correct format
-// # can only be at end
-// + and # can only be next to separator
-static char isTopicMatched(char* topicFilter, MQTTString* topicName)
+// Non-blocking version of queuePacketv. The packet is only accepted if it fits in the transmit buffer, so a slow
+// network never leaves part of a packet unsent.
+static int offerPacketv(MQTTClient* c, NetworkVector* packet, int count)
 {
-    char* curf = topicFilter;
-    char* curn = topicName->lenstring.data;
-    char* curn_end = curn + topicName->lenstring.len;
-    
-    while (*curf && curn < curn_end)
-    {
-        if (*curn == '/' && *curf != '/')
-            break;
-        if (*curf != '+' && *curf != '#' && *curf != *curn)
-            break;
-        if (*curf == '+')
-        {   // skip until we meet the next separator, or end of string
-            char* nextpos = curn + 1;
-            while (nextpos < curn_end && *nextpos != '/')
-                nextpos = ++curn + 1;
-        }
-        else if (*curf == '#')
-            curn = curn_end - 1;    // skip until end of string
-        curf++;
-        curn++;
-    };
-    
-    return (curn == curn_end) && (*curf == '\0');
+    int i;
+    size_t length = 0;
+
+    for (i = 0; i < count; ++i)
+        length += packet[i].len;
+    if (length > c->txbuf_size)
+        return MQTT_BUFFER_OVERFLOW;
+    if (c->txlen + length > c->txbuf_size && drainPackets(c) == MQTT_FAILURE)
+        return MQTT_FAILURE;
+    if (c->txlen + length > c->txbuf_size)
+        return MQTT_WOULD_BLOCK;
+
+    copyPacketv(c, packet, count);
+    if (c->corked || (c->tx_flush_ms > 0 && !TimerIsExpired(&c->tx_flush_timer)))
+        return MQTT_QUEUED;
+    return drainPackets(c);
 }
 
 
-int deliverMessage(MQTTClient* c, MQTTString* topicName, MQTTMessage* message)
+// Claim a free in-flight slot from the bitmap, -1 if all of them are in use or the broker's Receive Maximum is reached.
+static int inflightAlloc(MQTTClient* c)
 {
     int i;
-    int rc = MQTT_FAILURE;
 
-    // we have to find the right message handler - indexed by topic
-    for (i = 0; i < MAX_MESSAGE_HANDLERS; ++i)
+    if (inflightCount(c) >= c->receiveMaximum)
+        return -1;
+    for (i = 0; i < MAX_INFLIGHT_MESSAGES; ++i)
     {
-        if (c->messageHandlers[i].topicFilter != 0 && (MQTTPacket_equals(topicName, (char*)c->messageHandlers[i].topicFilter) ||
-                isTopicMatched((char*)c->messageHandlers[i].topicFilter, topicName)))
+        if ((c->inflight_used & (1UL << i)) == 0)
         {
-            if (c->messageHandlers[i].fp != NULL)
-            {
-                MessageData md;
-                NewMessageData(&md, topicName, message);
-                c->messageHandlers[i].fp(&md, c->userData);
-                rc = MQTT_SUCCESS;
-            }
+            c->inflight_used |= 1UL << i;
+            c->inflight[i].id = 0; // not a valid packet id, so the slot can't match an acknowledgement yet
+            c->inflight[i].retries = 0;
+            return i;
         }
     }
-    
-    if (rc == MQTT_FAILURE && c->defaultMessageHandler != NULL) 
-    {
-        MessageData md;
-        NewMessageData(&md, topicName, message);
-        c->defaultMessageHandler(&md, c->userData);
-        rc = MQTT_SUCCESS;
-    }   
-    
-    return rc;
+    return -1;
 }
 
 
-int keepalive(MQTTClient* c)
+static void inflightFree(MQTTClient* c, int i)
 {
-    int rc = MQTT_FAILURE;
+    c->inflight[i].state = INFLIGHT_FREE;
+    c->inflight_used &= ~(1UL << i);
+}
 
-    if (c->keepAliveInterval == 0)
+
+// Finish an in-flight publish. A waiting MQTTPublish collects the result itself, otherwise the slot is freed and the
+// completion handler is called.
+static void inflightComplete(MQTTClient* c, int i, int rc)
+{
+    InflightMessage* m = &c->inflight[i];
+
+    if (m->waiter)
     {
-        rc = MQTT_SUCCESS;
-        goto exit;
+        m->state = INFLIGHT_DONE;
+        m->rc = rc;
+        return;
     }
+    inflightFree(c, i);
+    if (m->fp != NULL)
+        m->fp(m->id, rc, m->context);
+}
 
-    if (TimerIsExpired(&c->ping_timer) || TimerIsExpired(&c->last_received_timer))
+
+// Look up the alias of a topic on an MQTT 5 connection. A topic without one is given the next alias if the broker
+// takes more and the topic fits in aliasbuf, it is set as pending until topicAliasCommit, as the broker only learns
+// the alias once the publish carrying it is sent. Returns the alias, or 0 if the topic is sent without one.
+static unsigned short topicAlias(MQTTClient* c, const char* topicName)
+{
+    size_t len = strlen(topicName) + 1,
+        pos = 0;
+    unsigned short alias;
+
+    c->aliaspending = 0;
+    if (c->MQTTVersion < 5 || c->aliasbuf == NULL)
+        return 0;
+    for (alias = 1; alias <= c->aliases; ++alias)
     {
-		if (!c->ping_outstanding)
-        {
-			Timer timer;
-            TimerInit(&timer);
-            TimerCountdownMS(&timer, 1000);
-            int len = MQTTSerialize_pingreq(c->buf, c->buf_size);
-			if (len > 0 && (rc = sendPacket(c, len, &timer)) == MQTT_SUCCESS) // send the ping packet
-			{
-				TimerCountdown(&c->ping_response_timer, c->keepAliveInterval);
-				c->ping_outstanding = 1;
-			}
-        }
-		else if (TimerIsExpired(&c->ping_response_timer))
-		{
-			c->isconnected = 0;
-		}
+        if (strcmp((const char*)&c->aliasbuf[pos], topicName) == 0)
+            return alias;
+        pos += strlen((const char*)&c->aliasbuf[pos]) + 1;
     }
+    if (alias > c->topicAliasMaximum || c->aliaslen + len > c->aliasbuf_size)
+        return 0;
+    memcpy(&c->aliasbuf[c->aliaslen], topicName, len);
+    c->aliaspending = len;
+    return alias;
+}
 
-exit:
-    return rc;
+
+// The publish that carried a new alias with its topic has been sent, so later publishes can use just the alias.
+static void topicAliasCommit(MQTTClient* c)
+{
+    if (c->aliaspending > 0)
+    {
+        c->aliaslen += c->aliaspending;
+        c->aliases++;
+        c->aliaspending = 0;
+    }
 }
 
 
-int cycle(MQTTClient* c, Timer* timer)
+// Build the vectors for a publish packet, the header goes in c->buf and the topic and payload are sent from where
+// they are. On an MQTT 5 connection the packet id is followed by the properties, and a topic the broker already knows
+// by alias is left out. Returns the number of vectors, or 0 if the header doesn't fit in c->buf.
+static int publishVectors(MQTTClient* c, NetworkVector* vectors, const char* topicName, int qos, unsigned char retained,
+        unsigned char dup, unsigned short id, void* payload, size_t payloadlen)
 {
-    // read the socket, see what work is due
-    unsigned short packet_type = readPacket(c, timer);
-    
+    MQTTString topic = MQTTString_initializer;
+    unsigned short alias = topicAlias(c, topicName);
+    unsigned char* ptr = NULL;
     int len = 0,
-        rc = MQTT_SUCCESS;
+        count = 0;
 
-    switch (packet_type)
+    topic.cstring = (alias > 0 && c->aliaspending == 0) ? (char *)"" : (char *)topicName;
+    if (c->MQTTVersion >= 5)
+        len = MQTTV5Serialize_publishHeader(c->buf, c->buf_size, dup, qos, retained, topic, alias, payloadlen);
+    else
+        len = MQTTSerialize_publishHeader(c->buf, c->buf_size, dup, qos, retained, topic, payloadlen);
+    if (len <= 0 || (qos != QOS0 && (size_t)len + 2 > c->buf_size))
+        return 0;
+    vectors[count].data = c->buf;
+    vectors[count++].len = len;
+    if (MQTTstrlen(topic) > 0)
     {
-		case CONNACK_MSG:
-			c->connAckReceived = 1;
-			break;
-		case PUBACK_MSG:
-			c->pubAckReceived = 1;
-			break;
-		case SUBACK_MSG:
-			c->subAckReceived = 1;
-			break;
-		case UNSUBACK_MSG:
-			c->unsubAckReceived = 1;
-			break;
-        case PUBLISH_MSG:
-        {
-            MQTTString topicName;
-            MQTTMessage msg;
-            int intQoS;
-            if (MQTTDeserialize_publish(&msg.dup, &intQoS, &msg.retained, &msg.id, &topicName,
-               (unsigned char**)&msg.payload, (int*)&msg.payloadlen, c->readbuf, c->readbuf_size) != 1)
-                goto exit;
-            msg.qos = (enum QoS)intQoS;
-            deliverMessage(c, &topicName, &msg);
-            if (msg.qos != QOS0)
-            {
-                if (msg.qos == QOS1)
-                    len = MQTTSerialize_ack(c->buf, c->buf_size, PUBACK_MSG, 0, msg.id);
-                else if (msg.qos == QOS2)
-                    len = MQTTSerialize_ack(c->buf, c->buf_size, PUBREC_MSG, 0, msg.id);
-                if (len <= 0)
-                    rc = MQTT_FAILURE;
-                else
-                    rc = sendPacket(c, len, timer);
-                if (rc == MQTT_FAILURE)
-                    goto exit; // there was a problem
-            }
-            break;
-        }
-        case PUBREC_MSG:
-        {
-            unsigned short mypacketid;
-            unsigned char dup, type;
-            if (MQTTDeserialize_ack(&type, &dup, &mypacketid, c->readbuf, c->readbuf_size) != 1)
-                rc = MQTT_FAILURE;
-            else if ((len = MQTTSerialize_ack(c->buf, c->buf_size, PUBREL_MSG, 0, mypacketid)) <= 0)
-                rc = MQTT_FAILURE;
-            else if ((rc = sendPacket(c, len, timer)) != MQTT_SUCCESS) // send the PUBREL_MSG packet
-                rc = MQTT_FAILURE; // there was a problem
-            if (rc == MQTT_FAILURE)
-                goto exit; // there was a problem
-            break;
-        }
-        case PUBCOMP_MSG:
-			c->pubCompReceived = 1;
-            break;
-        case PINGRESP_MSG:
-            c->ping_outstanding = 0;
-            break;
+        vectors[count].data = (unsigned char*)topic.cstring;
+        vectors[count++].len = MQTTstrlen(topic);
     }
-    keepalive(c);
-exit:
-    if (rc == MQTT_SUCCESS)
-        rc = packet_type;
-    return rc;
+    // the packet id and properties follow the header in c->buf
+    ptr = &c->buf[len];
+    if (qos == QOS1 || qos == QOS2)
+        writeInt(&ptr, id);
+    if (c->MQTTVersion >= 5)
+    {
+        int props = MQTTV5Serialize_publishProperties(ptr, c->buf_size - (ptr - c->buf), alias);
+        if (props <= 0)
+            return 0;
+        ptr += props;
+    }
+    if (ptr > &c->buf[len])
+    {
+        vectors[count].data = &c->buf[len];
+        vectors[count++].len = ptr - &c->buf[len];
+    }
+    vectors[count].data = (unsigned char*)payload;
+    vectors[count++].len = payloadlen;
+    return count;
 }
 
 
-int MQTTYield(MQTTClient* c, int timeout_ms)
+// How long to wait for an acknowledgement before resending: the smoothed round trip time plus four times its variation
+// once a round trip has been measured, else retry_ms, doubled for each resend already made (RFC 6298).
+static unsigned long retransmitTimeout(MQTTClient* c, int retries)
 {
-    int rc = MQTT_SUCCESS;
-    Timer timer;
-
-    TimerInit(&timer);
-    TimerCountdownMS(&timer, timeout_ms);
+    unsigned long rto = c->retry_ms;
 
-	do
+    if (c->rtt_samples > 0)
     {
-        if (cycle(c, &timer) == MQTT_FAILURE)
-        {
-            rc = MQTT_FAILURE;
-            break;
-        }
-	} while (!TimerIsExpired(&timer));
-        
-    return rc;
+        rto = c->srtt_ms + 4 * c->rttvar_ms;
+        if (rto < MQTT_RTO_MIN_MS)
+            rto = MQTT_RTO_MIN_MS;
+    }
+    while (retries-- > 0 && rto < MQTT_RTO_MAX_MS)
+        rto *= 2;
+    return (rto < MQTT_RTO_MAX_MS) ? rto : MQTT_RTO_MAX_MS;
 }
 
 
-void MQTTRun(void* parm)
+// How long to wait for an acknowledgement that isn't resent, a SUBACK or UNSUBACK: as long as a publish is
+// given with all its resends, but never more than command_timeout_ms, which is also the wait until a round trip has
+// been measured.
+static unsigned long ackTimeout(MQTTClient* c)
+{
+    unsigned long ms = 0;
+    int i;
+
+    if (c->rtt_samples == 0)
+        return c->command_timeout_ms;
+    for (i = 0; i <= MQTT_MAX_RETRIES; ++i)
+        ms += retransmitTimeout(c, i);
+    return (ms < c->command_timeout_ms) ? ms : c->command_timeout_ms;
+}
+
+
+// Start the countdown to resending an in-flight publish.
+static void inflightArm(MQTTClient* c, int i)
+{
+    c->inflight[i].rto_ms = retransmitTimeout(c, c->inflight[i].retries);
+    TimerCountdownMS(&c->inflight[i].retry_timer, c->inflight[i].rto_ms);
+}
+
+
+// Send the packet an in-flight publish is at, the PUBLISH or, once PUBREC has arrived, the PUBREL.
+static int sendInflight(MQTTClient* c, int i, unsigned char dup, Timer* timer)
+{
+    InflightMessage* m = &c->inflight[i];
+    NetworkVector vectors[MAX_PACKET_VECTORS];
+    int count = 0;
+
+    inflightArm(c, i);
+    if (m->state == INFLIGHT_PUBCOMP)
+    {
+        int len = MQTTSerialize_ack(c->buf, c->buf_size, PUBREL_MSG, 0, m->id);
+        return (len > 0) ? sendPacket(c, len, timer) : MQTT_FAILURE;
+    }
+    if ((count = publishVectors(c, vectors, m->topicName, m->qos, m->retained, dup, m->id, m->payload, m->payloadlen)) == 0)
+        return MQTT_FAILURE;
+    if (sendPacketv(c, vectors, count, timer) != MQTT_SUCCESS)
+        return MQTT_FAILURE;
+    topicAliasCommit(c);
+    return MQTT_SUCCESS;
+}
+
+
+// Resend in-flight publishes whose acknowledgement is overdue, and give up on those resent MQTT_MAX_RETRIES times.
+static void retryInflight(MQTTClient* c)
+{
+    int i;
+
+    for (i = 0; i < MAX_INFLIGHT_MESSAGES && c->isconnected; ++i)
+    {
+        InflightMessage* m = &c->inflight[i];
+        if ((c->inflight_used & (1UL << i)) == 0 || m->state == INFLIGHT_DONE || !TimerIsExpired(&m->retry_timer))
+            continue;
+        if (m->retries >= MQTT_MAX_RETRIES)
+            inflightComplete(c, i, MQTT_FAILURE);
+        else
+        {
+            Timer timer;
+            TimerInit(&timer);
+            TimerCountdownMS(&timer, 1000);
+            m->retries++;
+            sendInflight(c, i, 1, &timer);
+        }
+    }
+}
+
+
+// Resend the publishes still waiting for acknowledgement on a resumed session, as the broker may not have got them.
+static int inflightReplay(MQTTClient* c, Timer* timer)
+{
+    int i,
+        rc = MQTT_SUCCESS;
+
+    for (i = 0; i < MAX_INFLIGHT_MESSAGES && rc == MQTT_SUCCESS; ++i)
+    {
+        if ((c->inflight_used & (1UL << i)) && c->inflight[i].state != INFLIGHT_DONE)
+        {
+            c->inflight[i].retries = 0;
+            rc = sendInflight(c, i, 1, timer);
+        }
+    }
+    return rc;
+}
+
+
+// Fail the publishes still waiting for acknowledgement, the broker won't acknowledge them on a new session.
+static void inflightAbort(MQTTClient* c)
+{
+    int i;
+
+    for (i = 0; i < MAX_INFLIGHT_MESSAGES; ++i)
+    {
+        if ((c->inflight_used & (1UL << i)) && c->inflight[i].state != INFLIGHT_DONE)
+            inflightComplete(c, i, MQTT_FAILURE);
+    }
+}
+
+
+void MQTTClientInit(MQTTClient* c, Network* network, unsigned int command_timeout_ms,
+		unsigned char* sendbuf, size_t sendbuf_size, unsigned char* readbuf, size_t readbuf_size)
+{
+    int i;
+    c->ipstack = network;
+    
+    for (i = 0; i < MAX_MESSAGE_HANDLERS; ++i)
+        c->messageHandlers[i].topicFilter = 0;
+    c->command_timeout_ms = command_timeout_ms;
+    c->buf = sendbuf;
+    c->buf_size = sendbuf_size;
+    c->readbuf = readbuf;
+    c->readbuf_size = readbuf_size;
+    c->isconnected = 0;
+	c->connAckReceived = 0;
+	c->subAckReceived = 0;
+	c->unsubAckReceived = 0;
+    c->ping_outstanding = 0;
+    c->sessionPresent = 0;
+    c->MQTTVersion = 4;
+    c->receiveMaximum = 65535;
+    c->topicAliasMaximum = 0;
+    c->jitter_seed = 1;
+    c->srtt_ms = 0;
+    c->rttvar_ms = 0;
+    c->rtt_samples = 0;
+    c->defaultMessageHandler = NULL;
+	c->userData = NULL;
+	c->next_packetid = 1;
+	c->txbuf = NULL;
+	c->txbuf_size = 0;
+	c->txlen = 0;
+	c->corked = 0;
+	c->tx_flush_ms = 0;
+	c->nonblocking = 0;
+	c->rxlen = 0;
+	c->rxtotal = 0;
+	c->rxhdr = 0;
+	c->rxoffset = 0;
+	c->rxchunk = 0;
+	c->rxmode = RX_PACKET;
+	c->rxdropped = 0;
+	c->rxduplicate = 0;
+	c->feeding = 0;
+	for (i = 0; i < MQTT_MAX_INBOUND_IDS; ++i)
+		c->inbound[i].state = INBOUND_FREE;
+	c->inbound_next = 0;
+	c->chunkHandler = NULL;
+	c->inflight_used = 0;
+	for (i = 0; i < MAX_INFLIGHT_MESSAGES; ++i)
+	{
+		c->inflight[i].state = INFLIGHT_FREE;
+		TimerInit(&c->inflight[i].retry_timer);
+	}
+	c->inflightbuf = NULL;
+	c->inflightbuf_size = 0;
+	c->retry_ms = MQTT_RETRY_INTERVAL_MS;
+	c->aliasbuf = NULL;
+	c->aliasbuf_size = 0;
+	c->aliaslen = 0;
+	c->aliaspending = 0;
+	c->aliases = 0;
+	for (i = 0; i < MQTT_MAX_PENDING_SUBSCRIBES; ++i)
+	{
+		c->subscribes[i].id = 0;
+		TimerInit(&c->subscribes[i].timer);
+	}
+	TimerInit(&c->tx_flush_timer);
+    TimerInit(&c->ping_timer);
+	TimerInit(&c->last_received_timer);
+	TimerInit(&c->ping_response_timer);
+#if defined(MQTT_TASK)
+	MutexInit(&c->mutex);
+	MutexInit(&c->readMutex);
+#endif
+}
+
+
+// Number of bytes the receive parser wants next. The fixed header is taken a byte at a time so the parser never reads
+// past the end of the packet, after that the rest of the packet is wanted in one go, or as much of it as fits.
+static int rxWant(MQTTClient* c)
+{
+    size_t left = 0;
+
+    if (c->rxtotal == 0)
+        return 1;
+    if (c->rxmode == RX_PACKET)
+        return c->rxtotal - c->rxlen;
+    if (c->rxmode == RX_TOPIC)
+        return c->rxhdr - c->rxlen;
+    left = c->rxtotal - c->rxoffset - c->rxlen;
+    return (left < c->readbuf_size - c->rxlen) ? left : c->readbuf_size - c->rxlen;
+}
+
+
+static void rxReset(MQTTClient* c)
+{
+    c->rxlen = c->rxtotal = c->rxoffset = 0;
+    c->rxmode = RX_PACKET;
+}
+
+
+// Decide how to take a packet that is too big for readbuf, now that its fixed header is in readbuf.
+static void rxOversized(MQTTClient* c)
+{
+    MQTTHeader header = {0};
+
+    header.byte = c->readbuf[0];
+    c->rxoffset = 0;
+    if (header.bits.type == PUBLISH_MSG && c->rxlen + 2 <= c->readbuf_size)
+    {
+        c->rxmode = RX_TOPIC;
+        c->rxhdr = c->rxlen + 2; // the topic length comes first
+    }
+    else
+        c->rxmode = RX_DRAIN;
+}
+
+
+// Part of the header of a streamed PUBLISH has arrived. Work out how much of the packet to keep in readbuf from what is
+// in so far, the topic length first, then on MQTT 5 the properties length a byte at a time. Once all of that is in,
+// the payload can be streamed.
+static void rxTopic(MQTTClient* c)
+{
+    MQTTHeader header = {0};
+    int rem_len = 0;
+    size_t fixed = 1 + MQTTPacket_decodeBuf(&c->readbuf[1], &rem_len),
+        hdr = fixed + 2 + c->readbuf[fixed] * 256 + c->readbuf[fixed + 1];
+
+    header.byte = c->readbuf[0];
+    if (header.bits.qos > 0)
+        hdr += 2; // the packet id follows the topic
+    if (c->MQTTVersion >= 5)
+    {
+        // then the properties, their length is a variable byte integer
+        size_t i = hdr,
+            props = 0,
+            multiplier = 1;
+        while (1)
+        {
+            if (i >= c->rxhdr || i - hdr == 4)
+            {
+                hdr = (i - hdr == 4) ? c->readbuf_size : i + 1; // the next byte is needed, or the length is malformed
+                break;
+            }
+            props += (c->readbuf[i] & 127) * multiplier;
+            multiplier *= 128;
+            if ((c->readbuf[i++] & 128) == 0)
+            {
+                hdr = i + props;
+                break;
+            }
+        }
+    }
+    if (hdr >= c->readbuf_size || hdr >= c->rxtotal)
+        c->rxmode = RX_DRAIN; // no room left for the payload, or the packet is malformed
+    else if (hdr == c->rxhdr)
+        c->rxmode = RX_STREAM; // the topic, packet id and properties are in
+    else
+        c->rxhdr = hdr;
+}
+
+
+static void rxReceived(MQTTClient* c)
+{
+	if (c->keepAliveInterval > 0) {
+		keepaliveCountdown(c, &c->last_received_timer); // record the fact that we have successfully received a packet
+	}
+}
+
+
+// Account for n bytes that were added to readbuf at rxlen. Returns the packet type once a whole packet is in readbuf,
+// RX_CHUNK once a piece of a streamed payload is, 0 if more bytes are needed, or a failure code if the packet is
+// malformed.
+static int rxAdvance(MQTTClient* c, int n)
+{
+    MQTTHeader header = {0};
+    const size_t MAX_NO_OF_REMAINING_LENGTH_BYTES = 4;
+
+    c->rxlen += n;
+    if (c->rxtotal == 0 && c->rxlen >= 2)
+    {
+        if ((c->readbuf[c->rxlen - 1] & 128) == 0)
+        {
+            int rem_len = 0;
+            MQTTPacket_decodeBuf(&c->readbuf[1], &rem_len);
+            c->rxtotal = c->rxlen + rem_len;
+            if (c->rxtotal > c->readbuf_size)
+                rxOversized(c);
+        }
+        else if (c->rxlen > MAX_NO_OF_REMAINING_LENGTH_BYTES)
+        {
+            c->rxlen = 0;
+            return MQTT_FAILURE; /* bad data */
+        }
+    }
+    if (c->rxtotal == 0 && c->rxlen >= c->readbuf_size)
+    {
+        rxReset(c);
+        return MQTT_BUFFER_OVERFLOW;
+    }
+    if (c->rxtotal == 0)
+        return 0;
+
+    switch (c->rxmode)
+    {
+    case RX_TOPIC:
+        if (c->rxlen == c->rxhdr)
+            rxTopic(c);
+        return 0;
+    case RX_STREAM:
+        if (c->rxlen < c->readbuf_size && c->rxoffset + c->rxlen < c->rxtotal)
+            return 0;
+        c->rxchunk = c->rxlen - c->rxhdr;
+        c->rxoffset += c->rxchunk;
+        c->rxlen = c->rxhdr; // the next piece goes after the header again
+        rxReceived(c);
+        return RX_CHUNK;
+    case RX_DRAIN:
+        if (c->rxoffset + c->rxlen == c->rxtotal)
+        {
+            c->rxdropped++;
+            rxReset(c);
+            rxReceived(c);
+        }
+        else if (c->rxlen == c->readbuf_size)
+        {
+            c->rxoffset += c->rxlen;
+            c->rxlen = 0;
+        }
+        return 0;
+    }
+    if (c->rxlen < c->rxtotal)
+        return 0;
+
+    header.byte = c->readbuf[0];
+    c->rxlen = c->rxtotal = 0;
+    rxReceived(c);
+    return header.bits.type;
+}
+
+
+// Read until a whole packet is in readbuf or the timer expires. The parser state is kept in the client, so a packet
+// that is only partly received when the timer runs out is finished by the next call rather than thrown away.
+static int readPacket(MQTTClient* c, Timer* timer)
+{
+    int rc = 0;
+
+#if defined(MQTT_TASK)
+	MutexLock(&c->readMutex);
+#endif
+    // pull exactly the bytes the parser wants straight into readbuf
+    while (rc == 0)
+    {
+        int len = c->ipstack->mqttread(c->ipstack, &c->readbuf[c->rxlen], rxWant(c), TimerLeftMS(timer));
+        if (len <= 0)
+            rc = MQTT_FAILURE; // nothing more yet, what has arrived stays in readbuf
+        else
+            rc = rxAdvance(c, len);
+    }
+#if defined(MQTT_TASK)
+	MutexUnlock(&c->readMutex);
+#endif
+    return rc;
+}
+
+
+// Copy received data into readbuf until a packet is complete or the data runs out. Returns the number of bytes used,
+// and sets type to what rxAdvance returned for the last of them, so the caller can consume exactly those bytes
+// before handling the packet.
+static int rxFeed(MQTTClient* c, const unsigned char* data, int len, int* type)
+{
+    int used = 0;
+
+    *type = 0;
+    while (used < len && *type == 0)
+    {
+        int n = rxWant(c);
+        if (n > len - used)
+            n = len - used;
+        memcpy(&c->readbuf[c->rxlen], &data[used], n);
+        used += n;
+        *type = rxAdvance(c, n);
+    }
+    return used;
+}
+
+
+// assume topic filter and name is in correct format
+// # can only be at end
+// + and # can only be next to separator
+static char isTopicMatched(char* topicFilter, MQTTString* topicName)
+{
+    char* curf = topicFilter;
+    char* curn = topicName->lenstring.data;
+    char* curn_end = curn + topicName->lenstring.len;
+    
+    while (*curf && curn < curn_end)
+    {
+        if (*curn == '/' && *curf != '/')
+            break;
+        if (*curf != '+' && *curf != '#' && *curf != *curn)
+            break;
+        if (*curf == '+')
+        {   // skip until we meet the next separator, or end of string
+            char* nextpos = curn + 1;
+            while (nextpos < curn_end && *nextpos != '/')
+                nextpos = ++curn + 1;
+        }
+        else if (*curf == '#')
+            curn = curn_end - 1;    // skip until end of string
+        curf++;
+        curn++;
+    };
+    
+    return (curn == curn_end) && (*curf == '\0');
+}
+
+
+int deliverMessage(MQTTClient* c, MQTTString* topicName, MQTTMessage* message)
+{
+    int i;
+    int rc = MQTT_FAILURE;
+
+    // we have to find the right message handler - indexed by topic
+    for (i = 0; i < MAX_MESSAGE_HANDLERS; ++i)
+    {
+        if (c->messageHandlers[i].topicFilter != 0 && (MQTTPacket_equals(topicName, (char*)c->messageHandlers[i].topicFilter) ||
+                isTopicMatched((char*)c->messageHandlers[i].topicFilter, topicName)))
+        {
+            if (c->messageHandlers[i].fp != NULL)
+            {
+                MessageData md;
+                NewMessageData(&md, topicName, message);
+                c->messageHandlers[i].fp(&md, c->userData);
+                rc = MQTT_SUCCESS;
+            }
+        }
+    }
+    
+    if (rc == MQTT_FAILURE && c->defaultMessageHandler != NULL) 
+    {
+        MessageData md;
+        NewMessageData(&md, topicName, message);
+        c->defaultMessageHandler(&md, c->userData);
+        rc = MQTT_SUCCESS;
+    }   
+    
+    return rc;
+}
+
+
+int keepalive(MQTTClient* c)
+{
+    int rc = MQTT_FAILURE;
+
+    if (c->keepAliveInterval == 0)
+    {
+        rc = MQTT_SUCCESS;
+        goto exit;
+    }
+
+    // traffic both ways shows the connection is alive, a ping is only needed once one direction goes quiet
+    if (TimerIsExpired(&c->ping_timer) || TimerIsExpired(&c->last_received_timer))
+    {
+		if (!c->ping_outstanding)
+        {
+			Timer timer;
+            TimerInit(&timer);
+            TimerCountdownMS(&timer, 1000);
+            int len = MQTTSerialize_pingreq(c->buf, c->buf_size);
+			if (len > 0 && (rc = sendPacket(c, len, &timer)) == MQTT_SUCCESS) // send the ping packet
+			{
+				TimerCountdown(&c->ping_response_timer, c->keepAliveInterval);
+				c->ping_outstanding = 1;
+			}
+        }
+		else if (TimerIsExpired(&c->ping_response_timer))
+		{
+			c->isconnected = 0;
+		}
+    }
+
+exit:
+    return rc;
+}
+
+
+// Fold a round trip into the smoothed RTT and its variation, as TCP does (RFC 6298). The round trip is timed by a
+// timer started with interval when the request was sent.
+static void rttSample(MQTTClient* c, unsigned long interval, Timer* timer)
+{
+    int left = TimerLeftMS(timer);
+    unsigned long rtt;
+
+    if (left >= INT_MAX)
+        return; // TimerLeftMS is capped, how much of the interval has gone can't be told
+    left = (left > 0) ? left : 0;
+    rtt = ((unsigned long)left < interval) ? interval - left : 0;
+    if (c->rtt_samples++ == 0)
+    {
+        c->srtt_ms = rtt;
+        c->rttvar_ms = rtt / 2;
+        return;
+    }
+    c->rttvar_ms = (3 * c->rttvar_ms + ((c->srtt_ms > rtt) ? c->srtt_ms - rtt : rtt - c->srtt_ms)) / 4;
+    c->srtt_ms = (7 * c->srtt_ms + rtt) / 8;
+}
+
+
+// Time the round trip of an in-flight publish whose acknowledgement has arrived. A resent one isn't timed, as it
+// can't be told which of the sends was acknowledged (Karn's algorithm).
+static void inflightRtt(MQTTClient* c, int i)
+{
+    if (c->inflight[i].retries == 0)
+        rttSample(c, c->inflight[i].rto_ms, &c->inflight[i].retry_timer);
+}
+
+
+// Time the round trip of a SUBACK or UNSUBACK from the timer started with timeout before the request was sent. If it
+// didn't come, the round trip time is forgotten so the next wait is command_timeout_ms, in case the link got slower.
+static void ackRtt(MQTTClient* c, unsigned long timeout, Timer* timer, int acked)
+{
+    if (acked)
+        rttSample(c, timeout, timer);
+    else
+        c->rtt_samples = 0;
+}
+
+
+// Find the MQTTSubscribeAsync waiting for the SUBACK with packet id, or a free entry for id 0. Returns -1 if none is.
+static int subscribeFind(MQTTClient* c, unsigned short id)
+{
+    int i;
+
+    for (i = 0; i < MQTT_MAX_PENDING_SUBSCRIBES; ++i)
+    {
+        if (c->subscribes[i].id == id)
+            return i;
+    }
+    return -1;
+}
+
+
+// Free the entry of an MQTTSubscribeAsync that has completed, then tell its handler.
+static void subscribeComplete(MQTTClient* c, int i, int rc)
+{
+    unsigned short id = c->subscribes[i].id;
+    subscribeCompleteHandler fp = c->subscribes[i].fp;
+    void* context = c->subscribes[i].context;
+
+    c->subscribes[i].id = 0; // free before the handler runs, so it can subscribe again
+    if (fp != NULL)
+        fp(id, rc, context);
+}
+
+
+// Complete the MQTTSubscribeAsync the SUBACK in readbuf is for. Returns 0 if it isn't for one, so it's MQTTSubscribe's.
+static int subscribeAcked(MQTTClient* c)
+{
+    int grantedQoSs[MQTT_MAX_SUBSCRIBE_TOPICS];
+    int count = 0,
+        i = 0,
+        rc = 0;
+    unsigned short mypacketid;
+
+    if (c->MQTTVersion >= 5)
+        rc = MQTTV5Deserialize_suback(&mypacketid, MQTT_MAX_SUBSCRIBE_TOPICS, &count, grantedQoSs, c->readbuf, c->readbuf_size);
+    else
+        rc = MQTTDeserialize_suback(&mypacketid, MQTT_MAX_SUBSCRIBE_TOPICS, &count, grantedQoSs, c->readbuf, c->readbuf_size);
+    if (rc != 1 || (i = subscribeFind(c, mypacketid)) < 0)
+        return 0;
+    ackRtt(c, c->subscribes[i].timeout_ms, &c->subscribes[i].timer, 1);
+    rc = MQTT_SUCCESS;
+    while (count-- > 0)
+    {
+        if (grantedQoSs[count] >= 0x80)
+            rc = MQTT_FAILURE; // refused, MQTT 5 has several failure reason codes
+    }
+    subscribeComplete(c, i, rc);
+    return 1;
+}
+
+
+// Give up on the MQTTSubscribeAsync calls whose SUBACK is overdue.
+static void expireSubscribes(MQTTClient* c)
+{
+    int i;
+
+    for (i = 0; i < MQTT_MAX_PENDING_SUBSCRIBES; ++i)
+    {
+        if (c->subscribes[i].id != 0 && TimerIsExpired(&c->subscribes[i].timer))
+        {
+            ackRtt(c, c->subscribes[i].timeout_ms, &c->subscribes[i].timer, 0);
+            subscribeComplete(c, i, MQTT_FAILURE);
+        }
+    }
+}
+
+
+// Fail the MQTTSubscribeAsync calls still waiting, their SUBACK won't come on a new connection.
+static void subscribeAbort(MQTTClient* c)
+{
+    int i;
+
+    for (i = 0; i < MQTT_MAX_PENDING_SUBSCRIBES; ++i)
+    {
+        if (c->subscribes[i].id != 0)
+            subscribeComplete(c, i, MQTT_FAILURE);
+    }
+}
+
+
+// Read the PUBLISH at the start of readbuf, of which buflen bytes are there. MQTT 5 properties are skipped.
+static int deserializePublish(MQTTClient* c, MQTTString* topicName, MQTTMessage* msg, int buflen)
+{
+    int intQoS,
+        intPayloadLen, // payloadlen is a size_t, so don't let the deserializer write an int into it
+        rc = 0;
+
+    if (c->MQTTVersion >= 5)
+        rc = MQTTV5Deserialize_publish(&msg->dup, &intQoS, &msg->retained, &msg->id, topicName, NULL,
+            (unsigned char**)&msg->payload, &intPayloadLen, c->readbuf, buflen);
+    else
+        rc = MQTTDeserialize_publish(&msg->dup, &intQoS, &msg->retained, &msg->id, topicName,
+            (unsigned char**)&msg->payload, &intPayloadLen, c->readbuf, buflen);
+    if (rc == 1)
+    {
+        msg->qos = (enum QoS)intQoS;
+        msg->payloadlen = intPayloadLen;
+    }
+    return rc;
+}
+
+
+// Send an acknowledgement. It gets a timer of its own, the one of the read that brought the packet in may have run out.
+static int sendAck(MQTTClient* c, unsigned char type, unsigned short id)
+{
+    Timer timer;
+    int len = MQTTSerialize_ack(c->buf, c->buf_size, type, 0, id);
+
+    if (len <= 0)
+        return MQTT_FAILURE;
+    TimerInit(&timer);
+    TimerCountdownMS(&timer, c->command_timeout_ms);
+    return sendPacket(c, len, &timer);
+}
+
+
+// Find the entry of an inbound packet id in the table of those recently acknowledged, -1 if it isn't there.
+static int inboundFind(MQTTClient* c, unsigned short id)
+{
+    int i;
+
+    for (i = 0; i < MQTT_MAX_INBOUND_IDS; ++i)
+    {
+        if (c->inbound[i].state != INBOUND_FREE && c->inbound[i].id == id)
+            return i;
+    }
+    return -1;
+}
+
+
+// Check if an inbound publish has already been handled. A QoS2 message is a duplicate until its PUBREL arrives, a QoS1
+// message only when it is marked DUP, as the broker may reuse the packet id for a new message once it has its PUBACK.
+static int inboundDuplicate(MQTTClient* c, MQTTMessage* msg)
+{
+    int i;
+
+    if (msg->qos == QOS0 || (i = inboundFind(c, msg->id)) < 0)
+        return 0;
+    if (msg->qos == QOS2)
+        return c->inbound[i].state == INBOUND_PUBREL;
+    return msg->dup && c->inbound[i].state == INBOUND_PUBACK;
+}
+
+
+// Acknowledge a QoS1 or QoS2 message that has been handled, and remember its packet id so a redelivery of it can be
+// spotted. The table is a ring, the oldest id is forgotten to make room.
+static int ackPublish(MQTTClient* c, MQTTMessage* msg)
+{
+    int i;
+
+    if (msg->qos == QOS0)
+        return MQTT_SUCCESS;
+    if ((i = inboundFind(c, msg->id)) < 0)
+    {
+        i = c->inbound_next;
+        c->inbound_next = (c->inbound_next + 1) % MQTT_MAX_INBOUND_IDS;
+    }
+    c->inbound[i].id = msg->id;
+    c->inbound[i].state = (msg->qos == QOS1) ? INBOUND_PUBACK : INBOUND_PUBREL;
+    return sendAck(c, (msg->qos == QOS1) ? PUBACK_MSG : PUBREC_MSG, msg->id);
+}
+
+
+// Act on a packet that has been received into readbuf.
+static int processPacket(MQTTClient* c, int packet_type)
+{
+    int rc = MQTT_SUCCESS;
+
+    switch (packet_type)
+    {
+		case CONNACK_MSG:
+			c->connAckReceived = 1;
+			break;
+		case PUBACK_MSG:
+		case PUBCOMP_MSG:
+		{
+			unsigned short mypacketid;
+			unsigned char dup, type, reason;
+			int i;
+			// match the acknowledgement to its publish by packet id, so several can be in flight at once
+			if (MQTTV5Deserialize_ack(&type, &dup, &mypacketid, &reason, c->readbuf, c->readbuf_size) == 1 &&
+				(i = inflightFind(c, mypacketid)) >= 0 &&
+				c->inflight[i].state == ((packet_type == PUBACK_MSG) ? INFLIGHT_PUBACK : INFLIGHT_PUBCOMP))
+			{
+				inflightRtt(c, i);
+				inflightComplete(c, i, (reason >= 0x80) ? MQTT_FAILURE : MQTT_SUCCESS); // MQTT 5 can refuse a publish
+			}
+			break;
+		}
+		case SUBACK_MSG:
+			if (!subscribeAcked(c))
+				c->subAckReceived = 1;
+			break;
+		case UNSUBACK_MSG:
+			c->unsubAckReceived = 1;
+			break;
+        case PUBLISH_MSG:
+        {
+            MQTTString topicName;
+            MQTTMessage msg;
+            if (deserializePublish(c, &topicName, &msg, c->readbuf_size) != 1)
+                break;
+            if (!inboundDuplicate(c, &msg)) // a redelivered message is acknowledged again, but not handled again
+                deliverMessage(c, &topicName, &msg);
+            rc = ackPublish(c, &msg);
+            break;
+        }
+        case RX_CHUNK:
+        {
+            MQTTString topicName;
+            MQTTMessage msg;
+            size_t total = c->rxtotal - c->rxhdr;
+            if (deserializePublish(c, &topicName, &msg, c->rxhdr) != 1)
+            {
+                // a malformed header, throw the rest of the packet away. What has been received of it is rxoffset +
+                // rxlen, which is how RX_DRAIN counts it, and RX_DRAIN counts it as dropped when it ends.
+                if (c->rxoffset < total)
+                    c->rxmode = RX_DRAIN;
+                else
+                {
+                    c->rxdropped++;
+                    rxReset(c);
+                }
+                rc = MQTT_FAILURE;
+                break;
+            }
+            msg.payload = &c->readbuf[c->rxhdr];
+            msg.payloadlen = c->rxchunk;
+            if (c->rxoffset == c->rxchunk)
+                c->rxduplicate = inboundDuplicate(c, &msg); // decided on the first piece, for all of them
+            if (c->chunkHandler != NULL && !c->rxduplicate)
+            {
+                MessageData md;
+                NewMessageData(&md, &topicName, &msg);
+                c->chunkHandler(&md, c->rxoffset - c->rxchunk, total, c->userData);
+            }
+            if (c->rxoffset < total)
+                break; // more to come
+            if (c->chunkHandler == NULL)
+                c->rxdropped++;
+            rxReset(c);
+            rc = ackPublish(c, &msg); // acknowledged even if dropped, resending it wouldn't make it fit
+            break;
+        }
+        case PUBREC_MSG:
+        {
+            unsigned short mypacketid;
+            unsigned char dup, type, reason;
+            int i;
+            if (MQTTV5Deserialize_ack(&type, &dup, &mypacketid, &reason, c->readbuf, c->readbuf_size) != 1)
+            {
+                rc = MQTT_FAILURE;
+                goto exit;
+            }
+            if (reason >= 0x80)
+            {
+                // an MQTT 5 broker refused the publish, which ends the exchange without a PUBREL
+                if ((i = inflightFind(c, mypacketid)) >= 0 && c->inflight[i].state == INFLIGHT_PUBREC)
+                    inflightComplete(c, i, MQTT_FAILURE);
+                break;
+            }
+            if ((i = inflightFind(c, mypacketid)) >= 0 && c->inflight[i].state == INFLIGHT_PUBREC)
+            {
+                inflightRtt(c, i);
+                c->inflight[i].state = INFLIGHT_PUBCOMP; // a lost PUBREL is resent like a lost PUBLISH
+                c->inflight[i].retries = 0;
+                inflightArm(c, i);
+            }
+            if ((rc = sendAck(c, PUBREL_MSG, mypacketid)) != MQTT_SUCCESS) // send the PUBREL_MSG packet
+                goto exit; // there was a problem
+            break;
+        }
+        case PUBREL_MSG:
+        {
+            unsigned short mypacketid;
+            unsigned char dup, type;
+            int i;
+            if (MQTTDeserialize_ack(&type, &dup, &mypacketid, c->readbuf, c->readbuf_size) != 1)
+            {
+                rc = MQTT_FAILURE;
+                goto exit;
+            }
+            // the QoS2 message is complete, a new one may now come with the same packet id
+            if ((i = inboundFind(c, mypacketid)) >= 0 && c->inbound[i].state == INBOUND_PUBREL)
+                c->inbound[i].state = INBOUND_FREE;
+            rc = sendAck(c, PUBCOMP_MSG, mypacketid); // also for an id we don't know, the PUBCOMP may have been lost
+            break;
+        }
+        case PINGRESP_MSG:
+            if (c->ping_outstanding)
+            {
+                // the response timer started at the keepalive interval when the ping was sent
+                rttSample(c, c->keepAliveInterval * 1000UL, &c->ping_response_timer);
+            }
+            c->ping_outstanding = 0;
+            break;
+        case DISCONNECT_MSG:
+            c->isconnected = 0; // an MQTT 5 broker closing the connection
+            break;
+    }
+exit:
+    return rc;
+}
+
+
+// Send what is waiting in the transmit buffer, unless the client is corked.
+static void sendQueued(MQTTClient* c)
+{
+    if (c->txlen > 0 && !c->corked && c->nonblocking)
+        drainPackets(c);
+    else if (c->txlen > 0 && !c->corked)
+        flushPackets(c);
+}
+
+
+static int earlier(int left, Timer* timer)
+{
+    int ms = TimerLeftMS(timer);
+    return (ms < left) ? ms : left;
+}
+
+
+// Time until the client next has something to do, a keepalive ping, a resend, a subscribe timing out or a queued flush,
+// but no more than left.
+static int nextDeadline(MQTTClient* c, int left)
+{
+    int i;
+
+    if (c->keepAliveInterval > 0 && c->ping_outstanding)
+        left = earlier(left, &c->ping_response_timer);
+    else if (c->keepAliveInterval > 0)
+        left = earlier(earlier(left, &c->ping_timer), &c->last_received_timer);
+    for (i = 0; i < MAX_INFLIGHT_MESSAGES; ++i)
+    {
+        if ((c->inflight_used & (1UL << i)) && c->inflight[i].state != INFLIGHT_DONE)
+            left = earlier(left, &c->inflight[i].retry_timer);
+    }
+    for (i = 0; i < MQTT_MAX_PENDING_SUBSCRIBES; ++i)
+    {
+        if (c->subscribes[i].id != 0)
+            left = earlier(left, &c->subscribes[i].timer);
+    }
+    if (c->txlen > 0 && !c->corked && c->tx_flush_ms > 0)
+        left = earlier(left, &c->tx_flush_timer);
+    return (left > 0) ? left : 0; // a deadline that has passed is due now
+}
+
+
+// Do the work whose deadline has passed, the same deadlines nextDeadline looks at.
+static void runDeadlines(MQTTClient* c)
+{
+    keepalive(c);
+    retryInflight(c);
+    expireSubscribes(c);
+}
+
+
+int cycle(MQTTClient* c, Timer* timer)
+{
+    // don't leave queued packets waiting behind a blocking read
+    sendQueued(c);
+
+    // read the socket, see what work is due
+    unsigned short packet_type = readPacket(c, timer);
+    int rc = processPacket(c, packet_type);
+
+    if (rc == MQTT_SUCCESS)
+    {
+        runDeadlines(c);
+        rc = packet_type;
+    }
+    return rc;
+}
+
+
+int MQTTYield(MQTTClient* c, int timeout_ms)
+{
+    int rc = MQTT_SUCCESS;
+    Timer timer;
+
+    TimerInit(&timer);
+    TimerCountdownMS(&timer, timeout_ms);
+
+	do
+    {
+        if (cycle(c, &timer) == MQTT_FAILURE)
+        {
+            rc = MQTT_FAILURE;
+            break;
+        }
+	} while (!TimerIsExpired(&timer));
+        
+    return rc;
+}
+
+
+void MQTTRun(void* parm)
 {
-	Timer timer;
 	MQTTClient* c = (MQTTClient*)parm;
+#if defined(MQTT_TASK)
+	unsigned char* data;
+	int ms;
+
+	while (1)
+	{
+		// Wait for data holding only readMutex, so other tasks can publish while nothing is arriving, then take
+		// the client lock to handle what came in and any deadline that is due.
+		MutexLock(&c->mutex);
+		ms = nextDeadline(c, 500); /* Don't wait too long if no traffic is incoming */
+		MutexUnlock(&c->mutex);
+		MutexLock(&c->readMutex);
+		c->ipstack->mqttpeek(c->ipstack, &data, ms);
+		MutexUnlock(&c->readMutex);
+		MQTTPoll(c, NULL);
+	}
+#else
+	Timer timer;
+
+	TimerInit(&timer);
+
+	while (1)
+	{
+		TimerCountdownMS(&timer, 500); /* Don't wait too long if no traffic is incoming */
+		cycle(c, &timer);
+	} 
+#endif
+}
+
+
+#if defined(MQTT_TASK)
+int MQTTStartTask(MQTTClient* client)
+{
+	return ThreadStart(&client->thread, &MQTTRun, client);
+}
+#endif
+
+
+int waitfor(MQTTClient* c, int packet_type, Timer* timer)
+{
+    int rc = MQTT_FAILURE;
+    
+	// Use bool values to determine if a packet type has been received. This only works if waitfor is 
+	// called once at a time per type. However, it can be called with a different type at the same 
+	// time, for instance, while waiting for a subscription acknowledgement (SUBACK_MSG) we could 
+	// publish a QoS1 message. Publish acknowledgements are matched to their in-flight slot by packet id instead.
+	switch (packet_type)
+	{
+	case CONNACK_MSG:
+		c->connAckReceived = 0;
+		break;
+	case SUBACK_MSG:
+		c->subAckReceived = 0;
+		break;
+	case UNSUBACK_MSG:
+		c->unsubAckReceived = 0;
+		break;
+	}
+
+	do
+	{
+		switch (packet_type)
+		{
+		case CONNACK_MSG:
+			if (c->connAckReceived) {
+				c->connAckReceived = 0;
+				return packet_type;
+			}
+			break;
+		case SUBACK_MSG:
+			if (c->subAckReceived) {
+				c->subAckReceived = 0;
+				return packet_type;
+			}
+			break;
+		case UNSUBACK_MSG:
+			if (c->unsubAckReceived) {
+				c->unsubAckReceived = 0;
+				return packet_type;
+			}
+			break;
+		}
+		if (TimerIsExpired(timer) || c->feeding)
+			break; // we timed out, or are called from MQTTFeed and mustn't read the network
+		cycle(c, timer);
+	} while (1);
+    
+    return rc;
+}
+
+
+int MQTTConnect(MQTTClient* c, MQTTPacket_connectData* options)
+{
+    Timer connect_timer,
+        connack_timer;
+    int rc = MQTT_FAILURE;
+    MQTTPacket_connectData default_options = MQTTPacket_connectData_initializer;
+    int len = 0;
+
+#if defined(MQTT_TASK)
+	MutexLock(&c->mutex);
+#endif
+	if (c->isconnected) /* don't send connect packet again if we are already connected */
+		goto exit;
+    
+    TimerInit(&connect_timer);
+    TimerCountdownMS(&connect_timer, c->command_timeout_ms);
+
+    if (options == 0)
+        options = &default_options; /* set default options if none were supplied */
+    
+    c->keepAliveInterval = options->keepAliveInterval;
+    c->MQTTVersion = options->MQTTVersion;
+    seedJitter(c, &options->clientID);
+	keepaliveCountdown(c, &c->ping_timer);
+    c->txlen = 0; /* anything still queued belongs to the previous connection */
+    rxReset(c); /* and so does any packet that was partly received */
+    c->aliases = 0; /* and the topic aliases */
+    subscribeAbort(c); /* and the subscribes waiting for a SUBACK */
+    c->aliaslen = 0;
+    c->receiveMaximum = 65535;
+    c->topicAliasMaximum = 0;
+    if ((len = MQTTSerialize_connect(c->buf, c->buf_size, options)) <= 0)
+        goto exit;
+    if ((rc = sendPacket(c, len, &connect_timer)) != MQTT_SUCCESS)  // send the connect packet
+        goto exit; // there was a problem
+
+    if (c->keepAliveInterval > 0)
+        keepaliveCountdown(c, &c->last_received_timer);
+
+    // this will be a blocking call, wait for the connack. The wait isn't taken from the round trip time, the broker may
+    // take a while to authenticate us, so it gets the whole command_timeout_ms from when the connect was sent
+    TimerInit(&connack_timer);
+    TimerCountdownMS(&connack_timer, c->command_timeout_ms);
+    if (waitfor(c, CONNACK_MSG, &connack_timer) == CONNACK_MSG)
+    {
+        unsigned char connack_rc = 255;
+        c->sessionPresent = 0;
+        if (c->MQTTVersion >= 5)
+        {
+            MQTTProperties properties;
+            if (MQTTV5Deserialize_connack(&c->sessionPresent, &connack_rc, &properties, c->readbuf, c->readbuf_size) == 1)
+            {
+                rc = connack_rc;
+                c->receiveMaximum = properties.receiveMaximum;
+                c->topicAliasMaximum = properties.topicAliasMaximum;
+                if (properties.serverKeepAlive >= 0 && (unsigned int)properties.serverKeepAlive != c->keepAliveInterval)
+                {
+                    // the broker decides the keepalive interval
+                    c->keepAliveInterval = properties.serverKeepAlive;
+                    keepaliveCountdown(c, &c->ping_timer);
+                    keepaliveCountdown(c, &c->last_received_timer);
+                }
+            }
+            else
+                rc = MQTT_FAILURE;
+        }
+        else if (MQTTDeserialize_connack(&c->sessionPresent, &connack_rc, c->readbuf, c->readbuf_size) == 1)
+            rc = connack_rc;
+        else
+            rc = MQTT_FAILURE;
+    }
+    else
+    {
+        c->rtt_samples = 0; // the link may have got slower, wait command_timeout_ms next time
+        rc = MQTT_FAILURE;
+    }
+    
+exit:
+    if (rc == MQTT_SUCCESS)
+    {
+        c->isconnected = 1;
+        if (options->cleansession || !c->sessionPresent)
+        {
+            int i;
+            inflightAbort(c);
+            for (i = 0; i < MQTT_MAX_INBOUND_IDS; ++i)
+                c->inbound[i].state = INBOUND_FREE; // a new session starts with no messages delivered
+        }
+        else if ((rc = inflightReplay(c, &connect_timer)) != MQTT_SUCCESS)
+            c->isconnected = 0;
+    }
 
-	TimerInit(&timer);
+#if defined(MQTT_TASK)
+	MutexUnlock(&c->mutex);
+#endif
 
-	while (1)
-	{
+    return rc;
+}
+
+
+int MQTTSubscribe(MQTTClient* c, const char* topicFilter, enum QoS qos, messageHandler messageHandler)
+{ 
+    int rc = MQTT_FAILURE;  
+    Timer timer;
+    unsigned long timeout;
+    int len = 0;
+    MQTTString topic = MQTTString_initializer;
+    topic.cstring = (char *)topicFilter;
+    
 #if defined(MQTT_TASK)
-		MutexLock(&c->mutex);
+	MutexLock(&c->mutex);
 #endif
-		TimerCountdownMS(&timer, 500); /* Don't wait too long if no traffic is incoming */
-		cycle(c, &timer);
+	if (!c->isconnected)
+		goto exit;
+
+    TimerInit(&timer);
+    timeout = ackTimeout(c);
+    TimerCountdownMS(&timer, timeout);
+    
+    if (c->MQTTVersion >= 5)
+        len = MQTTV5Serialize_subscribe(c->buf, c->buf_size, 0, getNextPacketId(c), 1, &topic, (int*)&qos);
+    else
+        len = MQTTSerialize_subscribe(c->buf, c->buf_size, 0, getNextPacketId(c), 1, &topic, (int*)&qos);
+    if (len <= 0)
+        goto exit;
+    if ((rc = sendPacket(c, len, &timer)) != MQTT_SUCCESS) // send the subscribe packet
+        goto exit;             // there was a problem
+    
+    if (waitfor(c, SUBACK_MSG, &timer) == SUBACK_MSG)      // wait for suback 
+    {
+        int count = 0, grantedQoS = -1;
+        unsigned short mypacketid;
+        ackRtt(c, timeout, &timer, 1);
+        if (c->MQTTVersion >= 5 && MQTTV5Deserialize_suback(&mypacketid, 1, &count, &grantedQoS, c->readbuf, c->readbuf_size) == 1)
+            rc = (grantedQoS >= 0x80) ? 0x80 : grantedQoS; // MQTT 5 has several failure reason codes
+        else if (c->MQTTVersion < 5 && MQTTDeserialize_suback(&mypacketid, 1, &count, &grantedQoS, c->readbuf, c->readbuf_size) == 1)
+            rc = grantedQoS; // 0, 1, 2 or 0x80 
+        if (rc != 0x80)
+        {
+            int i;
+            for (i = 0; i < MAX_MESSAGE_HANDLERS; ++i)
+            {
+                if (c->messageHandlers[i].topicFilter == 0)
+                {
+                    c->messageHandlers[i].topicFilter = topicFilter;
+                    c->messageHandlers[i].fp = messageHandler;
+                    rc = 0;
+                    break;
+                }
+            }
+        }
+    }
+    else 
+    {
+        ackRtt(c, timeout, &timer, 0);
+        rc = MQTT_FAILURE;
+    }
+        
+exit:
 #if defined(MQTT_TASK)
-		MutexUnlock(&c->mutex);
+	MutexUnlock(&c->mutex);
 #endif
-	} 
+    return rc;
 }
 
 
+int MQTTUnsubscribe(MQTTClient* c, const char* topicFilter)
+{   
+    int rc = MQTT_FAILURE;
+    Timer timer;    
+    unsigned long timeout;
+    MQTTString topic = MQTTString_initializer;
+    topic.cstring = (char *)topicFilter;
+    int len = 0;
+
 #if defined(MQTT_TASK)
-int MQTTStartTask(MQTTClient* client)
+	MutexLock(&c->mutex);
+#endif
+	if (!c->isconnected)
+		goto exit;
+
+    TimerInit(&timer);
+    timeout = ackTimeout(c);
+    TimerCountdownMS(&timer, timeout);
+    
+    if (c->MQTTVersion >= 5)
+        len = MQTTV5Serialize_unsubscribe(c->buf, c->buf_size, 0, getNextPacketId(c), 1, &topic);
+    else
+        len = MQTTSerialize_unsubscribe(c->buf, c->buf_size, 0, getNextPacketId(c), 1, &topic);
+    if (len <= 0)
+        goto exit;
+    if ((rc = sendPacket(c, len, &timer)) != MQTT_SUCCESS) // send the subscribe packet
+        goto exit; // there was a problem
+    
+    if (waitfor(c, UNSUBACK_MSG, &timer) == UNSUBACK_MSG)
+    {
+        unsigned short mypacketid;  // should be the same as the packetid above
+        ackRtt(c, timeout, &timer, 1);
+        if (MQTTDeserialize_unsuback(&mypacketid, c->readbuf, c->readbuf_size) == 1)
+            rc = 0; 
+    }
+    else
+    {
+        ackRtt(c, timeout, &timer, 0);
+        rc = MQTT_FAILURE;
+    }
+    
+exit:
+#if defined(MQTT_TASK)
+	MutexUnlock(&c->mutex);
+#endif
+    return rc;
+}
+
+
+// Run one cycle, but don't let the read block past the time the next in-flight publish is due to be resent.
+static void cycleInflight(MQTTClient* c, Timer* timer)
 {
-	return ThreadStart(&client->thread, &MQTTRun, client);
+    Timer wait;
+
+    TimerInit(&wait);
+    TimerCountdownMS(&wait, nextDeadline(c, TimerLeftMS(timer)));
+    cycle(c, &wait);
 }
-#endif
 
 
-int waitfor(MQTTClient* c, int packet_type, Timer* timer)
+// Wait for an in-flight slot to free up. Returns the slot, or -1 if the timer expired, the connection was lost or
+// MQTTFeed is running, which means the network can't be read.
+static int waitForSlot(MQTTClient* c, Timer* timer)
+{
+    int i;
+
+    while ((i = inflightAlloc(c)) < 0 && c->isconnected && !c->feeding && !TimerIsExpired(timer))
+        cycleInflight(c, timer);
+    return i;
+}
+
+
+int MQTTPublish(MQTTClient* c, const char* topicName, MQTTMessage* message)
 {
     int rc = MQTT_FAILURE;
-    
-	// Use bool values to determine if a packet type has been received. This only works if waitfor is 
-	// called once at a time per type. However, it can be called with a different type at the same 
-	// time, for instance, while waiting for a subscription acknowledgement (SUBACK_MSG) we could 
-	// publish a QoS1 message and wait for the acknowledgement (PUBACK_MSG).
-	switch (packet_type)
-	{
-	case CONNACK_MSG:
-		c->connAckReceived = 0;
-		break;
-	case SUBACK_MSG:
-		c->subAckReceived = 0;
-		break;
-	case UNSUBACK_MSG:
-		c->unsubAckReceived = 0;
-		break;
-	case PUBACK_MSG:
-		c->pubAckReceived = 0;
-		break;
-	case PUBCOMP_MSG:
-		c->pubCompReceived = 0;
-		break;
-	}
+    Timer timer;   
+    NetworkVector vectors[MAX_PACKET_VECTORS];
+    int count = 0;
+    int i = -1;
 
-	do
-	{
-		switch (packet_type)
-		{
-		case CONNACK_MSG:
-			if (c->connAckReceived) {
-				c->connAckReceived = 0;
-				return packet_type;
-			}
-			break;
-		case SUBACK_MSG:
-			if (c->subAckReceived) {
-				c->subAckReceived = 0;
-				return packet_type;
-			}
-			break;
-		case UNSUBACK_MSG:
-			if (c->unsubAckReceived) {
-				c->unsubAckReceived = 0;
-				return packet_type;
-			}
-			break;
-		case PUBACK_MSG:
-			if (c->pubAckReceived) {
-				c->pubAckReceived = 0;
-				return packet_type;
-			}
-			break;
-		case PUBCOMP_MSG:
-			if (c->pubCompReceived) {
-				c->pubCompReceived = 0;
-				return packet_type;
-			}
-			break;
-		}
-		if (TimerIsExpired(timer))
-			break; // we timed out
-		cycle(c, timer);
-	} while (1);
+#if defined(MQTT_TASK)
+	MutexLock(&c->mutex);
+#endif
+	if (!c->isconnected)
+		goto exit;
+
+    TimerInit(&timer);
+    TimerCountdownMS(&timer, c->command_timeout_ms);
+
+    if (message->qos == QOS1 || message->qos == QOS2)
+    {
+        // take an in-flight slot so the acknowledgement can be told apart from those of other publishes
+        InflightMessage* m;
+        if (c->feeding || (i = waitForSlot(c, &timer)) < 0)
+            goto exit; // a handler called from MQTTFeed can't wait for the acknowledgement
+        m = &c->inflight[i];
+        m->waiter = 1;
+        m->topicName = topicName;
+        m->payload = message->payload;
+        m->payloadlen = message->payloadlen;
+        m->qos = message->qos;
+        m->retained = message->retained;
+        m->state = (message->qos == QOS1) ? INFLIGHT_PUBACK : INFLIGHT_PUBREC;
+        message->id = m->id = getNextPacketId(c);
+        if ((rc = sendInflight(c, i, 0, &timer)) != MQTT_SUCCESS)
+            goto exit;
+        // resends happen in cycle at the round trip time, the topic and payload stay valid because we don't return
+        // until it's done or command_timeout_ms has passed, whichever comes first
+        while (m->state != INFLIGHT_DONE && c->isconnected && !TimerIsExpired(&timer))
+            cycleInflight(c, &timer);
+        rc = (m->state == INFLIGHT_DONE) ? m->rc : MQTT_FAILURE;
+        goto exit;
+    }
+
+    // send the header, topic and payload from where they are rather than copying them into c->buf
+    if ((count = publishVectors(c, vectors, topicName, message->qos, message->retained, 0, 0, message->payload, message->payloadlen)) == 0)
+        goto exit;
+    if (c->nonblocking && c->txbuf)
+        rc = offerPacketv(c, vectors, count); // QUEUED and WOULD_BLOCK are passed back to the caller
+    else
+        rc = queuePacketv(c, vectors, count, &timer); // QoS0 packets can share a write with the packets around them
+    if (rc >= 0)
+        topicAliasCommit(c);
     
+exit:
+    if (i >= 0)
+        inflightFree(c, i);
+#if defined(MQTT_TASK)
+	MutexUnlock(&c->mutex);
+#endif
+    return rc;
+}
+
+
+int MQTTPublishAsync(MQTTClient* c, const char* topicName, MQTTMessage* message, publishCompleteHandler handler, void* context)
+{
+    int rc = MQTT_FAILURE;
+    Timer timer;
+    InflightMessage* m;
+    size_t slot_size = c->inflightbuf_size / MAX_INFLIGHT_MESSAGES;
+    size_t topiclen = strlen(topicName) + 1;
+    unsigned char* storage;
+    int i = -1;
+
+    if (message->qos == QOS0)
+        return MQTTPublish(c, topicName, message);
+
+#if defined(MQTT_TASK)
+	MutexLock(&c->mutex);
+#endif
+	if (!c->isconnected)
+		goto exit;
+    if (c->inflightbuf == NULL || topiclen + message->payloadlen > slot_size)
+    {
+        rc = MQTT_BUFFER_OVERFLOW;
+        goto exit;
+    }
+
+    TimerInit(&timer);
+    TimerCountdownMS(&timer, c->command_timeout_ms);
+
+    if (c->nonblocking)
+        i = inflightAlloc(c);
+    else
+        i = waitForSlot(c, &timer);
+    if (i < 0)
+    {
+        rc = c->nonblocking ? MQTT_WOULD_BLOCK : MQTT_FAILURE;
+        goto exit;
+    }
+
+    // keep our own copy, the caller's topic and payload may be gone before the publish is acknowledged
+    m = &c->inflight[i];
+    storage = &c->inflightbuf[i * slot_size];
+    memcpy(storage, topicName, topiclen);
+    memcpy(&storage[topiclen], message->payload, message->payloadlen);
+    m->waiter = 0;
+    m->topicName = (const char*)storage;
+    m->payload = &storage[topiclen];
+    m->payloadlen = message->payloadlen;
+    m->qos = message->qos;
+    m->retained = message->retained;
+    m->fp = handler;
+    m->context = context;
+    m->state = (message->qos == QOS1) ? INFLIGHT_PUBACK : INFLIGHT_PUBREC;
+    message->id = m->id = getNextPacketId(c);
+    if ((rc = sendInflight(c, i, 0, &timer)) != MQTT_SUCCESS)
+        inflightFree(c, i);
+
+exit:
+#if defined(MQTT_TASK)
+	MutexUnlock(&c->mutex);
+#endif
+    return rc;
+}
+
+
+void MQTTSetInflightBuffer(MQTTClient* c, unsigned char* buf, size_t buf_size)
+{
+#if defined(MQTT_TASK)
+	MutexLock(&c->mutex);
+#endif
+    c->inflightbuf = buf;
+    c->inflightbuf_size = buf ? buf_size : 0;
+#if defined(MQTT_TASK)
+	MutexUnlock(&c->mutex);
+#endif
+}
+
+
+void MQTTSetTopicAliasBuffer(MQTTClient* c, unsigned char* buf, size_t buf_size)
+{
+#if defined(MQTT_TASK)
+	MutexLock(&c->mutex);
+#endif
+    c->aliasbuf = buf;
+    c->aliasbuf_size = buf ? buf_size : 0;
+    c->aliaslen = 0;
+    c->aliases = 0;
+#if defined(MQTT_TASK)
+	MutexUnlock(&c->mutex);
+#endif
+}
+
+
+int MQTTInflight(MQTTClient* c)
+{
+    int rc = 0;
+
+#if defined(MQTT_TASK)
+	MutexLock(&c->mutex);
+#endif
+    rc = inflightCount(c);
+#if defined(MQTT_TASK)
+	MutexUnlock(&c->mutex);
+#endif
     return rc;
 }
 
 
-int MQTTConnect(MQTTClient* c, MQTTPacket_connectData* options)
+int MQTTSubscribeAsync(MQTTClient* c, int count, const char* topicFilters[], enum QoS qos,
+    subscribeCompleteHandler handler, void* context)
 {
-    Timer connect_timer;
     int rc = MQTT_FAILURE;
-    MQTTPacket_connectData default_options = MQTTPacket_connectData_initializer;
-    int len = 0;
+    Timer timer;
+    MQTTString topics[MQTT_MAX_SUBSCRIBE_TOPICS];
+    int requestedQoSs[MQTT_MAX_SUBSCRIBE_TOPICS];
+    NetworkVector vector;
+    unsigned short id = 0;
+    int i = -1,
+        len = 0;
+
+    if (count <= 0 || count > MQTT_MAX_SUBSCRIBE_TOPICS)
+        return MQTT_BUFFER_OVERFLOW;
 
 #if defined(MQTT_TASK)
 	MutexLock(&c->mutex);
 #endif
-	if (c->isconnected) /* don't send connect packet again if we are already connected */
+	if (!c->isconnected)
 		goto exit;
-    
-    TimerInit(&connect_timer);
-    TimerCountdownMS(&connect_timer, c->command_timeout_ms);
 
-    if (options == 0)
-        options = &default_options; /* set default options if none were supplied */
-    
-    c->keepAliveInterval = options->keepAliveInterval;
-	TimerCountdown(&c->ping_timer, c->keepAliveInterval);
-    if ((len = MQTTSerialize_connect(c->buf, c->buf_size, options)) <= 0)
+    TimerInit(&timer);
+    TimerCountdownMS(&timer, c->command_timeout_ms);
+
+    // wait for an earlier subscribe to be acknowledged if they all are waiting
+    while ((i = subscribeFind(c, 0)) < 0 && !c->nonblocking && c->isconnected && !TimerIsExpired(&timer))
+        cycleInflight(c, &timer);
+    if (i < 0)
+    {
+        rc = c->nonblocking ? MQTT_WOULD_BLOCK : MQTT_FAILURE;
         goto exit;
-    if ((rc = sendPacket(c, len, &connect_timer)) != MQTT_SUCCESS)  // send the connect packet
-        goto exit; // there was a problem
-    
-	if (c->keepAliveInterval > 0) {
-		TimerCountdown(&c->last_received_timer, c->keepAliveInterval);
-	}
-	
-	// this will be a blocking call, wait for the connack
-    if (waitfor(c, CONNACK_MSG, &connect_timer) == CONNACK_MSG)
+    }
+
+    for (len = 0; len < count; ++len)
     {
-        unsigned char connack_rc = 255;
-        unsigned char sessionPresent = 0;
-        if (MQTTDeserialize_connack(&sessionPresent, &connack_rc, c->readbuf, c->readbuf_size) == 1)
-            rc = connack_rc;
-        else
-            rc = MQTT_FAILURE;
+        MQTTString topic = MQTTString_initializer;
+        topic.cstring = (char*)topicFilters[len];
+        topics[len] = topic;
+        requestedQoSs[len] = qos;
     }
+    id = getNextPacketId(c);
+    if (c->MQTTVersion >= 5)
+        len = MQTTV5Serialize_subscribe(c->buf, c->buf_size, 0, id, count, topics, requestedQoSs);
     else
-        rc = MQTT_FAILURE;
-    
+        len = MQTTSerialize_subscribe(c->buf, c->buf_size, 0, id, count, topics, requestedQoSs);
+    if (len <= 0)
+    {
+        rc = (len == MQTTPACKET_BUFFER_TOO_SHORT) ? MQTT_BUFFER_OVERFLOW : MQTT_FAILURE;
+        goto exit;
+    }
+
+    // the SUBSCRIBE can share a write with the packets around it, like a QoS0 publish
+    vector.data = c->buf;
+    vector.len = len;
+    if ((rc = queuePacketv(c, &vector, 1, &timer)) != MQTT_SUCCESS)
+        goto exit;
+    c->subscribes[i].id = id;
+    c->subscribes[i].timeout_ms = ackTimeout(c);
+    TimerCountdownMS(&c->subscribes[i].timer, c->subscribes[i].timeout_ms);
+    c->subscribes[i].fp = handler;
+    c->subscribes[i].context = context;
+
 exit:
-    if (rc == MQTT_SUCCESS)
-        c->isconnected = 1;
+#if defined(MQTT_TASK)
+	MutexUnlock(&c->mutex);
+#endif
+    return rc;
+}
+
+
+void MQTTSetTxBuffer(MQTTClient* c, unsigned char* txbuf, size_t txbuf_size, unsigned int flush_ms)
+{
+#if defined(MQTT_TASK)
+	MutexLock(&c->mutex);
+#endif
+    if (c->isconnected)
+        flushPackets(c);
+    c->txlen = 0;
+    c->txbuf = txbuf;
+    c->txbuf_size = txbuf ? txbuf_size : 0;
+    c->tx_flush_ms = flush_ms;
+#if defined(MQTT_TASK)
+	MutexUnlock(&c->mutex);
+#endif
+}
+
+
+void MQTTCork(MQTTClient* c)
+{
+#if defined(MQTT_TASK)
+	MutexLock(&c->mutex);
+#endif
+    c->corked++;
+#if defined(MQTT_TASK)
+	MutexUnlock(&c->mutex);
+#endif
+}
+
+
+int MQTTUncork(MQTTClient* c)
+{
+    int rc = MQTT_SUCCESS;
+
+#if defined(MQTT_TASK)
+	MutexLock(&c->mutex);
+#endif
+    if (c->corked > 0 && --c->corked == 0 && c->isconnected)
+        rc = c->nonblocking ? drainPackets(c) : flushPackets(c);
+#if defined(MQTT_TASK)
+	MutexUnlock(&c->mutex);
+#endif
+    return rc;
+}
+
 
+void MQTTSetNonBlocking(MQTTClient* c, int nonblocking)
+{
+#if defined(MQTT_TASK)
+	MutexLock(&c->mutex);
+#endif
+    c->nonblocking = nonblocking;
 #if defined(MQTT_TASK)
 	MutexUnlock(&c->mutex);
 #endif
+}
+
+
+size_t MQTTWritable(MQTTClient* c)
+{
+    size_t rc = 0;
 
+#if defined(MQTT_TASK)
+	MutexLock(&c->mutex);
+#endif
+    if (c->isconnected && c->txbuf)
+        rc = c->txbuf_size - c->txlen;
+#if defined(MQTT_TASK)
+	MutexUnlock(&c->mutex);
+#endif
     return rc;
 }
 
 
-int MQTTSubscribe(MQTTClient* c, const char* topicFilter, enum QoS qos, messageHandler messageHandler)
-{ 
-    int rc = MQTT_FAILURE;  
-    Timer timer;
-    int len = 0;
-    MQTTString topic = MQTTString_initializer;
-    topic.cstring = (char *)topicFilter;
-    
+size_t MQTTQueueDepth(MQTTClient* c)
+{
+    size_t rc = 0;
+
 #if defined(MQTT_TASK)
 	MutexLock(&c->mutex);
 #endif
-	if (!c->isconnected)
-		goto exit;
+    rc = c->txlen;
+#if defined(MQTT_TASK)
+	MutexUnlock(&c->mutex);
+#endif
+    return rc;
+}
 
-    TimerInit(&timer);
-    TimerCountdownMS(&timer, c->command_timeout_ms);
-    
-    len = MQTTSerialize_subscribe(c->buf, c->buf_size, 0, getNextPacketId(c), 1, &topic, (int*)&qos);
-    if (len <= 0)
-        goto exit;
-    if ((rc = sendPacket(c, len, &timer)) != MQTT_SUCCESS) // send the subscribe packet
-        goto exit;             // there was a problem
-    
-    if (waitfor(c, SUBACK_MSG, &timer) == SUBACK_MSG)      // wait for suback 
+
+int MQTTFeed(MQTTClient* c, const unsigned char* data, int len, int* used)
+{
+    int rc = MQTT_SUCCESS,
+        packets = 0,
+        n = 0;
+
+#if defined(MQTT_TASK)
+	MutexLock(&c->mutex);
+#endif
+    // the data isn't read from ipstack, so readMutex isn't needed, and handlers are kept from reading it
+    c->feeding = 1;
+    while (rc >= 0 && n < len)
     {
-        int count = 0, grantedQoS = -1;
-        unsigned short mypacketid;
-        if (MQTTDeserialize_suback(&mypacketid, 1, &count, &grantedQoS, c->readbuf, c->readbuf_size) == 1)
-            rc = grantedQoS; // 0, 1, 2 or 0x80 
-        if (rc != 0x80)
+        int type = 0;
+        n += rxFeed(c, &data[n], len - n, &type);
+        if (type < 0)
+            rc = type;
+        else if (type > 0)
         {
-            int i;
-            for (i = 0; i < MAX_MESSAGE_HANDLERS; ++i)
-            {
-                if (c->messageHandlers[i].topicFilter == 0)
-                {
-                    c->messageHandlers[i].topicFilter = topicFilter;
-                    c->messageHandlers[i].fp = messageHandler;
-                    rc = 0;
-                    break;
-                }
-            }
+            rc = processPacket(c, type);
+            ++packets;
         }
     }
-    else 
-        rc = MQTT_FAILURE;
-        
-exit:
+    c->feeding = 0;
 #if defined(MQTT_TASK)
 	MutexUnlock(&c->mutex);
 #endif
-    return rc;
+    if (used)
+        *used = n;
+    return (rc < 0) ? rc : packets;
 }
 
 
-int MQTTUnsubscribe(MQTTClient* c, const char* topicFilter)
-{   
-    int rc = MQTT_FAILURE;
-    Timer timer;    
-    MQTTString topic = MQTTString_initializer;
-    topic.cstring = (char *)topicFilter;
-    int len = 0;
-
+void MQTTSetChunkHandler(MQTTClient* c, payloadChunkHandler handler)
+{
 #if defined(MQTT_TASK)
 	MutexLock(&c->mutex);
 #endif
-	if (!c->isconnected)
-		goto exit;
+    c->chunkHandler = handler;
+#if defined(MQTT_TASK)
+	MutexUnlock(&c->mutex);
+#endif
+}
 
-    TimerInit(&timer);
-    TimerCountdownMS(&timer, c->command_timeout_ms);
-    
-    if ((len = MQTTSerialize_unsubscribe(c->buf, c->buf_size, 0, getNextPacketId(c), 1, &topic)) <= 0)
-        goto exit;
-    if ((rc = sendPacket(c, len, &timer)) != MQTT_SUCCESS) // send the subscribe packet
-        goto exit; // there was a problem
-    
-    if (waitfor(c, UNSUBACK_MSG, &timer) == UNSUBACK_MSG)
+
+int MQTTGetRTT(MQTTClient* c, unsigned long* srtt_ms, unsigned long* rttvar_ms)
+{
+    int rc = 0;
+
+#if defined(MQTT_TASK)
+	MutexLock(&c->mutex);
+#endif
+    if (c->rtt_samples > 0)
     {
-        unsigned short mypacketid;  // should be the same as the packetid above
-        if (MQTTDeserialize_unsuback(&mypacketid, c->readbuf, c->readbuf_size) == 1)
-            rc = 0; 
+        if (srtt_ms)
+            *srtt_ms = c->srtt_ms;
+        if (rttvar_ms)
+            *rttvar_ms = c->rttvar_ms;
+        rc = 1;
     }
-    else
-        rc = MQTT_FAILURE;
-    
-exit:
 #if defined(MQTT_TASK)
 	MutexUnlock(&c->mutex);
 #endif
@@ -586,59 +2061,96 @@ exit:
 }
 
 
-int MQTTPublish(MQTTClient* c, const char* topicName, MQTTMessage* message)
+unsigned long MQTTDropped(MQTTClient* c)
 {
-    int rc = MQTT_FAILURE;
-    Timer timer;   
-    MQTTString topic = MQTTString_initializer;
-    topic.cstring = (char *)topicName;
-    int len = 0;
+    unsigned long rc = 0;
 
 #if defined(MQTT_TASK)
 	MutexLock(&c->mutex);
 #endif
-	if (!c->isconnected)
-		goto exit;
+    rc = c->rxdropped;
+#if defined(MQTT_TASK)
+	MutexUnlock(&c->mutex);
+#endif
+    return rc;
+}
 
-    TimerInit(&timer);
-    TimerCountdownMS(&timer, c->command_timeout_ms);
 
-    if (message->qos == QOS1 || message->qos == QOS2)
-        message->id = getNextPacketId(c);
-    
-    len = MQTTSerialize_publish(c->buf, c->buf_size, 0, message->qos, message->retained, message->id, 
-              topic, (unsigned char*)message->payload, message->payloadlen);
-    if (len <= 0)
-        goto exit;
-    if ((rc = sendPacket(c, len, &timer)) != MQTT_SUCCESS) // send the subscribe packet
-        goto exit; // there was a problem
-    
-    if (message->qos == QOS1)
+int MQTTPoll(MQTTClient* c, int* next_ms)
+{
+    int rc = MQTT_SUCCESS,
+        packets = 0;
+
+#if defined(MQTT_TASK)
+	MutexLock(&c->mutex);
+#endif
+    sendQueued(c);
+    // take what the network already has, partial packets stay in the parser until the rest arrives
+    while (rc >= 0 && c->isconnected)
     {
-        if (waitfor(c, PUBACK_MSG, &timer) == PUBACK_MSG)
+        unsigned char* data = NULL;
+        int len = 0,
+            type = 0;
+
+#if defined(MQTT_TASK)
+	MutexLock(&c->readMutex);
+#endif
+        // consume each packet from the network before handling it, a message handler that publishes may read more
+        if ((len = c->ipstack->mqttpeek(c->ipstack, &data, 0)) > 0)
+            c->ipstack->mqttskip(c->ipstack, rxFeed(c, data, len, &type));
+#if defined(MQTT_TASK)
+	MutexUnlock(&c->readMutex);
+#endif
+        if (len < 0)
+            rc = MQTT_FAILURE;
+        else if (type < 0)
+            rc = type; // a malformed packet, its bytes are gone so the next poll doesn't see it again
+        else if (type > 0)
         {
-            unsigned short mypacketid;
-            unsigned char dup, type;
-            if (MQTTDeserialize_ack(&type, &dup, &mypacketid, c->readbuf, c->readbuf_size) != 1)
-                rc = MQTT_FAILURE;
+            rc = processPacket(c, type);
+            ++packets;
         }
-        else
-            rc = MQTT_FAILURE;
+        else if (len == 0)
+            break;
     }
-    else if (message->qos == QOS2)
+    if (rc >= 0)
     {
-        if (waitfor(c, PUBCOMP_MSG, &timer) == PUBCOMP_MSG)
-        {
-            unsigned short mypacketid;
-            unsigned char dup, type;
-            if (MQTTDeserialize_ack(&type, &dup, &mypacketid, c->readbuf, c->readbuf_size) != 1)
-                rc = MQTT_FAILURE;
-        }
-        else
-            rc = MQTT_FAILURE;
+        runDeadlines(c);
+        rc = packets;
     }
-    
-exit:
+    if (next_ms)
+        *next_ms = nextDeadline(c, INT_MAX);
+#if defined(MQTT_TASK)
+	MutexUnlock(&c->mutex);
+#endif
+    return rc;
+}
+
+
+int MQTTNextDeadline(MQTTClient* c)
+{
+    int rc = 0;
+
+#if defined(MQTT_TASK)
+	MutexLock(&c->mutex);
+#endif
+    rc = nextDeadline(c, INT_MAX);
+#if defined(MQTT_TASK)
+	MutexUnlock(&c->mutex);
+#endif
+    return rc;
+}
+
+
+int MQTTFlush(MQTTClient* c)
+{
+    int rc = MQTT_SUCCESS;
+
+#if defined(MQTT_TASK)
+	MutexLock(&c->mutex);
+#endif
+    if (c->isconnected)
+        rc = flushPackets(c);
 #if defined(MQTT_TASK)
 	MutexUnlock(&c->mutex);
 #endif
@@ -52,10 +52,46 @@
 #define MAX_MESSAGE_HANDLERS 5 /* redefinable - how many subscriptions do you want? */
 #endif
 
+#if !defined(MAX_INFLIGHT_MESSAGES)
+#define MAX_INFLIGHT_MESSAGES 4 /* redefinable - how many QoS1/QoS2 publishes can wait for acknowledgement at once, up to 32 */
+#endif
+
+#if !defined(MQTT_RETRY_INTERVAL_MS)
+#define MQTT_RETRY_INTERVAL_MS 10000 /* redefinable - how long to wait for an acknowledgement before resending with DUP set, until a round trip has been measured */
+#endif
+
+#if !defined(MQTT_RTO_MIN_MS)
+#define MQTT_RTO_MIN_MS 200 /* redefinable - shortest wait for an acknowledgement once it follows the measured round trip time */
+#endif
+
+#if !defined(MQTT_RTO_MAX_MS)
+#define MQTT_RTO_MAX_MS 60000 /* redefinable - longest wait for an acknowledgement, however often a publish has been resent */
+#endif
+
+#if !defined(MQTT_MAX_INBOUND_IDS)
+#define MQTT_MAX_INBOUND_IDS 8 /* redefinable - how many inbound QoS1/QoS2 packet ids are remembered to spot redelivered messages */
+#endif
+
+#if !defined(MQTT_KEEPALIVE_JITTER_PERCENT)
+#define MQTT_KEEPALIVE_JITTER_PERCENT 10 /* redefinable - how much earlier than the keepalive interval a ping can randomly be sent */
+#endif
+
+#if !defined(MQTT_MAX_RETRIES)
+#define MQTT_MAX_RETRIES 3 /* redefinable - how many times a publish is resent before it is reported as failed */
+#endif
+
+#if !defined(MQTT_MAX_PENDING_SUBSCRIBES)
+#define MQTT_MAX_PENDING_SUBSCRIBES 4 /* redefinable - how many MQTTSubscribeAsync calls can wait for their SUBACK at once */
+#endif
+
+#if !defined(MQTT_MAX_SUBSCRIBE_TOPICS)
+#define MQTT_MAX_SUBSCRIBE_TOPICS 8 /* redefinable - how many topic filters one MQTTSubscribeAsync can subscribe to */
+#endif
+
 enum QoS { QOS0, QOS1, QOS2 };
 
 /* all failure return codes must be negative */
-enum returnCode { MQTT_BUFFER_OVERFLOW = -2, MQTT_FAILURE = -1, MQTT_SUCCESS = 0 };
+enum returnCode { MQTT_WOULD_BLOCK = -3, MQTT_BUFFER_OVERFLOW = -2, MQTT_FAILURE = -1, MQTT_SUCCESS = 0, MQTT_QUEUED = 1 };
 
 /* The Platform specific header must define the Network and Timer structures and functions
  * which operate on them.
@@ -64,6 +100,8 @@ typedef struct Network
 {
 	int (*mqttread)(Network*, unsigned char* read_buffer, int, int);
 	int (*mqttwrite)(Network*, unsigned char* send_buffer, int, int);
+	int (*mqttpeek)(Network*, unsigned char** data, int);  // returns received data in place
+	void (*mqttskip)(Network*, int);  // consumes data returned by mqttpeek
 } Network;*/
 
 /* The Timer structure must be defined in the platform specific header,
@@ -92,6 +130,57 @@ typedef struct MessageData
 
 typedef void (*messageHandler)(MessageData*, void*);
 
+/* called for each piece of a message too big for the read buffer, md's payload is the piece, which starts offset
+ * bytes into a payload of total bytes */
+typedef void (*payloadChunkHandler)(MessageData* md, size_t offset, size_t total, void* userData);
+
+/* called when a QoS1 or QoS2 publish completes, rc is MQTT_SUCCESS once it is acknowledged or MQTT_FAILURE if it was
+ * resent MQTT_MAX_RETRIES times without being acknowledged, or the client connected again without its old session */
+typedef void (*publishCompleteHandler)(unsigned short id, int rc, void* context);
+
+/* the acknowledgement an in-flight publish is waiting for */
+enum InflightState { INFLIGHT_FREE, INFLIGHT_PUBACK, INFLIGHT_PUBREC, INFLIGHT_PUBCOMP, INFLIGHT_DONE };
+
+typedef struct InflightMessage
+{
+    unsigned short id;
+    unsigned char state,           /* one of enum InflightState */
+      qos,
+      retained,
+      retries,                     /* number of times the message has been resent */
+      waiter;                      /* nonzero if MQTTPublish is waiting for the result, rather than a handler */
+    int rc;                        /* the result, once state is INFLIGHT_DONE */
+    const char* topicName;
+    void* payload;
+    size_t payloadlen;
+    Timer retry_timer;             /* when to resend if no acknowledgement has arrived */
+    unsigned int rto_ms;           /* what retry_timer was started with, to time the round trip when the ack comes */
+    publishCompleteHandler fp;
+    void* context;
+} InflightMessage;
+
+/* called when the SUBACK for an MQTTSubscribeAsync arrives, rc is MQTT_SUCCESS if every topic filter was granted or
+ * MQTT_FAILURE if one was refused, the SUBACK didn't arrive in time, or the client connected again before it did */
+typedef void (*subscribeCompleteHandler)(unsigned short id, int rc, void* context);
+
+typedef struct PendingSubscribe
+{
+    unsigned short id;             /* packet id of the SUBSCRIBE, 0 if the entry is free */
+    unsigned int timeout_ms;       /* what timer was started with, to time the round trip when the SUBACK comes */
+    Timer timer;                   /* when to give up on the SUBACK */
+    subscribeCompleteHandler fp;
+    void* context;
+} PendingSubscribe;
+
+/* what is known about an inbound QoS1 or QoS2 packet id that has been acknowledged */
+enum InboundState { INBOUND_FREE, INBOUND_PUBACK, INBOUND_PUBREL };
+
+typedef struct InboundMessage
+{
+    unsigned short id;
+    unsigned char state;           /* one of enum InboundState, INBOUND_PUBREL until the QoS2 exchange completes */
+} InboundMessage;
+
 typedef struct MQTTClient
 {
     unsigned int next_packetid,
@@ -102,12 +191,47 @@ typedef struct MQTTClient
       *readbuf;
     unsigned int keepAliveInterval;
     char ping_outstanding;
+    unsigned long jitter_seed;     /* random state for spreading out keepalive pings */
+    unsigned long srtt_ms,         /* smoothed round trip time of pings and acknowledgements */
+      rttvar_ms,                   /* variation of the round trip time */
+      rtt_samples;                 /* number of round trips measured */
     int isconnected;
+    unsigned char sessionPresent;  /* set from the last CONNACK, nonzero if the broker kept the session from before */
+    unsigned char MQTTVersion;     /* protocol version of the connection, 5 sends MQTT 5 packets */
+    unsigned short receiveMaximum, /* QoS1/QoS2 publishes the broker takes at once, from an MQTT 5 CONNACK */
+      topicAliasMaximum;           /* highest topic alias the broker takes, 0 for none */
 	int connAckReceived;
 	int subAckReceived;
 	int unsubAckReceived;
-	int pubAckReceived;
-	int pubCompReceived;
+    unsigned char *txbuf;          /* optional buffer used to combine small packets into one write */
+    size_t txbuf_size,
+      txlen;                       /* number of bytes waiting in txbuf */
+    int corked;                    /* while nonzero, queued packets are held until MQTTUncork */
+    unsigned int tx_flush_ms;      /* longest time a queued packet waits for others to join it */
+    Timer tx_flush_timer;
+    int nonblocking;               /* while nonzero, QoS0 publishes are queued in txbuf instead of waiting on the network */
+    size_t rxlen,                  /* number of bytes of the packet being received that are in readbuf */
+      rxtotal,                     /* length of that packet, 0 until its remaining length has been received */
+      rxhdr,                       /* bytes of a streamed PUBLISH kept at the start of readbuf, its header and topic */
+      rxoffset,                    /* bytes of a streamed or drained packet already passed on from readbuf */
+      rxchunk;                     /* length of the streamed payload piece in readbuf */
+    unsigned char rxmode;          /* how the packet being received is read, packets too big for readbuf aren't kept */
+    unsigned long rxdropped;       /* number of packets thrown away because they didn't fit in readbuf */
+    unsigned char rxduplicate;     /* nonzero if the streamed PUBLISH has already been handled */
+    unsigned char feeding;         /* nonzero while MQTTFeed handles packets, blocking calls then don't read ipstack */
+    InboundMessage inbound[MQTT_MAX_INBOUND_IDS]; /* ring of the inbound packet ids recently acknowledged */
+    int inbound_next;              /* entry of inbound to reuse next */
+    unsigned long inflight_used;   /* bitmap of the slots in inflight that are in use */
+    InflightMessage inflight[MAX_INFLIGHT_MESSAGES];
+    unsigned char *inflightbuf;    /* optional buffer MQTTPublishAsync copies messages into until they are acknowledged */
+    size_t inflightbuf_size;
+    unsigned int retry_ms;         /* how long to wait for an acknowledgement before resending, until a round trip has been measured */
+    unsigned char *aliasbuf;       /* optional buffer holding the topics that have an alias, as C strings in alias order */
+    size_t aliasbuf_size,
+      aliaslen,                    /* number of bytes of aliasbuf in use */
+      aliaspending;                /* length of a topic added to aliasbuf by the publish being sent, not yet in use */
+    unsigned short aliases;        /* number of topic aliases the broker knows on this connection */
+    PendingSubscribe subscribes[MQTT_MAX_PENDING_SUBSCRIBES]; /* MQTTSubscribeAsync calls waiting for their SUBACK */
 
     struct MessageHandlers
     {
@@ -116,6 +240,7 @@ typedef struct MQTTClient
     } messageHandlers[MAX_MESSAGE_HANDLERS];      /* Message handlers are indexed by subscription topic */
 
     void (*defaultMessageHandler) (MessageData*, void*);
+    payloadChunkHandler chunkHandler;
 	void* userData;
 
     Network* ipstack;
@@ -123,7 +248,8 @@ typedef struct MQTTClient
 	Timer last_received_timer;
 	Timer ping_response_timer;
 #if defined(MQTT_TASK)
-	Mutex mutex;
+	Mutex mutex;                   /* guards the client state and the transmit path */
+	Mutex readMutex;               /* guards receiving from ipstack, taken after mutex when both are held */
 	Thread thread;
 #endif 
 } MQTTClient;
@@ -143,6 +269,11 @@ DLLExport void MQTTClientInit(MQTTClient* client, Network* network, unsigned int
 
 /** MQTT Connect - send an MQTT connect packet down the network and wait for a Connack
  *  The nework object must be connected to the network endpoint before calling this
+ *  With cleansession 0, sessionPresent tells whether the broker kept the session, so its subscriptions still
+ *  exist. If it did, publishes that were still waiting for acknowledgement are resent with DUP set, otherwise they
+ *  are reported as failed.
+ *  With MQTTVersion 5 the broker's Receive Maximum caps the publishes in flight, its Server Keep Alive replaces
+ *  the keepalive interval, and topics are sent by alias as far as its Topic Alias Maximum allows.
  *  @param options - connect options
  *  @return success code
  */
@@ -156,6 +287,46 @@ DLLExport int MQTTConnect(MQTTClient* client, MQTTPacket_connectData* options);
  */
 DLLExport int MQTTPublish(MQTTClient* client, const char*, MQTTMessage*);
 
+/** MQTT Publish Async - send an MQTT publish packet without waiting for it to be acknowledged.
+ *  Up to MAX_INFLIGHT_MESSAGES QoS1 and QoS2 publishes can be waiting for acknowledgement at once. Acknowledgements
+ *  are matched by packet id as MQTTYield receives them, and a publish that isn't acknowledged in time is resent
+ *  with DUP set. The wait is retry_ms until a round trip has been measured, then the smoothed round trip time plus
+ *  four times its variation, as TCP does, doubled for each resend and kept between MQTT_RTO_MIN_MS and
+ *  MQTT_RTO_MAX_MS. The topic and payload are copied into the buffer from MQTTSetInflightBuffer, so the caller
+ *  doesn't have to keep them. If all slots are in use this waits for one to free up, or returns MQTT_WOULD_BLOCK in
+ *  non-blocking mode. QoS0 publishes are sent as by MQTTPublish.
+ *  @param client - the client object to use
+ *  @param topic - the topic to publish to
+ *  @param message - the message to send, its id is set to the packet id used
+ *  @param handler - called when the publish completes, can be NULL
+ *  @param context - passed to the handler
+ *  @return success code, MQTT_BUFFER_OVERFLOW if the message doesn't fit in a slot of the in-flight buffer
+ */
+DLLExport int MQTTPublishAsync(MQTTClient* client, const char* topic, MQTTMessage* message, publishCompleteHandler handler, void* context);
+
+/** MQTT Set Inflight Buffer - provide the storage MQTTPublishAsync keeps unacknowledged messages in.
+ *  The buffer is split into MAX_INFLIGHT_MESSAGES slots, each holding one topic and payload.
+ *  @param client - the client object to use
+ *  @param buf - the buffer, NULL to disable MQTTPublishAsync for QoS1 and QoS2
+ *  @param buf_size - the size of buf
+ */
+DLLExport void MQTTSetInflightBuffer(MQTTClient* client, unsigned char* buf, size_t buf_size);
+
+/** MQTT Set Topic Alias Buffer - provide the storage for the topics that are given an alias on an MQTT 5
+ *  connection. The first publish to a topic sends it with a new alias, later ones send just the 2 byte alias, until
+ *  the broker's Topic Alias Maximum is reached or the buffer is full. Aliases are forgotten on each MQTTConnect.
+ *  @param client - the client object to use
+ *  @param buf - the buffer, NULL to always send the topic
+ *  @param buf_size - the size of buf, each topic takes its length plus 1
+ */
+DLLExport void MQTTSetTopicAliasBuffer(MQTTClient* client, unsigned char* buf, size_t buf_size);
+
+/** MQTT Inflight - get the number of QoS1 and QoS2 publishes waiting for acknowledgement.
+ *  @param client - the client object to use
+ *  @return the number of publishes in flight
+ */
+DLLExport int MQTTInflight(MQTTClient* client);
+
 /** MQTT Subscribe - send an MQTT subscribe packet and wait for suback before returning.
  *  @param client - the client object to use
  *  @param topicFilter - the topic filter to subscribe to
@@ -164,6 +335,22 @@ DLLExport int MQTTPublish(MQTTClient* client, const char*, MQTTMessage*);
  */
 DLLExport int MQTTSubscribe(MQTTClient* client, const char* topicFilter, enum QoS, messageHandler);
 
+/** MQTT Subscribe Async - send an MQTT subscribe packet for several topic filters without waiting for the suback.
+ *  The packet is queued like a QoS0 publish, so when the client is corked it goes out in the same write as the
+ *  packets around it. The SUBACK is matched by packet id as MQTTYield receives it. Up to MQTT_MAX_PENDING_SUBSCRIBES
+ *  can be waiting at once, if all are this waits for one to complete, or returns MQTT_WOULD_BLOCK in non-blocking
+ *  mode. Messages on the topics go to the default message handler.
+ *  @param client - the client object to use
+ *  @param count - the number of topic filters, up to MQTT_MAX_SUBSCRIBE_TOPICS
+ *  @param topicFilters - the topic filters to subscribe to, only needed until this returns
+ *  @param qos - the QoS requested for every topic filter
+ *  @param handler - called when the SUBACK arrives, can be NULL
+ *  @param context - passed to the handler
+ *  @return success code, MQTT_BUFFER_OVERFLOW if the packet doesn't fit in the send buffer
+ */
+DLLExport int MQTTSubscribeAsync(MQTTClient* client, int count, const char* topicFilters[], enum QoS qos,
+    subscribeCompleteHandler handler, void* context);
+
 /** MQTT Subscribe - send an MQTT unsubscribe packet and wait for unsuback before returning.
  *  @param client - the client object to use
  *  @param topicFilter - the topic filter to unsubscribe from
@@ -171,13 +358,127 @@ DLLExport int MQTTSubscribe(MQTTClient* client, const char* topicFilter, enum Qo
  */
 DLLExport int MQTTUnsubscribe(MQTTClient* client, const char* topicFilter);
 
+/** MQTT Set Tx Buffer - combine QoS0 publishes into fewer network writes.
+ *  Queued packets are sent when the buffer fills, when any other packet is sent, on the next
+ *  MQTTYield, or when a publish finds the queued packets have waited longer than flush_ms.
+ *  @param client - the client object to use
+ *  @param txbuf - the buffer to queue packets in, NULL to send every packet immediately
+ *  @param txbuf_size - the size of txbuf
+ *  @param flush_ms - how long a packet can wait for others to join it, 0 to only combine while corked
+ */
+DLLExport void MQTTSetTxBuffer(MQTTClient* client, unsigned char* txbuf, size_t txbuf_size, unsigned int flush_ms);
+
+/** MQTT Cork - hold QoS0 publishes in the transmit buffer until MQTTUncork is called.
+ *  Calls can be nested, the packets are sent when the last MQTTUncork is called.
+ *  @param client - the client object to use
+ */
+DLLExport void MQTTCork(MQTTClient* client);
+
+/** MQTT Uncork - end a MQTTCork and send the queued packets.
+ *  @param client - the client object to use
+ *  @return success code, MQTT_QUEUED in non-blocking mode if some packets are still waiting
+ */
+DLLExport int MQTTUncork(MQTTClient* client);
+
+/** MQTT Set Non Blocking - make QoS0 publishes return without waiting on the network.
+ *  In non-blocking mode a QoS0 publish is copied into the transmit buffer and as much of the buffer as the
+ *  network will take is written at once. MQTTPublish then returns MQTT_SUCCESS if everything was written,
+ *  MQTT_QUEUED if data is still waiting in the buffer, or MQTT_WOULD_BLOCK if the buffer has no room and the
+ *  message was not sent. The rest of the buffer is written by MQTTYield. Requires a buffer from MQTTSetTxBuffer.
+ *  QoS1 and QoS2 publishes still wait for their acknowledgements.
+ *  @param client - the client object to use
+ *  @param nonblocking - 1 to enable non-blocking mode, 0 to disable it
+ */
+DLLExport void MQTTSetNonBlocking(MQTTClient* client, int nonblocking);
+
+/** MQTT Writable - get the room left in the transmit buffer.
+ *  @param client - the client object to use
+ *  @return the number of bytes that can be queued without blocking, 0 if not connected or there is no buffer
+ */
+DLLExport size_t MQTTWritable(MQTTClient* client);
+
+/** MQTT Queue Depth - get the amount of data waiting in the transmit buffer.
+ *  @param client - the client object to use
+ *  @return the number of bytes waiting to be written
+ */
+DLLExport size_t MQTTQueueDepth(MQTTClient* client);
+
+/** MQTT Feed - pass received data to the client, for transports that deliver data as it arrives.
+ *  The data can be split anywhere, partial packets are kept until the rest arrives. Each complete packet is
+ *  handled straight away, so incoming messages are delivered without waiting for MQTTYield. The data must already
+ *  have been taken off the network, to handle data in place in the Network's receive buffer use MQTTPoll instead.
+ *  Message handlers called from here must not wait on the network: a blocking MQTTPublish with QoS1 or QoS2, a
+ *  MQTTSubscribe or MQTTUnsubscribe, or a MQTTPublishAsync with no free in-flight slot returns MQTT_FAILURE.
+ *  With MQTT_TASK only the client lock is taken: readMutex guards reads from the Network, which MQTTFeed never
+ *  makes, and the partial packet is client state guarded by the client lock. Use MQTTFeed instead of MQTTYield,
+ *  MQTTPoll or MQTTStartTask, not alongside them, since they all add to the same partial packet.
+ *  @param client - the client object to use
+ *  @param data - the received data
+ *  @param len - the number of bytes of data
+ *  @param used - set to the number of bytes used, all of them unless a packet failed, in which case the bytes up to
+ *  the end of that packet, can be NULL
+ *  @return the number of packets handled, or a failure code if a packet was malformed or couldn't be acknowledged
+ */
+DLLExport int MQTTFeed(MQTTClient* client, const unsigned char* data, int len, int* used);
+
+/** MQTT Flush - send any packets waiting in the transmit buffer.
+ *  @param client - the client object to use
+ *  @return success code
+ */
+DLLExport int MQTTFlush(MQTTClient* client);
+
 /** MQTT Disconnect - send an MQTT disconnect packet and close the connection
  *  @param client - the client object to use
  *  @return success code
  */
 DLLExport int MQTTDisconnect(MQTTClient* client);
 
+/** MQTT Set Chunk Handler - receive messages that are too big for the read buffer in pieces.
+ *  The header and topic of such a message are kept in the read buffer and the payload is passed to the handler a
+ *  bufferful at a time, so it is never held whole. Without a chunk handler these messages are thrown away and counted
+ *  by MQTTDropped. QoS1 and QoS2 messages are acknowledged once the last piece has been handled.
+ *  @param client - the client object to use
+ *  @param handler - the handler, NULL to drop messages that don't fit
+ */
+DLLExport void MQTTSetChunkHandler(MQTTClient* client, payloadChunkHandler handler);
+
+/** MQTT Get RTT - get the round trip time to the broker, measured from keepalive pings and from the
+ *  acknowledgements of publishes that weren't resent, subscribes and unsubscribes. A ping is only sent when no
+ *  packet has been sent or received for the keepalive interval, less a random part of up to
+ *  MQTT_KEEPALIVE_JITTER_PERCENT, so a busy connection isn't measured.
+ *  @param client - the client object to use
+ *  @param srtt_ms - set to the smoothed round trip time in milliseconds, can be NULL
+ *  @param rttvar_ms - set to the round trip time variation in milliseconds, can be NULL
+ *  @return 1 if a round trip has been measured, 0 if not
+ */
+DLLExport int MQTTGetRTT(MQTTClient* client, unsigned long* srtt_ms, unsigned long* rttvar_ms);
+
+/** MQTT Dropped - get the number of received packets that were thrown away because they didn't fit in the read buffer.
+ *  @param client - the client object to use
+ *  @return the number of packets dropped
+ */
+DLLExport unsigned long MQTTDropped(MQTTClient* client);
+
+/** MQTT Poll - handle every packet the network has already received, without waiting.
+ *  Keepalive pings, resends of unacknowledged publishes and queued packets are also dealt with, so calling this
+ *  often enough replaces MQTTYield. Incomplete packets are kept until the rest arrives. Each packet is taken off
+ *  the network before it is handled, so a message handler may publish, even with a blocking MQTTPublish.
+ *  @param client - the client object to use
+ *  @param next_ms - set to the time in milliseconds until the client next has something to do, INT_MAX if nothing
+ *  is pending, can be NULL
+ *  @return the number of packets handled, or a failure code
+ */
+DLLExport int MQTTPoll(MQTTClient* client, int* next_ms);
+
+/** MQTT Next Deadline - get the time until the client next has something to do, as MQTTPoll reports it, without
+ *  handling anything. Until then only data arriving from the network needs MQTTPoll to be called.
+ *  @param client - the client object to use
+ *  @return the time in milliseconds, 0 if something is due now, INT_MAX if nothing is pending
+ */
+DLLExport int MQTTNextDeadline(MQTTClient* client);
+
 /** MQTT Yield - MQTT background
+ *  A packet that is only partly received when the time runs out is finished by the next call, so short times are safe.
  *  @param client - the client object to use
  *  @param time - the time, in milliseconds, to yield for 
  *  @return success code
@@ -186,6 +487,8 @@ DLLExport int MQTTYield(MQTTClient* client, int time);
 
 #if defined(MQTT_TASK)
 /** MQTT start background thread for a client.  After this, MQTTYield should not be called.
+*  The thread waits for incoming data without holding the client lock, so publishes from other threads are sent
+*  while the connection is idle. The network must allow one thread to read while another writes.
 *  @param client - the client object to use
 *  @return success code
 */
@@ -21,6 +21,8 @@ ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEAL
 //Set the platform specific header file containing the Timer & Network definitions here.
 #if defined(ARDUINO)
 	#include "../Platform/Arduino/MQTTArduino.h"
+#elif defined(__linux__)
+	#include "../Platform/Posix/MQTTPosix.h"
 #endif
 
 #define MAX_MESSAGE_HANDLERS 0  // Set MQTTClient handlers to 0 since Cayenne uses its own handlers.
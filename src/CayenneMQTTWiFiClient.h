@@ -24,8 +24,15 @@ ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEAL
 #include "esp_wpa2.h"
 #endif
 
+#if defined(CAYENNE_TLS)
+#include <WiFiClientSecure.h>
+#define CAYENNE_WIFI_PORT CAYENNE_TLS_PORT
+#else
+#define CAYENNE_WIFI_PORT CAYENNE_PORT
+#endif
+
 #ifndef WRITE_CHUNK_SIZE
-#define WRITE_CHUNK_SIZE 0 // The chunk size to use when sending data, 0 means data will not be sent in chunks.
+#define WRITE_CHUNK_SIZE 0 // The initial chunk size to use when sending data, 0 means data is not sent in chunks until the client takes a short write.
 #endif // !WRITE_CHUNK_SIZE
 
 
@@ -64,7 +71,8 @@ public:
 
 		IPAddress local_ip = WiFi.localIP();
 		CAYENNE_LOG("IP: %d.%d.%d.%d", local_ip[0], local_ip[1], local_ip[2], local_ip[3]);
-		CayenneArduinoMQTTClient::begin(_wifiClient, username, password, clientID, WRITE_CHUNK_SIZE);
+		setupTLS();
+		CayenneArduinoMQTTClient::begin(_wifiClient, username, password, clientID, WRITE_CHUNK_SIZE, CAYENNE_WIFI_PORT);
 	}
 
 
@@ -98,7 +106,8 @@ public:
 
 		IPAddress local_ip = WiFi.localIP();
 		CAYENNE_LOG("IP: %d.%d.%d.%d", local_ip[0], local_ip[1], local_ip[2], local_ip[3]);
-		CayenneArduinoMQTTClient::begin(_wifiClient, username, password, clientID, WRITE_CHUNK_SIZE);
+		setupTLS();
+		CayenneArduinoMQTTClient::begin(_wifiClient, username, password, clientID, WRITE_CHUNK_SIZE, CAYENNE_WIFI_PORT);
 	}
 #endif
 
@@ -115,12 +124,49 @@ public:
 		}
 		IPAddress local_ip = WiFi.localIP();
 		CAYENNE_LOG("IP: %d.%d.%d.%d", local_ip[0], local_ip[1], local_ip[2], local_ip[3]);
-		CayenneArduinoMQTTClient::begin(_wifiClient, username, password, clientID, WRITE_CHUNK_SIZE);
+		setupTLS();
+		CayenneArduinoMQTTClient::begin(_wifiClient, username, password, clientID, WRITE_CHUNK_SIZE, CAYENNE_WIFI_PORT);
 	}
 
 
 private:
+	/**
+	* Configures server verification and session resumption on the TLS client. Defining CAYENNE_TLS_CA_CERT (a PEM
+	* string) verifies the server against that CA. On ESP8266 CAYENNE_TLS_FINGERPRINT can be used instead.
+	*/
+	void setupTLS()
+	{
+#if defined(CAYENNE_TLS)
+#if defined(CAYENNE_TLS_CA_CERT)
+#if defined(ESP8266)
+		_wifiClient.setTrustAnchors(&_trustAnchors);
+#else
+		_wifiClient.setCACert(CAYENNE_TLS_CA_CERT);
+#endif
+#elif defined(CAYENNE_TLS_FINGERPRINT) && defined(ESP8266)
+		_wifiClient.setFingerprint(CAYENNE_TLS_FINGERPRINT);
+#else
+		CAYENNE_LOG("TLS server certificate is not verified, define CAYENNE_TLS_CA_CERT to verify it");
+		_wifiClient.setInsecure();
+#endif
+#if defined(ESP8266)
+		// Reconnects resume the previous session instead of running a full handshake.
+		_wifiClient.setSession(&_tlsSession);
+#endif
+#endif
+	}
+
+#if defined(CAYENNE_TLS) && defined(ESP8266)
+	BearSSL::WiFiClientSecure _wifiClient;
+	BearSSL::Session _tlsSession;
+#if defined(CAYENNE_TLS_CA_CERT)
+	BearSSL::X509List _trustAnchors{CAYENNE_TLS_CA_CERT};
+#endif
+#elif defined(CAYENNE_TLS)
+	WiFiClientSecure _wifiClient;
+#else
 	WiFiClient _wifiClient;
+#endif
 };
 
 CayenneMQTTWiFiClient Cayenne;
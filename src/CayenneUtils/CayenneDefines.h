@@ -33,6 +33,66 @@ ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEAL
 #define CAYENNE_MAX_PAYLOAD_SIZE 64 // Redefine this for different payload size
 #endif
 
+#ifndef CAYENNE_RECONNECT_MIN_MS
+#define CAYENNE_RECONNECT_MIN_MS 1000 // Redefine to change the first reconnect backoff, later attempts double it up to CAYENNE_RECONNECT_MAX_MS
+#endif
+
+#ifndef CAYENNE_RECONNECT_MAX_MS
+#define CAYENNE_RECONNECT_MAX_MS 60000 // Redefine to change the longest reconnect backoff
+#endif
+
+#ifndef CAYENNE_MAX_ENDPOINTS
+#define CAYENNE_MAX_ENDPOINTS 4 // Redefine to change the number of broker endpoints the client can fail over between
+#endif
+
+#ifndef CAYENNE_ENDPOINT_HOLDDOWN_MS
+#define CAYENNE_ENDPOINT_HOLDDOWN_MS 30000 // Redefine to change how long an endpoint that failed is skipped, repeated failures double it up to CAYENNE_RECONNECT_MAX_MS
+#endif
+
+#ifndef CAYENNE_ENDPOINT_FAILURE_COST_MS
+#define CAYENNE_ENDPOINT_FAILURE_COST_MS 10000 // Redefine to change how much latency an endpoint that always fails is treated as costing
+#endif
+
+#ifndef CAYENNE_PERSISTENT_SESSION
+#define CAYENNE_PERSISTENT_SESSION 0 // Redefine to 1 to ask the server to keep subscriptions and unacknowledged messages across reconnects
+#endif
+
+#ifndef CAYENNE_MQTT_VERSION
+#if CAYENNE_PERSISTENT_SESSION
+#define CAYENNE_MQTT_VERSION 4 // MQTT 3.1.1, the oldest version whose CONNACK tells if the server kept the session
+#else
+#define CAYENNE_MQTT_VERSION 3 // Redefine to 5 to connect with MQTT 5, so each data topic is sent once and then by a 2 byte topic alias
+#endif
+#endif
+
+#if CAYENNE_PERSISTENT_SESSION && CAYENNE_MQTT_VERSION < 4
+#error "CAYENNE_PERSISTENT_SESSION needs CAYENNE_MQTT_VERSION 4 or 5, an MQTT 3.1 CONNACK doesn't tell if the session was kept"
+#endif
+
+#ifndef CAYENNE_TOPIC_ALIAS_BUFFER_SIZE
+#if CAYENNE_MQTT_VERSION == 5
+#define CAYENNE_TOPIC_ALIAS_BUFFER_SIZE 768 // Redefine this for a different buffer size for remembering the topics that have an alias, about 8 data topics fit in the default
+#else
+#define CAYENNE_TOPIC_ALIAS_BUFFER_SIZE 0
+#endif
+#endif
+
+#ifndef CAYENNE_COMMAND_TIMEOUT_MS
+#define CAYENNE_COMMAND_TIMEOUT_MS 30000 // Redefine to change how long a blocking MQTT command waits on the network
+#endif
+
+#ifndef CAYENNE_TX_BUFFER_SIZE
+#define CAYENNE_TX_BUFFER_SIZE 256 // Redefine this for a different buffer size for combining small publishes into one write, 0 to disable
+#endif
+
+#ifndef CAYENNE_TX_FLUSH_MS
+#define CAYENNE_TX_FLUSH_MS 0 // Redefine to let publishes wait up to this many milliseconds to be combined, 0 to only combine while corked
+#endif
+
+#ifndef CAYENNE_INFLIGHT_BUFFER_SIZE
+#define CAYENNE_INFLIGHT_BUFFER_SIZE (MAX_INFLIGHT_MESSAGES * (CAYENNE_MAX_MESSAGE_SIZE + 1)) // Redefine this for a different buffer size for keeping command responses until they are acknowledged, 0 to wait for each one
+#endif
+
 #ifndef CAYENNE_MAX_MESSAGE_HANDLERS
 #define CAYENNE_MAX_MESSAGE_HANDLERS 5 /* Redefine to change number of handlers */
 #endif
@@ -32,10 +32,14 @@ int MQTTSerialize_connectLength(MQTTPacket_connectData* options)
 		len = 12; /* variable depending on MQTT or MQIsdp */
 	else if (options->MQTTVersion == 4)
 		len = 10;
+	else if (options->MQTTVersion == 5)
+		len = 11; /* MQTT 5 adds the properties length */
 
 	len += MQTTstrlen(options->clientID)+2;
 	if (options->willFlag)
 		len += MQTTstrlen(options->will.topicName)+2 + MQTTstrlen(options->will.message)+2;
+	if (options->willFlag && options->MQTTVersion == 5)
+		len += 1; /* will properties length */
 	if (options->username.cstring || options->username.lenstring.data)
 		len += MQTTstrlen(options->username)+2;
 	if (options->password.cstring || options->password.lenstring.data)
@@ -46,7 +50,8 @@ int MQTTSerialize_connectLength(MQTTPacket_connectData* options)
 
 
 /**
-  * Serializes the connect options into the buffer.
+  * Serializes the connect options into the buffer. An MQTT 5 connect is sent without properties, so the server
+  * keeps to the defaults for the client: no receive limit below 65535 and no topic aliases.
   * @param buf the buffer into which the packet will be serialized
   * @param len the length in bytes of the supplied buffer
   * @param options the options to be used to build the connect packet
@@ -72,10 +77,10 @@ int MQTTSerialize_connect(unsigned char* buf, int buflen, MQTTPacket_connectData
 
 	ptr += MQTTPacket_encode(ptr, len); /* write remaining length */
 
-	if (options->MQTTVersion == 4)
+	if (options->MQTTVersion == 4 || options->MQTTVersion == 5)
 	{
 		writeCString(&ptr, "MQTT");
-		writeChar(&ptr, (char) 4);
+		writeChar(&ptr, (char) options->MQTTVersion);
 	}
 	else
 	{
@@ -99,9 +104,13 @@ int MQTTSerialize_connect(unsigned char* buf, int buflen, MQTTPacket_connectData
 
 	writeChar(&ptr, flags.all);
 	writeInt(&ptr, options->keepAliveInterval);
+	if (options->MQTTVersion == 5)
+		writeChar(&ptr, 0); /* no properties */
 	writeMQTTString(&ptr, options->clientID);
 	if (options->willFlag)
 	{
+		if (options->MQTTVersion == 5)
+			writeChar(&ptr, 0); /* no will properties */
 		writeMQTTString(&ptr, options->will.topicName);
 		writeMQTTString(&ptr, options->will.message);
 	}
@@ -153,6 +162,46 @@ exit:
 }
 
 
+/**
+  * Deserializes the supplied (wire) buffer into MQTT 5 connack data - reason code and properties
+  * @param sessionPresent the session present flag returned
+  * @param connack_rc returned integer value of the connack reason code, 0x80 or more is a failure
+  * @param properties returned MQTTProperties - the limits the server sets, such as the receive maximum
+  * @param buf the raw buffer data, of the correct length determined by the remaining length field
+  * @param len the length in bytes of the data in the supplied buffer
+  * @return error code.  1 is success, 0 is failure
+  */
+int MQTTV5Deserialize_connack(unsigned char* sessionPresent, unsigned char* connack_rc, MQTTProperties* properties,
+		unsigned char* buf, int buflen)
+{
+	MQTTHeader header = {0};
+	unsigned char* curdata = buf;
+	unsigned char* enddata = NULL;
+	int rc = 0;
+	int mylen;
+	MQTTConnackFlags flags = {0};
+
+	header.byte = readChar(&curdata);
+	if (header.bits.type != CONNACK_MSG)
+		goto exit;
+
+	curdata += MQTTPacket_decodeBuf(curdata, &mylen); /* read remaining length */
+	enddata = curdata + mylen;
+	if (enddata - curdata < 2)
+		goto exit;
+
+	flags.all = readChar(&curdata);
+	*sessionPresent = flags.bits.sessionpresent;
+	*connack_rc = readChar(&curdata);
+	if (!MQTTProperties_read(properties, &curdata, enddata))
+		goto exit;
+
+	rc = 1;
+exit:
+	return rc;
+}
+
+
 /**
   * Serializes a 0-length packet into the supplied buffer, ready for writing to a socket
   * @param buf the buffer into which the packet will be serialized
@@ -66,6 +66,62 @@ exit:
 }
 
 
+/**
+  * Deserializes the supplied (wire) buffer into MQTT 5 publish data
+  * @param dup returned integer - the MQTT dup flag
+  * @param qos returned integer - the MQTT QoS value
+  * @param retained returned integer - the MQTT retained flag
+  * @param packetid returned integer - the MQTT packet identifier
+  * @param topicName returned MQTTString - the MQTT topic in the publish, empty if the topic alias stands for it
+  * @param properties returned MQTTProperties - the topic alias of the publish, may be NULL
+  * @param payload returned byte buffer - the MQTT publish payload
+  * @param payloadlen returned integer - the length of the MQTT payload
+  * @param buf the raw buffer data, of the correct length determined by the remaining length field
+  * @param buflen the length in bytes of the data in the supplied buffer
+  * @return error code.  1 is success
+  */
+int MQTTV5Deserialize_publish(unsigned char* dup, int* qos, unsigned char* retained, unsigned short* packetid, MQTTString* topicName,
+		MQTTProperties* properties, unsigned char** payload, int* payloadlen, unsigned char* buf, int buflen)
+{
+	MQTTHeader header = {0};
+	unsigned char* curdata = buf;
+	unsigned char* enddata = NULL;
+	int rc = 0;
+	int mylen = 0;
+
+	header.byte = readChar(&curdata);
+	if (header.bits.type != PUBLISH_MSG)
+		goto exit;
+	*dup = header.bits.dup;
+	*qos = header.bits.qos;
+	*retained = header.bits.retain;
+
+	curdata += MQTTPacket_decodeBuf(curdata, &mylen); /* read remaining length */
+	enddata = curdata + mylen;
+	if (enddata - buf > buflen)
+		enddata = buf + buflen; /* only part of the packet is in the buffer */
+
+	if (!readMQTTLenString(topicName, &curdata, enddata))
+		goto exit;
+
+	if (*qos > 0)
+	{
+		if (enddata - curdata < 2)
+			goto exit;
+		*packetid = readInt(&curdata);
+	}
+
+	if (!MQTTProperties_read(properties, &curdata, enddata))
+		goto exit;
+
+	*payloadlen = enddata - curdata;
+	*payload = curdata;
+	rc = 1;
+exit:
+	return rc;
+}
+
+
 
 /**
   * Deserializes the supplied (wire) buffer into an ack
@@ -100,3 +156,40 @@ exit:
 	return rc;
 }
 
+
+/**
+  * Deserializes the supplied (wire) buffer into an MQTT 5 ack. The reason code is optional, an ack without one,
+  * including any MQTT 3.1.1 ack, is a success.
+  * @param packettype returned integer - the MQTT packet type
+  * @param dup returned integer - the MQTT dup flag
+  * @param packetid returned integer - the MQTT packet identifier
+  * @param reasonCode returned integer - the MQTT 5 reason code, 0x80 or more is a failure
+  * @param buf the raw buffer data, of the correct length determined by the remaining length field
+  * @param buflen the length in bytes of the data in the supplied buffer
+  * @return error code.  1 is success, 0 is failure
+  */
+int MQTTV5Deserialize_ack(unsigned char* packettype, unsigned char* dup, unsigned short* packetid, unsigned char* reasonCode,
+		unsigned char* buf, int buflen)
+{
+	MQTTHeader header = {0};
+	unsigned char* curdata = buf;
+	unsigned char* enddata = NULL;
+	int rc = 0;
+	int mylen;
+
+	header.byte = readChar(&curdata);
+	*dup = header.bits.dup;
+	*packettype = header.bits.type;
+
+	curdata += MQTTPacket_decodeBuf(curdata, &mylen); /* read remaining length */
+	enddata = curdata + mylen;
+
+	if (enddata - curdata < 2)
+		goto exit;
+	*packetid = readInt(&curdata);
+	*reasonCode = (enddata - curdata > 0) ? readChar(&curdata) : 0;
+
+	rc = 1;
+exit:
+	return rc;
+}
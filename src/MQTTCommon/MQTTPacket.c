@@ -244,6 +244,114 @@ int MQTTstrlen(MQTTString mqttstring)
 }
 
 
+/**
+ * Reads a variable byte integer, like the remaining length, without reading beyond the end of the data
+ * @param value returned integer
+ * @param pptr pointer to the input buffer - incremented by the number of bytes used
+ * @param enddata pointer to the end of the data: do not read beyond
+ * @return 1 if successful, 0 if not
+ */
+static int readVarInt(int* value, unsigned char** pptr, unsigned char* enddata)
+{
+	int multiplier = 1;
+	int len = 0;
+	unsigned char c;
+
+	*value = 0;
+	do
+	{
+		if (*pptr >= enddata || ++len > MAX_NO_OF_REMAINING_LENGTH_BYTES)
+			return 0;
+		c = *(*pptr)++;
+		*value += (c & 127) * multiplier;
+		multiplier *= 128;
+	} while ((c & 128) != 0);
+	return 1;
+}
+
+
+/**
+ * Reads the MQTT 5 properties of a packet, their length and then each property. Those in MQTTProperties are
+ * returned, the rest are skipped.
+ * @param properties returned MQTTProperties - the properties the client acts on, may be NULL to skip them all
+ * @param pptr pointer to the input buffer - incremented by the number of bytes used
+ * @param enddata pointer to the end of the data: do not read beyond
+ * @return 1 if successful, 0 if not
+ */
+int MQTTProperties_read(MQTTProperties* properties, unsigned char** pptr, unsigned char* enddata)
+{
+	MQTTProperties ignored;
+	MQTTString string;
+	unsigned char* curdata = *pptr;
+	int len = 0;
+	int rc = 0;
+
+	if (properties == NULL)
+		properties = &ignored;
+	properties->receiveMaximum = 65535;
+	properties->topicAliasMaximum = 0;
+	properties->topicAlias = 0;
+	properties->serverKeepAlive = -1;
+
+	if (!readVarInt(&len, &curdata, enddata) || enddata - curdata < len)
+		goto exit;
+	enddata = curdata + len;
+
+	while (curdata < enddata)
+	{
+		int identifier = *curdata++;
+		int value = 0;
+
+		switch (identifier)
+		{
+		case 0x01: case 0x17: case 0x19: case 0x24: case 0x25: case 0x28: case 0x29: case 0x2A: /* byte */
+			if (enddata - curdata < 1)
+				goto exit;
+			curdata += 1;
+			break;
+		case MQTTPROPERTY_SERVER_KEEP_ALIVE: case MQTTPROPERTY_RECEIVE_MAXIMUM: /* two byte integer */
+		case MQTTPROPERTY_TOPIC_ALIAS_MAXIMUM: case MQTTPROPERTY_TOPIC_ALIAS:
+			if (enddata - curdata < 2)
+				goto exit;
+			value = readInt(&curdata);
+			if (identifier == MQTTPROPERTY_SERVER_KEEP_ALIVE)
+				properties->serverKeepAlive = value;
+			else if (identifier == MQTTPROPERTY_RECEIVE_MAXIMUM)
+				properties->receiveMaximum = value;
+			else if (identifier == MQTTPROPERTY_TOPIC_ALIAS_MAXIMUM)
+				properties->topicAliasMaximum = value;
+			else
+				properties->topicAlias = value;
+			break;
+		case 0x02: case 0x11: case 0x18: case 0x27: /* four byte integer */
+			if (enddata - curdata < 4)
+				goto exit;
+			curdata += 4;
+			break;
+		case 0x0B: /* variable byte integer */
+			if (!readVarInt(&value, &curdata, enddata))
+				goto exit;
+			break;
+		case 0x26: /* string pair */
+			if (!readMQTTLenString(&string, &curdata, enddata))
+				goto exit;
+			/* falls through - the second string follows */
+		case 0x03: case 0x08: case 0x09: case 0x12: case 0x15: case 0x16: case 0x1A: case 0x1C: case 0x1F: /* string or binary data */
+			if (!readMQTTLenString(&string, &curdata, enddata))
+				goto exit;
+			break;
+		default:
+			goto exit; /* not a property, the packet is malformed */
+		}
+	}
+
+	*pptr = curdata;
+	rc = 1;
+exit:
+	return rc;
+}
+
+
 /**
  * Compares an MQTTString to a C string
  * @param a the MQTTString to compare
@@ -88,6 +88,28 @@ typedef struct
 
 int MQTTstrlen(MQTTString mqttstring);
 
+/**
+ * MQTT 5 property identifiers the client acts on.
+ */
+enum propertyIdentifiers
+{
+	MQTTPROPERTY_SERVER_KEEP_ALIVE = 0x13, MQTTPROPERTY_RECEIVE_MAXIMUM = 0x21,
+	MQTTPROPERTY_TOPIC_ALIAS_MAXIMUM = 0x22, MQTTPROPERTY_TOPIC_ALIAS = 0x23
+};
+
+/**
+ * The MQTT 5 properties of a received packet that the client acts on. Any others are skipped.
+ */
+typedef struct
+{
+	unsigned short receiveMaximum;		/**< QoS 1 and 2 publishes the sender takes at once, 65535 if absent */
+	unsigned short topicAliasMaximum;	/**< highest topic alias the sender takes, 0 if absent */
+	unsigned short topicAlias;			/**< topic alias of a publish, 0 if absent */
+	int serverKeepAlive;				/**< keepalive interval the server requires in seconds, -1 if absent */
+} MQTTProperties;
+
+int MQTTProperties_read(MQTTProperties* properties, unsigned char** pptr, unsigned char* enddata);
+
 #include "MQTTConnect.h"
 #include "MQTTPublish.h"
 #include "MQTTSubscribe.h"
@@ -95,6 +117,8 @@ int MQTTstrlen(MQTTString mqttstring);
 
 int MQTTSerialize_ack(unsigned char* buf, int buflen, unsigned char type, unsigned char dup, unsigned short packetid);
 int MQTTDeserialize_ack(unsigned char* packettype, unsigned char* dup, unsigned short* packetid, unsigned char* buf, int buflen);
+int MQTTV5Deserialize_ack(unsigned char* packettype, unsigned char* dup, unsigned short* packetid, unsigned char* reasonCode,
+		unsigned char* buf, int buflen);
 
 int MQTTPacket_len(int rem_len);
 int MQTTPacket_equals(MQTTString* a, char* b);
@@ -89,6 +89,129 @@ exit:
 
 
 
+/**
+  * Serializes the fixed header of a publish packet and the length of its topic name.
+  * @param rem_len integer - the remaining length of the whole packet
+  * @return the length of the serialized header.  <= 0 indicates error
+  */
+static int serializePublishHeader(unsigned char* buf, int buflen, unsigned char dup, int qos, unsigned char retained,
+		MQTTString topicName, int rem_len)
+{
+	unsigned char *ptr = buf;
+	MQTTHeader header = {0};
+	int rc = 0;
+
+	if (buflen < 7)
+	{
+		rc = MQTTPACKET_BUFFER_TOO_SHORT;
+		goto exit;
+	}
+
+	header.bits.type = PUBLISH_MSG;
+	header.bits.dup = dup;
+	header.bits.qos = qos;
+	header.bits.retain = retained;
+	writeChar(&ptr, header.byte); /* write header */
+
+	ptr += MQTTPacket_encode(ptr, rem_len); /* write remaining length */;
+
+	writeInt(&ptr, MQTTstrlen(topicName)); /* write topic name length, the topic name itself is sent separately */
+
+	rc = ptr - buf;
+
+exit:
+	return rc;
+}
+
+
+/**
+  * Serializes the part of a publish packet that precedes the topic name, so the packet can be sent as separate
+  * blocks without copying the topic and payload. The packet on the wire is the returned header, the topic name,
+  * the 2 byte packet identifier if qos > 0, then the payload.
+  * @param buf the buffer into which the header will be serialized
+  * @param buflen the length in bytes of the supplied buffer
+  * @param dup integer - the MQTT dup flag
+  * @param qos integer - the MQTT QoS value
+  * @param retained integer - the MQTT retained flag
+  * @param topicName MQTTString - the MQTT topic in the publish
+  * @param payloadlen integer - the length of the MQTT payload
+  * @return the length of the serialized header.  <= 0 indicates error
+  */
+int MQTTSerialize_publishHeader(unsigned char* buf, int buflen, unsigned char dup, int qos, unsigned char retained,
+		MQTTString topicName, int payloadlen)
+{
+	return serializePublishHeader(buf, buflen, dup, qos, retained, topicName,
+		MQTTSerialize_publishLength(qos, topicName, payloadlen));
+}
+
+
+/**
+  * Determines the length of the properties of an MQTT 5 publish packet, including the properties length
+  * @param topicAlias the topic alias, 0 for none
+  * @return the length of buffer needed to contain the serialized properties
+  */
+static int publishPropertiesLength(unsigned short topicAlias)
+{
+	return 1 + ((topicAlias > 0) ? 3 : 0);
+}
+
+
+/**
+  * Serializes the part of an MQTT 5 publish packet that precedes the topic name. The packet on the wire is the
+  * returned header, the topic name, the 2 byte packet identifier if qos > 0, the properties written by
+  * MQTTV5Serialize_publishProperties, then the payload. Once a topic alias has been sent with its topic, later
+  * publishes can send the alias with an empty topic name.
+  * @param buf the buffer into which the header will be serialized
+  * @param buflen the length in bytes of the supplied buffer
+  * @param dup integer - the MQTT dup flag
+  * @param qos integer - the MQTT QoS value
+  * @param retained integer - the MQTT retained flag
+  * @param topicName MQTTString - the MQTT topic in the publish, empty to use the topic of the alias
+  * @param topicAlias the topic alias, 0 for none
+  * @param payloadlen integer - the length of the MQTT payload
+  * @return the length of the serialized header.  <= 0 indicates error
+  */
+int MQTTV5Serialize_publishHeader(unsigned char* buf, int buflen, unsigned char dup, int qos, unsigned char retained,
+		MQTTString topicName, unsigned short topicAlias, int payloadlen)
+{
+	return serializePublishHeader(buf, buflen, dup, qos, retained, topicName,
+		MQTTSerialize_publishLength(qos, topicName, payloadlen) + publishPropertiesLength(topicAlias));
+}
+
+
+/**
+  * Serializes the properties of an MQTT 5 publish packet, which follow the packet identifier.
+  * @param buf the buffer into which the properties will be serialized
+  * @param buflen the length in bytes of the supplied buffer
+  * @param topicAlias the topic alias, 0 for none
+  * @return the length of the serialized properties.  <= 0 indicates error
+  */
+int MQTTV5Serialize_publishProperties(unsigned char* buf, int buflen, unsigned short topicAlias)
+{
+	unsigned char *ptr = buf;
+	int len = publishPropertiesLength(topicAlias);
+	int rc = 0;
+
+	if (buflen < len)
+	{
+		rc = MQTTPACKET_BUFFER_TOO_SHORT;
+		goto exit;
+	}
+
+	ptr += MQTTPacket_encode(ptr, len - 1); /* write properties length */
+	if (topicAlias > 0)
+	{
+		writeChar(&ptr, MQTTPROPERTY_TOPIC_ALIAS);
+		writeInt(&ptr, topicAlias);
+	}
+
+	rc = ptr - buf;
+
+exit:
+	return rc;
+}
+
+
 /**
   * Serializes the ack packet into the supplied buffer.
   * @param buf the buffer into which the packet will be serialized
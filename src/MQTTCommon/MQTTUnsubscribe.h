@@ -35,4 +35,7 @@ DLLExport int MQTTSerialize_unsuback(unsigned char* buf, int buflen, unsigned sh
 
 DLLExport int MQTTDeserialize_unsuback(unsigned short* packetid, unsigned char* buf, int len);
 
+DLLExport int MQTTV5Serialize_unsubscribe(unsigned char* buf, int buflen, unsigned char dup, unsigned short packetid,
+		int count, MQTTString topicFilters[]);
+
 #endif /* MQTTUNSUBSCRIBE_H_ */
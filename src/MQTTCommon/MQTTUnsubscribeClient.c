@@ -36,25 +36,20 @@ int MQTTSerialize_unsubscribeLength(int count, MQTTString topicFilters[])
 
 
 /**
-  * Serializes the supplied unsubscribe data into the supplied buffer, ready for sending
-  * @param buf the raw buffer data, of the correct length determined by the remaining length field
-  * @param buflen the length in bytes of the data in the supplied buffer
-  * @param dup integer - the MQTT dup flag
-  * @param packetid integer - the MQTT packet identifier
-  * @param count - number of members in the topicFilters array
-  * @param topicFilters - array of topic filter names
-  * @return the length of the serialized data.  <= 0 indicates error
+  * Serializes unsubscribe data, with a properties length of 0 for MQTT 5
   */
-int MQTTSerialize_unsubscribe(unsigned char* buf, int buflen, unsigned char dup, unsigned short packetid,
-		int count, MQTTString topicFilters[])
+static int serializeUnsubscribe(unsigned char* buf, int buflen, unsigned char dup, unsigned short packetid,
+		int count, MQTTString topicFilters[], int MQTTVersion)
 {
 	unsigned char *ptr = buf;
 	MQTTHeader header = {0};
-	int rem_len = 0;
+	int rem_len = MQTTSerialize_unsubscribeLength(count, topicFilters);
 	int rc = -1;
 	int i = 0;
 
-	if (MQTTPacket_len(rem_len = MQTTSerialize_unsubscribeLength(count, topicFilters)) > buflen)
+	if (MQTTVersion == 5)
+		rem_len += 1; /* properties length */
+	if (MQTTPacket_len(rem_len) > buflen)
 	{
 		rc = MQTTPACKET_BUFFER_TOO_SHORT;
 		goto exit;
@@ -69,6 +64,8 @@ int MQTTSerialize_unsubscribe(unsigned char* buf, int buflen, unsigned char dup,
 	ptr += MQTTPacket_encode(ptr, rem_len); /* write remaining length */;
 
 	writeInt(&ptr, packetid);
+	if (MQTTVersion == 5)
+		writeChar(&ptr, 0); /* no properties */
 
 	for (i = 0; i < count; ++i)
 		writeMQTTString(&ptr, topicFilters[i]);
@@ -79,6 +76,40 @@ exit:
 }
 
 
+/**
+  * Serializes the supplied unsubscribe data into the supplied buffer, ready for sending
+  * @param buf the raw buffer data, of the correct length determined by the remaining length field
+  * @param buflen the length in bytes of the data in the supplied buffer
+  * @param dup integer - the MQTT dup flag
+  * @param packetid integer - the MQTT packet identifier
+  * @param count - number of members in the topicFilters array
+  * @param topicFilters - array of topic filter names
+  * @return the length of the serialized data.  <= 0 indicates error
+  */
+int MQTTSerialize_unsubscribe(unsigned char* buf, int buflen, unsigned char dup, unsigned short packetid,
+		int count, MQTTString topicFilters[])
+{
+	return serializeUnsubscribe(buf, buflen, dup, packetid, count, topicFilters, 4);
+}
+
+
+/**
+  * Serializes the supplied unsubscribe data into the supplied buffer as an MQTT 5 packet without properties
+  * @param buf the raw buffer data, of the correct length determined by the remaining length field
+  * @param buflen the length in bytes of the data in the supplied buffer
+  * @param dup integer - the MQTT dup flag
+  * @param packetid integer - the MQTT packet identifier
+  * @param count - number of members in the topicFilters array
+  * @param topicFilters - array of topic filter names
+  * @return the length of the serialized data.  <= 0 indicates error
+  */
+int MQTTV5Serialize_unsubscribe(unsigned char* buf, int buflen, unsigned char dup, unsigned short packetid,
+		int count, MQTTString topicFilters[])
+{
+	return serializeUnsubscribe(buf, buflen, dup, packetid, count, topicFilters, 5);
+}
+
+
 /**
   * Deserializes the supplied (wire) buffer into unsuback data
   * @param packetid returned integer - the MQTT packet identifier
@@ -14,6 +14,8 @@
  *    Allan Stockdill-Mander - initial API and implementation and/or initial documentation
  *******************************************************************************/
 
+#include <limits.h>
+#include <string.h>
 #include <Client.h>
 #if defined(ARDUINO)
 #if ARDUINO >= 100
@@ -23,77 +25,192 @@
 #endif
 #endif
 #include "MQTTArduino.h"
+#if defined(ESP8266)
+#include <ESP8266WiFi.h>
+#define ARDUINO_HOST_BY_NAME
+#elif defined(ESP32)
+#include <WiFi.h>
+#define ARDUINO_HOST_BY_NAME
+#endif
 
 void TimerInit(Timer* timer)
 {
-	timer->interval_end_ms = 0;
+	timer->start_ms = 0;
+	timer->interval_ms = TIMER_STOPPED;
 }
 
 
 char TimerIsExpired(Timer* timer)
 {
-	return (timer->interval_end_ms > 0L) && (millis() >= timer->interval_end_ms);
+	// The elapsed time is right across a millis() wraparound, where comparing with an end time isn't.
+	return (timer->interval_ms != TIMER_STOPPED) && (millis() - timer->start_ms >= timer->interval_ms);
 }
 
 
 void TimerCountdownMS(Timer* timer, unsigned int timeout)
 {
-	timer->interval_end_ms = millis() + timeout;
+	timer->start_ms = millis();
+	timer->interval_ms = timeout;
 }
 
 
 void TimerCountdown(Timer* timer, unsigned int timeout)
 {
-	TimerCountdownMS(timer, timeout * 1000L);
+	// Set directly, a countdown of more than 65 seconds doesn't fit in the unsigned int of TimerCountdownMS on AVR.
+	timer->start_ms = millis();
+	timer->interval_ms = timeout * 1000UL;
 }
 
 
 int TimerLeftMS(Timer* timer)
 {
-	return timer->interval_end_ms - millis();
+	unsigned long elapsed = millis() - timer->start_ms;
+	if (elapsed >= timer->interval_ms)
+		return 0;
+	return (timer->interval_ms - elapsed > INT_MAX) ? INT_MAX : (int)(timer->interval_ms - elapsed);
 }
 
 
-int arduino_read(Network* network, unsigned char* buffer, int len, int timeout_ms)
+/**
+* Move everything the client has received into the receive ring with bulk reads.
+* @param[in] network Pointer to the Network struct
+* @return Number of bytes added to the ring
+*/
+static int arduino_fill(Network* network)
 {
-	int interval = 10;  // all times are in milliseconds
-	int total = 0, rc = -1;
-	int bytesRead = 0;
 	Client* client = static_cast<Client*>(network->client);
+	int available = client->available();
+	int total = 0;
+	unsigned char* space;
+	int len;
 
-	if (timeout_ms < 30)
-		interval = 2;
-	while (client->available() < len && total < timeout_ms)
+	while (available > 0 && (len = NetworkRingReserve(&network->rx, &space)) > 0)
 	{
-		delay(interval);
-		total += interval;
+		if (len > available)
+			len = available;
+		len = client->read(space, len);
+		NetworkStatsRead(&network->stats, len);
+		if (len <= 0)
+			break;
+		NetworkRingCommit(&network->rx, len);
+		available -= len;
+		total += len;
 	}
-	if (client->available() >= len)
-		rc = client->readBytes((char*)buffer, len);
-	else {
-		while (client->available() && bytesRead < len)
-		{
-			rc = bytesRead += client->readBytes((char*)buffer + bytesRead, len - bytesRead);
+	return total;
+}
+
+
+/**
+* Wait until data is buffered in the receive ring or the timeout expires.
+* @param[in] network Pointer to the Network struct
+* @param[in] start Time the wait started, from millis()
+* @param[in] timeout_ms Timeout for the wait, in milliseconds
+* @return 1 if data is buffered, 0 otherwise
+*/
+static int arduino_wait(Network* network, unsigned long start, int timeout_ms)
+{
+	unsigned long waitStart = millis();
+	int rc = 1;
+	while (arduino_fill(network) == 0)
+	{
+		if ((long)(millis() - start) >= timeout_ms) {
+			rc = 0;
+			break;
 		}
+		delay(1);
 	}
+	network->stats.readWaitMs += millis() - waitStart;
 	return rc;
 }
 
 
+int arduino_read(Network* network, unsigned char* buffer, int len, int timeout_ms)
+{
+	unsigned long start = millis();
+	int bytesRead = NetworkRingRead(&network->rx, buffer, len);
+
+	while (bytesRead < len && arduino_wait(network, start, timeout_ms))
+	{
+		bytesRead += NetworkRingRead(&network->rx, buffer + bytesRead, len - bytesRead);
+	}
+	return bytesRead ? bytesRead : -1;
+}
+
+
+int arduino_peek(Network* network, unsigned char** data, int timeout_ms)
+{
+	if (NetworkRingAvailable(&network->rx) == 0)
+		arduino_wait(network, millis(), timeout_ms);
+	return NetworkRingPeek(&network->rx, data);
+}
+
+
+void arduino_skip(Network* network, int len)
+{
+	NetworkRingConsume(&network->rx, len);
+}
+
+
+/**
+* Reduce the write chunk size after the client failed to accept a whole chunk.
+* @param[in] network Pointer to the Network struct
+* @param[in] accepted Number of bytes the client did accept
+* @param[in] chunk Size of the chunk that was written
+*/
+static void arduino_shrink_chunk(Network* network, int accepted, int chunk)
+{
+	int size = (accepted > 0) ? accepted : chunk / 2;
+	network->fullChunks = 0;
+	network->chunkSize = (size < ARDUINO_MIN_CHUNK_SIZE) ? ARDUINO_MIN_CHUNK_SIZE : size;
+}
+
+
+/**
+* Increase the write chunk size once the client has accepted enough whole chunks in a row.
+* @param[in] network Pointer to the Network struct
+*/
+static void arduino_grow_chunk(Network* network)
+{
+	if (++network->fullChunks < ARDUINO_CHUNK_GROW_WRITES)
+		return;
+	network->fullChunks = 0;
+	network->chunkSize *= 2;
+	if (network->chunkSize > ARDUINO_MAX_CHUNK_SIZE)
+		network->chunkSize = 0;
+}
+
+
 int arduino_write(Network* network, unsigned char* buffer, int len, int timeout_ms)
 {
 	Client* client = static_cast<Client*>(network->client);
-	client->setTimeout(timeout_ms);
+	if (network->clientTimeout != timeout_ms) {
+		// Some clients do work in setTimeout, so only call it when the timeout changes.
+		client->setTimeout(timeout_ms);
+		network->clientTimeout = timeout_ms;
+	}
 
+	unsigned long start = millis();
 	int index = 0;
-	int chunk = len;
 	while (index < len) {
-		if (network->chunkSize) {
-			chunk = (network->chunkSize < len - index) ? network->chunkSize : len - index;
-		}
+		int chunk = len - index;
+		if (network->chunkSize && network->chunkSize < chunk)
+			chunk = network->chunkSize;
 		int bytesWritten = client->write((uint8_t*)buffer + index, chunk);
-		if (bytesWritten == 0) {
-			return -1;
+		NetworkStatsWrite(&network->stats, chunk, bytesWritten);
+		if (bytesWritten < chunk) {
+			arduino_shrink_chunk(network, bytesWritten, chunk);
+			if (bytesWritten <= 0) {
+				// Nothing was accepted, retry with the smaller chunk until the timeout unless the connection dropped.
+				if (!client->connected())
+					return index ? index : -1;
+				if ((long)(millis() - start) >= timeout_ms)
+					return index;
+				delay(1);
+				continue;
+			}
+		}
+		else if (chunk == network->chunkSize) {
+			arduino_grow_chunk(network);
 		}
 		index += bytesWritten;
 	}
@@ -101,18 +218,85 @@ int arduino_write(Network* network, unsigned char* buffer, int len, int timeout_
 }
 
 
+int arduino_writev(Network* network, NetworkVector* vectors, int count, int timeout_ms)
+{
+	// The Client interface has no vectored write, so fall back to writing each block in turn.
+	int total = 0;
+	for (int i = 0; i < count; ++i) {
+		if (vectors[i].len <= 0)
+			continue;
+		int rc = arduino_write(network, vectors[i].data, vectors[i].len, timeout_ms);
+		if (rc < 0)
+			return total ? total : rc;
+		total += rc;
+		if (rc < vectors[i].len)
+			break;
+	}
+	return total;
+}
+
+
 void NetworkInit(Network* network, void* client, int chunkSize)
 {
 	network->client = client;
-	network->chunkSize = chunkSize;
+	network->chunkSize = (chunkSize > 0 && chunkSize < ARDUINO_MIN_CHUNK_SIZE) ? ARDUINO_MIN_CHUNK_SIZE : chunkSize;
+	network->fullChunks = 0;
+	NetworkStatsInit(&network->stats);
+	network->clientTimeout = -1;
+	network->addressTTL = ARDUINO_ADDRESS_TTL_MS;
+	network->host[0] = '\0';
 	network->mqttread = arduino_read;
 	network->mqttwrite = arduino_write;
+	network->mqttwritev = arduino_writev;
+	network->mqttpeek = arduino_peek;
+	network->mqttskip = arduino_skip;
+	NetworkRingInit(&network->rx);
 }
 
 
+#if defined(ARDUINO_HOST_BY_NAME)
+/**
+* Get the address of a host, from the cache if it has not expired.
+* @param[in] network Pointer to the Network struct
+* @param[in] addr Host name
+* @param[out] address The resolved address
+* @return 1 if the host was resolved, 0 otherwise
+*/
+static int arduino_resolve(Network* network, const char* addr, IPAddress& address)
+{
+	if (network->host[0] && strcmp(network->host, addr) == 0 && !TimerIsExpired(&network->addressExpiry)) {
+		address = IPAddress(network->address);
+		return 1;
+	}
+	network->host[0] = '\0';
+	if (WiFi.hostByName(addr, address) != 1)
+		return 0;
+	if (strlen(addr) < sizeof(network->host)) {
+		strcpy(network->host, addr);
+		network->address = (uint32_t)address;
+		TimerInit(&network->addressExpiry);
+		TimerCountdownMS(&network->addressExpiry, network->addressTTL);
+	}
+	return 1;
+}
+#endif
+
+
 int NetworkConnect(Network* network, char* addr, int port)
 {
 	Client* client = static_cast<Client*>(network->client);
+	NetworkRingInit(&network->rx);
+#if defined(ARDUINO_HOST_BY_NAME)
+	if (network->addressTTL > 0) {
+		IPAddress address;
+		if (!arduino_resolve(network, addr, address))
+			return 0;
+		if (client->connect(address, port))
+			return 1;
+		// The host may have moved, so drop the cached address and let the client resolve the name itself.
+		network->host[0] = '\0';
+	}
+#endif
 	return client->connect(addr, port);
 }
 
@@ -121,6 +305,13 @@ void NetworkDisconnect(Network* network)
 {
 	Client* client = static_cast<Client*>(network->client);
 	client->stop();
+	NetworkRingInit(&network->rx);
+}
+
+
+void NetworkGetStats(Network* network, NetworkStats* stats)
+{
+	*stats = network->stats;
 }
 
 
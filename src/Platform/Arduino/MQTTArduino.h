@@ -17,19 +17,45 @@
 #if !defined(__MQTT_ARDUINO_)
 #define __MQTT_ARDUINO_
 
+#include <stdint.h>
+#include "../NetworkCommon.h"
+
+#ifndef ARDUINO_MIN_CHUNK_SIZE
+#define ARDUINO_MIN_CHUNK_SIZE 32 // Smallest chunk size arduino_write will shrink to
+#endif
+
+#ifndef ARDUINO_CHUNK_GROW_WRITES
+#define ARDUINO_CHUNK_GROW_WRITES 8 // Number of whole chunks that must be accepted in a row before the chunk size grows
+#endif
+
+#ifndef ARDUINO_ADDRESS_TTL_MS
+#define ARDUINO_ADDRESS_TTL_MS 300000 // Time a resolved address is reused before the host name is resolved again
+#endif
+
+#ifndef ARDUINO_HOST_SIZE
+#define ARDUINO_HOST_SIZE 64 // Longest host name whose address is cached
+#endif
+
+#ifndef ARDUINO_MAX_CHUNK_SIZE
+#define ARDUINO_MAX_CHUNK_SIZE 1460 // Once the chunk size grows past this, data is no longer sent in chunks
+#endif
 
 #if defined(__cplusplus)
 extern "C" {
 #endif
 
 	/**
-	* Countdown timer struct.
+	* Countdown timer struct. The start and length of the countdown are kept rather than its end, so it keeps working
+	* when millis() wraps around after 49 days.
 	*/
 	typedef struct Timer
 	{
-		unsigned long interval_end_ms;
+		unsigned long start_ms; /**< millis() when the countdown started. */
+		unsigned long interval_ms; /**< Length of the countdown, TIMER_STOPPED if it hasn't been started. */
 	} Timer;
 
+#define TIMER_STOPPED ((unsigned long)-1)
+
 	/**
 	* Initialize countdown timer.
 	* @param[in] timer Pointer to Timer struct
@@ -60,7 +86,7 @@ extern "C" {
 	/**
 	* Get the number of milliseconds left in countdown.
 	* @param[in] timer Pointer to Timer struct
-	* @return Number of milliseconds left.
+	* @return Number of milliseconds left, 0 if it has expired, at most INT_MAX.
 	*/
 	int TimerLeftMS(Timer* timer);
 
@@ -71,7 +97,15 @@ extern "C" {
 	typedef struct Network
 	{
 		void* client; /**< The network client. */
-		int chunkSize; /**< The chunk size to use when writing data, 0 for no limit. */
+		int chunkSize; /**< The chunk size currently used when writing data, 0 for no limit. Adapted by arduino_write. */
+		unsigned int fullChunks; /**< Whole chunks accepted in a row since the chunk size last changed. */
+		NetworkStats stats; /**< I/O counters. */
+		int clientTimeout; /**< Timeout last passed to the client's setTimeout, -1 if not set. */
+		NetworkRing rx; /**< Data received from the client that has not been read yet. */
+		unsigned long addressTTL; /**< Time in milliseconds a resolved address is reused, 0 to resolve the host on every connect. */
+		char host[ARDUINO_HOST_SIZE]; /**< Host name of the cached address, empty if there is none. */
+		uint32_t address; /**< Cached IPv4 address of host. */
+		Timer addressExpiry; /**< Countdown until the cached address must be resolved again. */
 
 		/**
 		* Read data from the network.
@@ -92,6 +126,32 @@ extern "C" {
 		* @return Number of bytes written, or a negative value if there was an error
 		*/
 		int(*mqttwrite) (struct Network* network, unsigned char* buffer, int len, int timeout_ms);
+
+		/**
+		* Write a list of data blocks to the network as one stream.
+		* @param[in] network Pointer to the Network struct
+		* @param[in] vectors Data blocks to write
+		* @param[in] count Number of data blocks
+		* @param[in] timeout_ms Timeout for the write operation, in milliseconds
+		* @return Number of bytes written, or a negative value if there was an error
+		*/
+		int(*mqttwritev) (struct Network* network, NetworkVector* vectors, int count, int timeout_ms);
+
+		/**
+		* Get received data in place, without copying it.
+		* @param[in] network Pointer to the Network struct
+		* @param[out] data Set to the start of the buffered data
+		* @param[in] timeout_ms Time to wait for data if none is buffered, in milliseconds
+		* @return Number of contiguous bytes at data, 0 if no data arrived, or a negative value if there was an error
+		*/
+		int(*mqttpeek) (struct Network* network, unsigned char** data, int timeout_ms);
+
+		/**
+		* Consume data returned by mqttpeek.
+		* @param[in] network Pointer to the Network struct
+		* @param[in] len Number of bytes to consume
+		*/
+		void(*mqttskip) (struct Network* network, int len);
 	} Network;
 
 	/**
@@ -103,31 +163,58 @@ extern "C" {
 	* @return Number of bytes read, or a negative value if there was an error
 	*/
 	int arduino_read(struct Network* network, unsigned char* buffer, int len, int timeout_ms);
-	
+
+	/**
+	* Get received data in place, without copying it.
+	* @param[in] network Pointer to the Network struct
+	* @param[out] data Set to the start of the buffered data
+	* @param[in] timeout_ms Time to wait for data if none is buffered, in milliseconds
+	* @return Number of contiguous bytes at data, 0 if no data arrived, or a negative value if there was an error
+	*/
+	int arduino_peek(struct Network* network, unsigned char** data, int timeout_ms);
+
+	/**
+	* Consume data returned by arduino_peek.
+	* @param[in] network Pointer to the Network struct
+	* @param[in] len Number of bytes to consume
+	*/
+	void arduino_skip(struct Network* network, int len);
+
 	/**
-	* Write data to the network.
+	* Write data to the network. The chunk size is halved or cut to what the client accepted when a write comes up
+	* short, and doubled after a run of whole chunks is accepted, so it settles on what the client's socket buffer can take.
 	* @param[in] network Pointer to the Network struct
 	* @param[in] buffer Buffer that contains data to write
 	* @param[in] len Number of bytes to write
 	* @param[in] timeout_ms Timeout for the write operation, in milliseconds
-	* @return Number of bytes written, or a negative value if there was an error
+	* @return Number of bytes written, which may be 0 if the timeout expired, or a negative value if there was an error
 	*/
 	int arduino_write(struct Network* network, unsigned char* buffer, int len, int timeout_ms);
 
+	/**
+	* Write a list of data blocks to the network as one stream.
+	* @param[in] network Pointer to the Network struct
+	* @param[in] vectors Data blocks to write
+	* @param[in] count Number of data blocks
+	* @param[in] timeout_ms Timeout for the write operation, in milliseconds
+	* @return Number of bytes written, or a negative value if there was an error
+	*/
+	int arduino_writev(struct Network* network, NetworkVector* vectors, int count, int timeout_ms);
+
 	/**
 	* Initialize Network struct
 	* @param[in] network Pointer to the Network struct
 	* @param[in] client The network client
-	* @param[in] network The chunk size to use when writing data, 0 for no limit
+	* @param[in] chunkSize The initial chunk size to use when writing data, 0 for no limit
 	*/
 	void NetworkInit(Network* network, void* client, int chunkSize);
 
 	/**
-	* Connect to the specified address.
+	* Connect to the specified address. On ESP8266 and ESP32 the resolved address is cached for addressTTL milliseconds.
 	* @param[in] network Pointer to the Network struct
 	* @param[in] addr Destination address
 	* @param[in] port Destination port
-	* @return 0 if successfully connected, an error code otherwise
+	* @return 1 if successfully connected, 0 otherwise
 	*/
 	int NetworkConnect(Network* network, char* addr, int port);
 
@@ -137,6 +224,13 @@ extern "C" {
 	*/
 	void NetworkDisconnect(Network* network);
 
+	/**
+	* Get the I/O counters. The counters accumulate across reconnects.
+	* @param[in] network Pointer to the Network struct
+	* @param[out] stats Receives a copy of the counters
+	*/
+	void NetworkGetStats(Network* network, NetworkStats* stats);
+
 	/**
 	* Get the connection state.
 	* @param[in] network Pointer to the Network struct
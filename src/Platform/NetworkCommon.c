@@ -0,0 +1,115 @@
+/*
+The MIT License(MIT)
+
+Cayenne MQTT Client Library
+Copyright (c) 2016 myDevices
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated
+documentation files(the "Software"), to deal in the Software without restriction, including without limitation
+the rights to use, copy, modify, merge, publish, distribute, sublicense, and / or sell copies of the Software,
+and to permit persons to whom the Software is furnished to do so, subject to the following conditions :
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include "NetworkCommon.h"
+#include <string.h>
+
+void NetworkRingInit(NetworkRing* ring)
+{
+	ring->head = 0;
+	ring->tail = 0;
+	ring->count = 0;
+}
+
+
+int NetworkRingAvailable(NetworkRing* ring)
+{
+	return ring->count;
+}
+
+
+int NetworkRingRead(NetworkRing* ring, unsigned char* buffer, int len)
+{
+	int total = 0;
+	while (total < len && ring->count > 0) {
+		unsigned char* data;
+		int chunk = NetworkRingPeek(ring, &data);
+		if (chunk > len - total)
+			chunk = len - total;
+		memcpy(buffer + total, data, chunk);
+		NetworkRingConsume(ring, chunk);
+		total += chunk;
+	}
+	return total;
+}
+
+
+int NetworkRingPeek(NetworkRing* ring, unsigned char** data)
+{
+	unsigned int contiguous = NETWORK_RX_BUFFER_SIZE - ring->tail;
+	*data = &ring->data[ring->tail];
+	return (ring->count < contiguous) ? ring->count : contiguous;
+}
+
+
+void NetworkRingConsume(NetworkRing* ring, int len)
+{
+	if (len <= 0)
+		return;
+	if ((unsigned int)len >= ring->count) {
+		// Rewind when the ring empties so the next bulk read gets the whole buffer as one contiguous block.
+		NetworkRingInit(ring);
+		return;
+	}
+	ring->tail = (ring->tail + len) % NETWORK_RX_BUFFER_SIZE;
+	ring->count -= len;
+}
+
+
+int NetworkRingReserve(NetworkRing* ring, unsigned char** data)
+{
+	unsigned int space = NETWORK_RX_BUFFER_SIZE - ring->count;
+	unsigned int contiguous = NETWORK_RX_BUFFER_SIZE - ring->head;
+	*data = &ring->data[ring->head];
+	return (space < contiguous) ? space : contiguous;
+}
+
+
+void NetworkRingCommit(NetworkRing* ring, int len)
+{
+	if (len <= 0)
+		return;
+	ring->head = (ring->head + len) % NETWORK_RX_BUFFER_SIZE;
+	ring->count += len;
+}
+
+
+void NetworkStatsInit(NetworkStats* stats)
+{
+	memset(stats, 0, sizeof(NetworkStats));
+}
+
+
+void NetworkStatsRead(NetworkStats* stats, int received)
+{
+	stats->reads++;
+	if (received > 0)
+		stats->bytesIn += received;
+}
+
+
+void NetworkStatsWrite(NetworkStats* stats, int requested, int written)
+{
+	stats->writes++;
+	if (written <= 0) {
+		stats->zeroWrites++;
+		return;
+	}
+	stats->bytesOut += written;
+	if (written < requested)
+		stats->partialWrites++;
+}
@@ -0,0 +1,143 @@
+/*
+The MIT License(MIT)
+
+Cayenne MQTT Client Library
+Copyright (c) 2016 myDevices
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated
+documentation files(the "Software"), to deal in the Software without restriction, including without limitation
+the rights to use, copy, modify, merge, publish, distribute, sublicense, and / or sell copies of the Software,
+and to permit persons to whom the Software is furnished to do so, subject to the following conditions :
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef _NETWORKCOMMON_h
+#define _NETWORKCOMMON_h
+
+#ifndef NETWORK_RX_BUFFER_SIZE
+#define NETWORK_RX_BUFFER_SIZE 256 // Redefine this for a different receive buffer size
+#endif
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+	/**
+	* A block of data for a vectored write. Packets are sent as a list of vectors so the header, topic and payload can be
+	* written from where they already are instead of being copied into one buffer first.
+	*/
+	typedef struct NetworkVector
+	{
+		unsigned char* data; /**< Start of the data. */
+		int len; /**< Number of bytes at data. */
+	} NetworkVector;
+
+	/**
+	* I/O counters kept by each platform Network implementation. They count calls into the underlying client or
+	* socket, so a single MQTT packet may account for several reads or writes.
+	*/
+	typedef struct NetworkStats
+	{
+		unsigned long bytesIn; /**< Number of bytes received. */
+		unsigned long bytesOut; /**< Number of bytes sent. */
+		unsigned long reads; /**< Number of read calls on the client or socket. */
+		unsigned long writes; /**< Number of write calls on the client or socket. */
+		unsigned long partialWrites; /**< Number of writes that sent some, but not all, of the data. */
+		unsigned long zeroWrites; /**< Number of writes that sent nothing. */
+		unsigned long readWaitMs; /**< Time spent waiting for data to arrive, in milliseconds. */
+	} NetworkStats;
+
+	/**
+	* Receive ring buffer shared by the platform Network implementations. The network is drained into the ring
+	* with bulk reads so the MQTT parser can work from memory instead of reading the client a byte at a time.
+	*/
+	typedef struct NetworkRing
+	{
+		unsigned char data[NETWORK_RX_BUFFER_SIZE]; /**< Buffered data. */
+		unsigned int head; /**< Index the next received byte is written to. */
+		unsigned int tail; /**< Index the next byte is read from. */
+		unsigned int count; /**< Number of bytes buffered. */
+	} NetworkRing;
+
+	/**
+	* Initialize the ring buffer.
+	* @param[in] ring Pointer to the NetworkRing struct
+	*/
+	void NetworkRingInit(NetworkRing* ring);
+
+	/**
+	* Get the number of buffered bytes.
+	* @param[in] ring Pointer to the NetworkRing struct
+	* @return Number of bytes that can be read without touching the network
+	*/
+	int NetworkRingAvailable(NetworkRing* ring);
+
+	/**
+	* Copy buffered bytes out of the ring.
+	* @param[in] ring Pointer to the NetworkRing struct
+	* @param[out] buffer Buffer that receives the data
+	* @param[in] len Maximum number of bytes to copy
+	* @return Number of bytes copied
+	*/
+	int NetworkRingRead(NetworkRing* ring, unsigned char* buffer, int len);
+
+	/**
+	* Get the buffered data that is contiguous in memory, without consuming it.
+	* @param[in] ring Pointer to the NetworkRing struct
+	* @param[out] data Set to the start of the contiguous data
+	* @return Number of contiguous bytes at data
+	*/
+	int NetworkRingPeek(NetworkRing* ring, unsigned char** data);
+
+	/**
+	* Consume bytes previously returned by NetworkRingPeek.
+	* @param[in] ring Pointer to the NetworkRing struct
+	* @param[in] len Number of bytes to consume
+	*/
+	void NetworkRingConsume(NetworkRing* ring, int len);
+
+	/**
+	* Get the free space that is contiguous in memory, so data can be received directly into the ring.
+	* @param[in] ring Pointer to the NetworkRing struct
+	* @param[out] data Set to the start of the contiguous free space
+	* @return Number of bytes that can be written at data
+	*/
+	int NetworkRingReserve(NetworkRing* ring, unsigned char** data);
+
+	/**
+	* Commit bytes written into the space returned by NetworkRingReserve.
+	* @param[in] ring Pointer to the NetworkRing struct
+	* @param[in] len Number of bytes written
+	*/
+	void NetworkRingCommit(NetworkRing* ring, int len);
+
+	/**
+	* Clear the I/O counters.
+	* @param[in] stats Pointer to the NetworkStats struct
+	*/
+	void NetworkStatsInit(NetworkStats* stats);
+
+	/**
+	* Count a read call on the client or socket.
+	* @param[in] stats Pointer to the NetworkStats struct
+	* @param[in] received Number of bytes the call returned, 0 or negative if none
+	*/
+	void NetworkStatsRead(NetworkStats* stats, int received);
+
+	/**
+	* Count a write call on the client or socket.
+	* @param[in] stats Pointer to the NetworkStats struct
+	* @param[in] requested Number of bytes passed to the call
+	* @param[in] written Number of bytes the call accepted, 0 or negative if none
+	*/
+	void NetworkStatsWrite(NetworkStats* stats, int requested, int written);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif
@@ -0,0 +1,883 @@
+/*******************************************************************************
+ * Copyright (c) 2014 IBM Corp.
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v10.html
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *
+ * Contributors:
+ *    Allan Stockdill-Mander - initial API and implementation and/or initial documentation
+ *******************************************************************************/
+
+// The Arduino build compiles every source file in the library, so only build this on Linux hosts.
+#if !defined(ARDUINO) && defined(__linux__)
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include "MQTTPosix.h"
+#if defined(MQTT_TASK)
+#include <poll.h>
+#endif
+
+#if defined(MQTT_TLS) && defined(MQTT_TASK)
+#define TLS_LOCK(network) pthread_mutex_lock(&(network)->sslLock)
+#define TLS_UNLOCK(network) pthread_mutex_unlock(&(network)->sslLock)
+#else
+#define TLS_LOCK(network)
+#define TLS_UNLOCK(network)
+#endif
+
+static unsigned long long posix_millis(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (unsigned long long)now.tv_sec * 1000ULL + now.tv_nsec / 1000000L;
+}
+
+
+void TimerInit(Timer* timer)
+{
+	timer->interval_end_ms = 0;
+}
+
+
+char TimerIsExpired(Timer* timer)
+{
+	return (timer->interval_end_ms > 0) && (posix_millis() >= timer->interval_end_ms);
+}
+
+
+void TimerCountdownMS(Timer* timer, unsigned int timeout)
+{
+	timer->interval_end_ms = posix_millis() + timeout;
+}
+
+
+void TimerCountdown(Timer* timer, unsigned int timeout)
+{
+	TimerCountdownMS(timer, timeout * 1000L);
+}
+
+
+int TimerLeftMS(Timer* timer)
+{
+	unsigned long long now = posix_millis();
+	return (timer->interval_end_ms > now) ? (int)(timer->interval_end_ms - now) : 0;
+}
+
+
+#if defined(MQTT_TASK)
+void MutexInit(Mutex* mutex)
+{
+	pthread_mutex_init(&mutex->m, NULL);
+}
+
+
+int MutexLock(Mutex* mutex)
+{
+	return pthread_mutex_lock(&mutex->m);
+}
+
+
+int MutexUnlock(Mutex* mutex)
+{
+	return pthread_mutex_unlock(&mutex->m);
+}
+
+
+static void* posix_thread(void* arg)
+{
+	Thread* thread = (Thread*)arg;
+	thread->fn(thread->arg);
+	return NULL;
+}
+
+
+int ThreadStart(Thread* thread, void (*fn)(void*), void* arg)
+{
+	pthread_attr_t attr;
+	int rc;
+
+	thread->fn = fn;
+	thread->arg = arg;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	rc = pthread_create(&thread->t, &attr, posix_thread, thread);
+	pthread_attr_destroy(&attr);
+	return rc;
+}
+#endif
+
+
+/**
+* Wait for the socket to become readable or writable.
+* @param[in] network Pointer to the Network struct
+* @param[in] events The epoll events to wait for
+* @param[in] timeout_ms Maximum time to wait, in milliseconds
+* @return 1 if the socket is ready, 0 on timeout, or a negative value if there was an error
+*/
+static int posix_wait(Network* network, unsigned int events, int timeout_ms)
+{
+	int rc;
+#if defined(MQTT_TASK)
+	// The client task reads while other tasks write, so each waits with its own poll rather than switching the
+	// events registered with epoll under the other.
+	struct pollfd fd;
+
+	fd.fd = network->my_socket;
+	fd.events = ((events & EPOLLIN) ? POLLIN : 0) | ((events & EPOLLOUT) ? POLLOUT : 0);
+	fd.revents = 0;
+	do {
+		rc = poll(&fd, 1, timeout_ms < 0 ? 0 : timeout_ms);
+	} while (rc < 0 && errno == EINTR);
+	if (rc > 0 && (fd.revents & (POLLERR | POLLHUP | POLLNVAL)) && !(fd.revents & fd.events))
+		rc = -1;
+#else
+	struct epoll_event event;
+
+	if (network->events != events) {
+		memset(&event, 0, sizeof(event));
+		event.events = events;
+		event.data.fd = network->my_socket;
+		if (epoll_ctl(network->epoll_fd, EPOLL_CTL_MOD, network->my_socket, &event) < 0)
+			return -1;
+		network->events = events;
+	}
+
+	do {
+		rc = epoll_wait(network->epoll_fd, &event, 1, timeout_ms < 0 ? 0 : timeout_ms);
+	} while (rc < 0 && errno == EINTR);
+	if (rc > 0 && (event.events & (EPOLLERR | EPOLLHUP)) && !(event.events & events))
+		rc = -1;
+#endif
+	return rc;
+}
+
+
+/**
+* Receive data from the socket, through TLS if it is in use.
+* @param[in] network Pointer to the Network struct
+* @param[out] buffer Buffer that receives the data
+* @param[in] len Buffer length
+* @return Number of bytes received, 0 if the connection was closed, or -1 with errno set
+*/
+static ssize_t posix_recv(Network* network, unsigned char* buffer, int len)
+{
+	ssize_t rc;
+#if defined(MQTT_TLS)
+	TLS_LOCK(network);
+	if (network->ssl) {
+		rc = SSL_read(network->ssl, buffer, len);
+		if (rc <= 0) {
+			switch (SSL_get_error(network->ssl, rc)) {
+			case SSL_ERROR_WANT_READ:
+			case SSL_ERROR_WANT_WRITE:
+				errno = EAGAIN;
+				rc = -1;
+				break;
+			case SSL_ERROR_ZERO_RETURN:
+				rc = 0;
+				break;
+			default:
+				errno = EIO;
+				rc = -1;
+				break;
+			}
+		}
+		TLS_UNLOCK(network);
+		NetworkStatsRead(&network->stats, rc);
+		return rc;
+	}
+	TLS_UNLOCK(network);
+#endif
+	rc = recv(network->my_socket, buffer, len, 0);
+	NetworkStatsRead(&network->stats, rc);
+	return rc;
+}
+
+
+/**
+* Send data on the socket, through TLS if it is in use.
+* @param[in] network Pointer to the Network struct
+* @param[in] buffer Buffer that contains data to send
+* @param[in] len Number of bytes to send
+* @return Number of bytes sent, or -1 with errno set
+*/
+static ssize_t posix_send(Network* network, unsigned char* buffer, int len)
+{
+	ssize_t rc;
+#if defined(MQTT_TLS)
+	TLS_LOCK(network);
+	if (network->ssl) {
+		rc = SSL_write(network->ssl, buffer, len);
+		if (rc <= 0) {
+			switch (SSL_get_error(network->ssl, rc)) {
+			case SSL_ERROR_WANT_READ:
+			case SSL_ERROR_WANT_WRITE:
+				errno = EAGAIN;
+				rc = -1;
+				break;
+			default:
+				errno = EIO;
+				rc = -1;
+				break;
+			}
+		}
+		TLS_UNLOCK(network);
+		NetworkStatsWrite(&network->stats, len, rc);
+		return rc;
+	}
+	TLS_UNLOCK(network);
+#endif
+	rc = send(network->my_socket, buffer, len, MSG_NOSIGNAL);
+	NetworkStatsWrite(&network->stats, len, rc);
+	return rc;
+}
+
+
+/**
+* Move everything the socket has received into the receive ring, waiting for data if none is buffered.
+* @param[in] network Pointer to the Network struct
+* @param[in] timer Countdown for the wait
+* @return Number of bytes buffered, 0 on timeout, or a negative value if there was an error or the connection was closed
+*/
+static int posix_fill(Network* network, Timer* timer)
+{
+	while (NetworkRingAvailable(&network->rx) == 0)
+	{
+		unsigned char* space;
+		int len;
+		ssize_t rc;
+		if (network->closed)
+			return -1;
+		len = NetworkRingReserve(&network->rx, &space);
+		rc = posix_recv(network, space, len);
+		if (rc > 0) {
+			NetworkRingCommit(&network->rx, rc);
+			// The ring may have wrapped, pick up anything else that is already waiting.
+			if (rc == len && (len = NetworkRingReserve(&network->rx, &space)) > 0 &&
+				(rc = posix_recv(network, space, len)) > 0)
+				NetworkRingCommit(&network->rx, rc);
+		}
+		else if (rc == 0) {
+			// The peer closed the connection. Only note it, the reader may not hold the lock writers take, so the
+			// socket is left for the owner to close with NetworkDisconnect.
+			__atomic_store_n(&network->closed, 1, __ATOMIC_RELAXED);
+			return -1;
+		}
+		else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			int left = TimerLeftMS(timer);
+			unsigned long long start;
+			if (left <= 0)
+				return 0;
+			start = posix_millis();
+			rc = posix_wait(network, EPOLLIN, left);
+			network->stats.readWaitMs += posix_millis() - start;
+			if (rc == 0)
+				return 0;
+			if (rc < 0)
+				return -1;
+		}
+		else if (errno != EINTR) {
+			return -1;
+		}
+	}
+	return NetworkRingAvailable(&network->rx);
+}
+
+
+int posix_read(Network* network, unsigned char* buffer, int len, int timeout_ms)
+{
+	Timer timer;
+	int bytesRead = NetworkRingRead(&network->rx, buffer, len);
+
+	if (bytesRead == len)
+		return bytesRead;
+	if (network->my_socket < 0)
+		return bytesRead ? bytesRead : -1;
+
+	TimerInit(&timer);
+	TimerCountdownMS(&timer, timeout_ms < 0 ? 0 : timeout_ms);
+	while (bytesRead < len)
+	{
+		int rc = posix_fill(network, &timer);
+		if (rc <= 0)
+			return (bytesRead || rc == 0) ? bytesRead : -1;
+		bytesRead += NetworkRingRead(&network->rx, buffer + bytesRead, len - bytesRead);
+	}
+	return bytesRead;
+}
+
+
+int posix_peek(Network* network, unsigned char** data, int timeout_ms)
+{
+	if (NetworkRingAvailable(&network->rx) == 0) {
+		Timer timer;
+		int rc;
+		if (network->my_socket < 0)
+			return -1;
+		TimerInit(&timer);
+		TimerCountdownMS(&timer, timeout_ms < 0 ? 0 : timeout_ms);
+		if ((rc = posix_fill(network, &timer)) <= 0)
+			return rc;
+	}
+	return NetworkRingPeek(&network->rx, data);
+}
+
+
+void posix_skip(Network* network, int len)
+{
+	NetworkRingConsume(&network->rx, len);
+}
+
+
+int posix_write(Network* network, unsigned char* buffer, int len, int timeout_ms)
+{
+	Timer timer;
+	int bytesWritten = 0;
+
+	if (network->my_socket < 0)
+		return -1;
+
+	TimerInit(&timer);
+	TimerCountdownMS(&timer, timeout_ms < 0 ? 0 : timeout_ms);
+	while (bytesWritten < len)
+	{
+		ssize_t rc = posix_send(network, buffer + bytesWritten, len - bytesWritten);
+		if (rc >= 0) {
+			bytesWritten += rc;
+		}
+		else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			int left = TimerLeftMS(&timer);
+			if (left <= 0 || (rc = posix_wait(network, EPOLLOUT, left)) == 0)
+				break;
+			if (rc < 0)
+				return -1;
+		}
+		else if (errno != EINTR) {
+			return -1;
+		}
+	}
+	return bytesWritten;
+}
+
+
+int posix_writev(Network* network, NetworkVector* vectors, int count, int timeout_ms)
+{
+	struct iovec iov[MQTT_POSIX_MAX_VECTORS];
+	struct msghdr msg;
+	Timer timer;
+	int bytesWritten = 0;
+	int index = 0;
+	int offset = 0;
+
+	if (network->my_socket < 0)
+		return -1;
+
+#if defined(MQTT_TLS)
+	if (network->ssl) {
+		// SSL_write makes one record per call, so gather the blocks first rather than sending a record for each.
+		unsigned char gather[MQTT_POSIX_TLS_GATHER_SIZE];
+		int len = 0;
+		int i;
+		for (i = 0; i < count && len < (int)sizeof(gather); ++i) {
+			int chunk = vectors[i].len;
+			if (chunk > (int)sizeof(gather) - len)
+				chunk = sizeof(gather) - len;
+			memcpy(gather + len, vectors[i].data, chunk);
+			len += chunk;
+		}
+		return posix_write(network, gather, len, timeout_ms);
+	}
+#endif
+
+	TimerInit(&timer);
+	TimerCountdownMS(&timer, timeout_ms < 0 ? 0 : timeout_ms);
+	while (index < count)
+	{
+		ssize_t rc;
+		int i;
+		int iovcnt = 0;
+		int requested = 0;
+
+		for (i = index; i < count && iovcnt < MQTT_POSIX_MAX_VECTORS; ++i) {
+			int skip = (i == index) ? offset : 0;
+			if (vectors[i].len - skip <= 0)
+				continue;
+			iov[iovcnt].iov_base = vectors[i].data + skip;
+			iov[iovcnt].iov_len = vectors[i].len - skip;
+			requested += iov[iovcnt].iov_len;
+			++iovcnt;
+		}
+		if (iovcnt == 0)
+			break;
+
+		// sendmsg is writev for sockets, and lets us suppress SIGPIPE on a closed connection.
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = iovcnt;
+		rc = sendmsg(network->my_socket, &msg, MSG_NOSIGNAL);
+		NetworkStatsWrite(&network->stats, requested, rc);
+		if (rc >= 0) {
+			bytesWritten += rc;
+			rc += offset;
+			while (index < count && rc >= vectors[index].len) {
+				rc -= vectors[index].len;
+				++index;
+			}
+			offset = rc;
+		}
+		else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			int left = TimerLeftMS(&timer);
+			if (left <= 0 || (rc = posix_wait(network, EPOLLOUT, left)) == 0)
+				break;
+			if (rc < 0)
+				return -1;
+		}
+		else if (errno != EINTR) {
+			return -1;
+		}
+	}
+	return bytesWritten;
+}
+
+
+void NetworkInit(Network* network)
+{
+	network->my_socket = -1;
+	network->epoll_fd = -1;
+	network->events = 0;
+	network->mqttread = posix_read;
+	network->mqttwrite = posix_write;
+	network->mqttwritev = posix_writev;
+	network->mqttpeek = posix_peek;
+	network->mqttskip = posix_skip;
+	NetworkRingInit(&network->rx);
+	network->resolved.count = 0;
+	NetworkStatsInit(&network->stats);
+#if defined(MQTT_TLS)
+	network->ctx = NULL;
+	network->ssl = NULL;
+	network->session = NULL;
+	network->fullHandshakes = 0;
+	network->resumedHandshakes = 0;
+#if defined(MQTT_TASK)
+	pthread_mutex_init(&network->sslLock, NULL);
+#endif
+#endif
+#if defined(MQTT_URING)
+	network->uring = NULL;
+	network->slot = -1;
+	network->generation = 0;
+	network->txlen = 0;
+	network->txsent = 0;
+	network->rxpending = 0;
+#endif
+	network->closed = 0;
+}
+
+
+#if defined(MQTT_TLS)
+static int posix_tls_index = -1;
+
+/**
+* OpenSSL callback for a new session. TLS 1.3 sends session tickets after the handshake, so the session is
+* captured here instead of right after SSL_connect.
+*/
+static int posix_tls_new_session(SSL* ssl, SSL_SESSION* session)
+{
+	Network* network = (Network*)SSL_get_ex_data(ssl, posix_tls_index);
+	if (network == NULL)
+		return 0;
+	if (network->session)
+		SSL_SESSION_free(network->session);
+	network->session = session;
+	return 1; // Keep the reference OpenSSL passed in.
+}
+
+
+int NetworkInitTLS(Network* network, const char* caFile)
+{
+	NetworkInit(network);
+	if (posix_tls_index < 0)
+		posix_tls_index = SSL_get_ex_new_index(0, NULL, NULL, NULL, NULL);
+	network->ctx = SSL_CTX_new(TLS_client_method());
+	if (network->ctx == NULL)
+		return 0;
+	SSL_CTX_set_min_proto_version(network->ctx, TLS1_2_VERSION);
+	SSL_CTX_set_mode(network->ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+	SSL_CTX_set_verify(network->ctx, SSL_VERIFY_PEER, NULL);
+	if ((caFile ? SSL_CTX_load_verify_locations(network->ctx, caFile, NULL) : SSL_CTX_set_default_verify_paths(network->ctx)) != 1) {
+		NetworkFreeTLS(network);
+		return 0;
+	}
+	// Cache sessions on the client side only, the session is held in the Network struct rather than OpenSSL's cache.
+	SSL_CTX_set_session_cache_mode(network->ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+	SSL_CTX_sess_set_new_cb(network->ctx, posix_tls_new_session);
+	return 1;
+}
+
+
+void NetworkFreeTLS(Network* network)
+{
+	if (network->session) {
+		SSL_SESSION_free(network->session);
+		network->session = NULL;
+	}
+	if (network->ctx) {
+		SSL_CTX_free(network->ctx);
+		network->ctx = NULL;
+	}
+}
+
+
+/**
+* Run the TLS handshake on the connected socket, offering the cached session for resumption.
+* @param[in] network Pointer to the Network struct
+* @param[in] host Host name used for SNI and certificate verification
+* @return 1 if the handshake succeeded, 0 otherwise
+*/
+static int posix_tls_connect(Network* network, const char* host)
+{
+	Timer timer;
+
+	network->ssl = SSL_new(network->ctx);
+	if (network->ssl == NULL)
+		return 0;
+	SSL_set_ex_data(network->ssl, posix_tls_index, network);
+	SSL_set_fd(network->ssl, network->my_socket);
+	SSL_set_tlsext_host_name(network->ssl, host);
+	SSL_set1_host(network->ssl, host);
+	if (network->session)
+		SSL_set_session(network->ssl, network->session);
+
+	TimerInit(&timer);
+	TimerCountdownMS(&timer, MQTT_POSIX_CONNECT_TIMEOUT_MS);
+	while (1)
+	{
+		int rc = SSL_connect(network->ssl);
+		if (rc == 1)
+			break;
+		switch (SSL_get_error(network->ssl, rc)) {
+		case SSL_ERROR_WANT_READ:
+			rc = posix_wait(network, EPOLLIN, TimerLeftMS(&timer));
+			break;
+		case SSL_ERROR_WANT_WRITE:
+			rc = posix_wait(network, EPOLLOUT, TimerLeftMS(&timer));
+			break;
+		default:
+			rc = -1;
+			break;
+		}
+		if (rc <= 0) {
+			// A session the server rejected shouldn't be offered again.
+			if (network->session) {
+				SSL_SESSION_free(network->session);
+				network->session = NULL;
+			}
+			return 0;
+		}
+	}
+
+	if (SSL_session_reused(network->ssl))
+		network->resumedHandshakes++;
+	else
+		network->fullHandshakes++;
+	posix_wait(network, EPOLLIN, 0);
+	return 1;
+}
+#endif
+
+
+/**
+* Resolve a host name into the address cache, unless the cache already holds unexpired addresses for it.
+* @param[in] network Pointer to the Network struct
+* @param[in] addr Host name or address
+* @param[in] port Destination port
+* @param[out] cached Set to 1 if the addresses came from the cache, 0 if the name was resolved
+* @return Number of cached addresses, 0 if the name could not be resolved
+*/
+static int posix_resolve(Network* network, char* addr, int port, int* cached)
+{
+	NetworkAddressCache* cache = &network->resolved;
+	struct addrinfo hints;
+	struct addrinfo* result = NULL;
+	struct addrinfo* address;
+	struct addrinfo* families[2][MQTT_POSIX_MAX_ADDRESSES];
+	int familyCount[2] = { 0, 0 };
+	char service[8];
+	int i;
+
+	*cached = (cache->count > 0 && cache->port == port && strcmp(cache->host, addr) == 0 && !TimerIsExpired(&cache->expiry));
+	if (*cached)
+		return cache->count;
+	cache->count = 0;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_protocol = IPPROTO_TCP;
+	snprintf(service, sizeof(service), "%d", port);
+	if (getaddrinfo(addr, service, &hints, &result) != 0)
+		return 0;
+
+	// Split the results by family, keeping the resolver's preference order within each family.
+	for (address = result; address != NULL; address = address->ai_next) {
+		int family = (address->ai_family == result->ai_family) ? 0 : 1;
+		if (familyCount[family] < MQTT_POSIX_MAX_ADDRESSES && address->ai_addrlen <= sizeof(struct sockaddr_storage))
+			families[family][familyCount[family]++] = address;
+	}
+	// Then interleave them so a broken IPv6 or IPv4 path only costs one attempt delay.
+	for (i = 0; cache->count < MQTT_POSIX_MAX_ADDRESSES && (i < familyCount[0] || i < familyCount[1]); ++i) {
+		int family;
+		for (family = 0; family < 2 && cache->count < MQTT_POSIX_MAX_ADDRESSES; ++family) {
+			if (i < familyCount[family]) {
+				memcpy(&cache->addresses[cache->count], families[family][i]->ai_addr, families[family][i]->ai_addrlen);
+				cache->lengths[cache->count] = families[family][i]->ai_addrlen;
+				cache->count++;
+			}
+		}
+	}
+	freeaddrinfo(result);
+
+	// Names too long for the cache are resolved again on every connect.
+	if (strlen(addr) < sizeof(cache->host)) {
+		strcpy(cache->host, addr);
+		cache->port = port;
+		TimerInit(&cache->expiry);
+		TimerCountdownMS(&cache->expiry, MQTT_POSIX_ADDRESS_TTL_MS);
+	}
+	else {
+		cache->host[0] = '\0';
+	}
+	return cache->count;
+}
+
+
+/**
+* Start a non-blocking connect to a single address and register the socket with epoll.
+* @param[in] network Pointer to the Network struct, with epoll_fd already created
+* @param[in] address The address to connect to
+* @param[in] length Length of the address
+* @param[out] connected Set to 1 if the connection completed immediately
+* @return The socket, or -1 if the connect failed
+*/
+static int posix_start_connect(Network* network, struct sockaddr_storage* address, socklen_t length, int* connected)
+{
+	struct epoll_event event;
+	int sock = socket(address->ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP);
+	if (sock < 0)
+		return -1;
+
+	memset(&event, 0, sizeof(event));
+	event.events = EPOLLOUT;
+	event.data.fd = sock;
+	if (epoll_ctl(network->epoll_fd, EPOLL_CTL_ADD, sock, &event) < 0) {
+		close(sock);
+		return -1;
+	}
+
+	*connected = 0;
+	if (connect(sock, (struct sockaddr*)address, length) == 0) {
+		*connected = 1;
+	}
+	else if (errno != EINPROGRESS) {
+		epoll_ctl(network->epoll_fd, EPOLL_CTL_DEL, sock, NULL);
+		close(sock);
+		return -1;
+	}
+	return sock;
+}
+
+
+/**
+* Race connects to the cached addresses. A new attempt starts every MQTT_POSIX_ATTEMPT_DELAY_MS, or as soon as the
+* previous attempts have failed, and the first socket to connect is kept.
+* @param[in] network Pointer to the Network struct, with epoll_fd already created
+* @return The connected socket, or -1 if no address could be connected
+*/
+static int posix_race(Network* network)
+{
+	NetworkAddressCache* cache = &network->resolved;
+	int sockets[MQTT_POSIX_MAX_ADDRESSES];
+	struct epoll_event events[MQTT_POSIX_MAX_ADDRESSES];
+	int started = 0;
+	int pending = 0;
+	int winner = -1;
+	Timer timer;
+	Timer attempt;
+	int i;
+
+	TimerInit(&timer);
+	TimerCountdownMS(&timer, MQTT_POSIX_CONNECT_TIMEOUT_MS);
+	TimerInit(&attempt);
+	while (winner < 0 && !TimerIsExpired(&timer))
+	{
+		int count;
+		int wait;
+
+		if (started < cache->count && (pending == 0 || TimerIsExpired(&attempt))) {
+			int connected = 0;
+			int sock = posix_start_connect(network, &cache->addresses[started], cache->lengths[started], &connected);
+			sockets[started++] = sock;
+			if (connected)
+				winner = sock;
+			else if (sock >= 0) {
+				pending++;
+				TimerCountdownMS(&attempt, MQTT_POSIX_ATTEMPT_DELAY_MS);
+			}
+			continue;
+		}
+		if (pending == 0)
+			break;
+
+		wait = TimerLeftMS(&timer);
+		if (started < cache->count && TimerLeftMS(&attempt) < wait)
+			wait = TimerLeftMS(&attempt);
+		count = epoll_wait(network->epoll_fd, events, MQTT_POSIX_MAX_ADDRESSES, wait);
+		if (count < 0 && errno != EINTR)
+			break;
+		for (i = 0; i < count && winner < 0; ++i) {
+			int error = 0;
+			socklen_t errorLen = sizeof(error);
+			int sock = events[i].data.fd;
+			if (getsockopt(sock, SOL_SOCKET, SO_ERROR, &error, &errorLen) == 0 && error == 0) {
+				winner = sock;
+			}
+			else {
+				int j;
+				for (j = 0; j < started; ++j) {
+					if (sockets[j] == sock)
+						sockets[j] = -1;
+				}
+				epoll_ctl(network->epoll_fd, EPOLL_CTL_DEL, sock, NULL);
+				close(sock);
+				pending--;
+			}
+		}
+	}
+
+	for (i = 0; i < started; ++i) {
+		if (sockets[i] >= 0 && sockets[i] != winner) {
+			epoll_ctl(network->epoll_fd, EPOLL_CTL_DEL, sockets[i], NULL);
+			close(sockets[i]);
+		}
+	}
+	return winner;
+}
+
+
+int NetworkConnect(Network* network, char* addr, int port)
+{
+	int attempt;
+	int flag = 1;
+
+	if (network->my_socket >= 0)
+		NetworkDisconnect(network);
+	NetworkRingInit(&network->rx);
+	network->closed = 0;
+
+	network->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (network->epoll_fd < 0)
+		return 0;
+
+	// If none of the cached addresses answer, resolve the name again in case the broker moved.
+	for (attempt = 0; attempt < 2 && network->my_socket < 0; ++attempt) {
+		int cached = 0;
+		if (posix_resolve(network, addr, port, &cached) == 0)
+			break;
+		network->my_socket = posix_race(network);
+		if (network->my_socket < 0) {
+			network->resolved.count = 0;
+			if (!cached)
+				break;
+		}
+	}
+
+	if (network->my_socket < 0) {
+		NetworkDisconnect(network);
+		return 0;
+	}
+
+	// MQTT packets are small and latency sensitive, so don't let Nagle hold them back.
+	setsockopt(network->my_socket, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+	network->events = EPOLLOUT;
+	posix_wait(network, EPOLLIN, 0);
+#if defined(MQTT_TLS)
+	if (network->ctx && !posix_tls_connect(network, addr)) {
+		NetworkDisconnect(network);
+		return 0;
+	}
+#endif
+#if defined(MQTT_URING)
+	if (network->uring)
+		uring_connected(network);
+#endif
+	return 1;
+}
+
+
+void NetworkDisconnect(Network* network)
+{
+#if defined(MQTT_URING)
+	if (network->uring)
+		uring_disconnect(network);
+#endif
+#if defined(MQTT_TLS)
+	TLS_LOCK(network);
+	if (network->ssl) {
+		SSL_shutdown(network->ssl); // Best effort close_notify, the socket is non-blocking so this doesn't wait.
+		SSL_free(network->ssl);
+		network->ssl = NULL;
+	}
+	TLS_UNLOCK(network);
+#endif
+	if (network->my_socket >= 0) {
+		close(network->my_socket);
+		network->my_socket = -1;
+	}
+	if (network->epoll_fd >= 0) {
+		close(network->epoll_fd);
+		network->epoll_fd = -1;
+	}
+	network->events = 0;
+}
+
+
+void NetworkGetStats(Network* network, NetworkStats* stats)
+{
+	*stats = network->stats;
+}
+
+
+int NetworkConnected(Network* network)
+{
+	unsigned char byte;
+	ssize_t rc;
+
+	// The reader sets closed without the owner's lock.
+	if (network->my_socket < 0 || __atomic_load_n(&network->closed, __ATOMIC_RELAXED))
+		return 0;
+	rc = recv(network->my_socket, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+	if (rc == 0 || (rc < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+		return 0;
+	return 1;
+}
+
+#endif
@@ -0,0 +1,351 @@
+/*******************************************************************************
+ * Copyright (c) 2014 IBM Corp.
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v10.html
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *
+ * Contributors:
+ *    Allan Stockdill-Mander - initial API and implementation and/or initial documentation
+ *******************************************************************************/
+
+#if !defined(__MQTT_POSIX_)
+#define __MQTT_POSIX_
+
+#include <sys/socket.h>
+#include "../NetworkCommon.h"
+#if defined(MQTT_TLS)
+#include <openssl/ssl.h>
+#endif
+#if defined(MQTT_URING)
+#include "MQTTUring.h"
+#endif
+#if defined(MQTT_TASK)
+#include <pthread.h>
+#endif
+
+#if !defined(MQTT_POSIX_CONNECT_TIMEOUT_MS)
+#define MQTT_POSIX_CONNECT_TIMEOUT_MS 10000 /* Redefine to change the TCP connect timeout */
+#endif
+
+#if !defined(MQTT_POSIX_ATTEMPT_DELAY_MS)
+#define MQTT_POSIX_ATTEMPT_DELAY_MS 250 /* Time to wait on a connect attempt before racing the next address */
+#endif
+
+#if !defined(MQTT_POSIX_MAX_ADDRESSES)
+#define MQTT_POSIX_MAX_ADDRESSES 8 /* Maximum number of resolved addresses kept and raced */
+#endif
+
+#if !defined(MQTT_POSIX_ADDRESS_TTL_MS)
+#define MQTT_POSIX_ADDRESS_TTL_MS 300000 /* Time resolved addresses are reused before the host name is resolved again */
+#endif
+
+#if !defined(MQTT_POSIX_HOST_SIZE)
+#define MQTT_POSIX_HOST_SIZE 128 /* Longest host name whose addresses are cached */
+#endif
+
+#if !defined(MQTT_POSIX_TLS_GATHER_SIZE)
+#define MQTT_POSIX_TLS_GATHER_SIZE 1024 /* Largest TLS record built from a vectored write */
+#endif
+
+#if !defined(MQTT_POSIX_MAX_VECTORS)
+#define MQTT_POSIX_MAX_VECTORS 16 /* Maximum number of blocks passed to a single sendmsg call */
+#endif
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+	/**
+	* Countdown timer struct.
+	*/
+	typedef struct Timer
+	{
+		unsigned long long interval_end_ms; /**< CLOCK_MONOTONIC time the countdown ends, 0 if not started. */
+	} Timer;
+
+	/**
+	* Initialize countdown timer.
+	* @param[in] timer Pointer to Timer struct
+	*/
+	void TimerInit(Timer* timer);
+
+	/**
+	* The countdown timer has expired.
+	* @param[in] timer Pointer to Timer struct
+	* @return 1 if countdown has expired, 0 otherwise.
+	*/
+	char TimerIsExpired(Timer* timer);
+
+	/**
+	* Start countdown in milliseconds.
+	* @param[in] timer Pointer to Timer struct
+	* @param[in] timeout Number of milliseconds to count down.
+	*/
+	void TimerCountdownMS(Timer* timer, unsigned int timeout);
+
+	/**
+	* Start countdown in seconds.
+	* @param[in] timer Pointer to Timer struct
+	* @param[in] timeout Number of seconds to count down.
+	*/
+	void TimerCountdown(Timer* timer, unsigned int timeout);
+
+	/**
+	* Get the number of milliseconds left in countdown.
+	* @param[in] timer Pointer to Timer struct
+	* @return Number of milliseconds left.
+	*/
+	int TimerLeftMS(Timer* timer);
+
+#if defined(MQTT_TASK)
+	/**
+	* Mutex struct.
+	*/
+	typedef struct Mutex
+	{
+		pthread_mutex_t m; /**< The underlying pthread mutex. */
+	} Mutex;
+
+	/**
+	* Initialize mutex.
+	* @param[in] mutex Pointer to Mutex struct
+	*/
+	void MutexInit(Mutex* mutex);
+
+	/**
+	* Lock mutex, waiting until it is free.
+	* @param[in] mutex Pointer to Mutex struct
+	* @return 0 if successful, an error number otherwise.
+	*/
+	int MutexLock(Mutex* mutex);
+
+	/**
+	* Unlock mutex.
+	* @param[in] mutex Pointer to Mutex struct
+	* @return 0 if successful, an error number otherwise.
+	*/
+	int MutexUnlock(Mutex* mutex);
+
+	/**
+	* Thread struct.
+	*/
+	typedef struct Thread
+	{
+		pthread_t t; /**< The underlying pthread. */
+		void (*fn)(void*); /**< Function the thread runs. */
+		void* arg; /**< Argument passed to fn. */
+	} Thread;
+
+	/**
+	* Start a detached thread.
+	* @param[in] thread Pointer to Thread struct, which must stay valid while the thread runs
+	* @param[in] fn Function the thread runs
+	* @param[in] arg Argument passed to fn
+	* @return 0 if successful, an error number otherwise.
+	*/
+	int ThreadStart(Thread* thread, void (*fn)(void*), void* arg);
+#endif
+
+
+	/**
+	* Addresses resolved for a host, kept so reconnects don't wait on name resolution.
+	*/
+	typedef struct NetworkAddressCache
+	{
+		char host[MQTT_POSIX_HOST_SIZE]; /**< Host name the addresses were resolved for. */
+		int port; /**< Port the addresses were resolved for. */
+		int count; /**< Number of cached addresses, 0 if the cache is empty. */
+		struct sockaddr_storage addresses[MQTT_POSIX_MAX_ADDRESSES]; /**< Addresses in the order they are tried, alternating address families. */
+		socklen_t lengths[MQTT_POSIX_MAX_ADDRESSES]; /**< Length of each address. */
+		Timer expiry; /**< Countdown until the addresses must be resolved again. */
+	} NetworkAddressCache;
+
+
+	/**
+	* Network struct for reading from and writing to a non-blocking socket.
+	*/
+	typedef struct Network
+	{
+		int my_socket; /**< The socket file descriptor, -1 if not connected. */
+		int epoll_fd; /**< The epoll instance used to wait for socket readiness, -1 if not connected. */
+		unsigned int events; /**< The epoll events currently registered for the socket. */
+		int closed; /**< Set when the peer closed the connection or a completion reported it failed. The socket stays open until NetworkDisconnect. */
+		NetworkRing rx; /**< Data received from the socket that has not been read yet. */
+		NetworkAddressCache resolved; /**< Addresses from the last name resolution. */
+		NetworkStats stats; /**< I/O counters. */
+#if defined(MQTT_TLS)
+		SSL_CTX* ctx; /**< TLS context, NULL for a plain TCP connection. */
+		SSL* ssl; /**< TLS connection, NULL if not connected or not using TLS. */
+		SSL_SESSION* session; /**< Session from the last handshake, offered on the next connect so it can be resumed. */
+		unsigned int fullHandshakes; /**< Number of handshakes that negotiated a new session. */
+		unsigned int resumedHandshakes; /**< Number of handshakes that resumed the cached session. */
+#if defined(MQTT_TASK)
+		pthread_mutex_t sslLock; /**< Held across each SSL call, an SSL object can't be read and written from two threads at once. */
+#endif
+#endif
+#if defined(MQTT_URING)
+		struct NetworkUring* uring; /**< Ring shared with other connections, NULL if the socket is waited on with epoll. */
+		int slot; /**< Index of the connection's buffers in the ring. */
+		unsigned int generation; /**< Incremented on disconnect so completions for the old socket are ignored. */
+		unsigned int txlen; /**< Number of bytes staged in the send buffer, including any being sent. */
+		unsigned int txsent; /**< Number of bytes the send in flight covers, 0 if no send is in flight. */
+		int rxpending; /**< 1 while a read is in flight. */
+#endif
+
+		/**
+		* Read data from the network.
+		* @param[in] network Pointer to the Network struct
+		* @param[out] buffer Buffer that receives the data
+		* @param[in] len Buffer length
+		* @param[in] timeout_ms Timeout for the read operation, in milliseconds
+		* @return Number of bytes read, or a negative value if there was an error
+		*/
+		int(*mqttread) (struct Network* network, unsigned char* buffer, int len, int timeout_ms);
+
+		/**
+		* Write data to the network.
+		* @param[in] network Pointer to the Network struct
+		* @param[in] buffer Buffer that contains data to write
+		* @param[in] len Number of bytes to write
+		* @param[in] timeout_ms Timeout for the write operation, in milliseconds
+		* @return Number of bytes written, or a negative value if there was an error
+		*/
+		int(*mqttwrite) (struct Network* network, unsigned char* buffer, int len, int timeout_ms);
+
+		/**
+		* Write a list of data blocks to the network as one stream.
+		* @param[in] network Pointer to the Network struct
+		* @param[in] vectors Data blocks to write
+		* @param[in] count Number of data blocks
+		* @param[in] timeout_ms Timeout for the write operation, in milliseconds
+		* @return Number of bytes written, or a negative value if there was an error
+		*/
+		int(*mqttwritev) (struct Network* network, NetworkVector* vectors, int count, int timeout_ms);
+
+		/**
+		* Get received data in place, without copying it.
+		* @param[in] network Pointer to the Network struct
+		* @param[out] data Set to the start of the buffered data
+		* @param[in] timeout_ms Time to wait for data if none is buffered, in milliseconds
+		* @return Number of contiguous bytes at data, 0 if no data arrived, or a negative value if there was an error
+		*/
+		int(*mqttpeek) (struct Network* network, unsigned char** data, int timeout_ms);
+
+		/**
+		* Consume data returned by mqttpeek.
+		* @param[in] network Pointer to the Network struct
+		* @param[in] len Number of bytes to consume
+		*/
+		void(*mqttskip) (struct Network* network, int len);
+	} Network;
+
+	/**
+	* Read data from the network. Waits on epoll until data arrives or the timeout expires.
+	* @param[in] network Pointer to the Network struct
+	* @param[out] buffer Buffer that receives the data
+	* @param[in] len Buffer length
+	* @param[in] timeout_ms Timeout for the read operation, in milliseconds
+	* @return Number of bytes read, 0 on timeout, or a negative value if there was an error or the connection was closed
+	*/
+	int posix_read(struct Network* network, unsigned char* buffer, int len, int timeout_ms);
+
+	/**
+	* Get received data in place, without copying it.
+	* @param[in] network Pointer to the Network struct
+	* @param[out] data Set to the start of the buffered data
+	* @param[in] timeout_ms Time to wait for data if none is buffered, in milliseconds
+	* @return Number of contiguous bytes at data, 0 if no data arrived, or a negative value if there was an error
+	*/
+	int posix_peek(struct Network* network, unsigned char** data, int timeout_ms);
+
+	/**
+	* Consume data returned by posix_peek.
+	* @param[in] network Pointer to the Network struct
+	* @param[in] len Number of bytes to consume
+	*/
+	void posix_skip(struct Network* network, int len);
+
+	/**
+	* Write data to the network. Waits on epoll while the socket send buffer is full.
+	* @param[in] network Pointer to the Network struct
+	* @param[in] buffer Buffer that contains data to write
+	* @param[in] len Number of bytes to write
+	* @param[in] timeout_ms Timeout for the write operation, in milliseconds
+	* @return Number of bytes written, or a negative value if there was an error
+	*/
+	int posix_write(struct Network* network, unsigned char* buffer, int len, int timeout_ms);
+
+	/**
+	* Write a list of data blocks to the network as one stream.
+	* @param[in] network Pointer to the Network struct
+	* @param[in] vectors Data blocks to write
+	* @param[in] count Number of data blocks
+	* @param[in] timeout_ms Timeout for the write operation, in milliseconds
+	* @return Number of bytes written, or a negative value if there was an error
+	*/
+	int posix_writev(struct Network* network, NetworkVector* vectors, int count, int timeout_ms);
+
+	/**
+	* Initialize Network struct
+	* @param[in] network Pointer to the Network struct
+	*/
+	void NetworkInit(Network* network);
+
+#if defined(MQTT_TLS)
+	/**
+	* Initialize Network struct for TLS connections. The session negotiated by each handshake is kept and offered
+	* on the next NetworkConnect, so reconnecting only needs an abbreviated handshake.
+	* @param[in] network Pointer to the Network struct
+	* @param[in] caFile File containing the trusted CA certificates, or NULL to use the system defaults
+	* @return 1 if successful, 0 otherwise
+	*/
+	int NetworkInitTLS(Network* network, const char* caFile);
+
+	/**
+	* Free the TLS context and cached session. The Network must be disconnected.
+	* @param[in] network Pointer to the Network struct
+	*/
+	void NetworkFreeTLS(Network* network);
+#endif
+
+	/**
+	* Connect to the specified address. Resolved addresses are cached for MQTT_POSIX_ADDRESS_TTL_MS. Connect attempts
+	* are started MQTT_POSIX_ATTEMPT_DELAY_MS apart, alternating IPv6 and IPv4, and the first one to complete is kept.
+	* @param[in] network Pointer to the Network struct
+	* @param[in] addr Destination host name or address
+	* @param[in] port Destination port
+	* @return 1 if successfully connected, 0 otherwise
+	*/
+	int NetworkConnect(Network* network, char* addr, int port);
+
+	/**
+	* Close the connection.
+	* @param[in] network Pointer to the Network struct
+	*/
+	void NetworkDisconnect(Network* network);
+
+	/**
+	* Get the I/O counters. The counters accumulate across reconnects.
+	* @param[in] network Pointer to the Network struct
+	* @param[out] stats Receives a copy of the counters
+	*/
+	void NetworkGetStats(Network* network, NetworkStats* stats);
+
+	/**
+	* Get the connection state. A connection the peer closed isn't closed here until NetworkDisconnect is called.
+	* @param[in] network Pointer to the Network struct
+	* @return 1 if connected, 0 if not
+	*/
+	int NetworkConnected(Network* network);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif
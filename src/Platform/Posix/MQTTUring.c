@@ -0,0 +1,499 @@
+/*
+The MIT License(MIT)
+
+Cayenne MQTT Client Library
+Copyright (c) 2016 myDevices
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated
+documentation files(the "Software"), to deal in the Software without restriction, including without limitation
+the rights to use, copy, modify, merge, publish, distribute, sublicense, and / or sell copies of the Software,
+and to permit persons to whom the Software is furnished to do so, subject to the following conditions :
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+// Only built on Linux hosts that opt in with MQTT_URING, the default Posix backend uses epoll.
+#if !defined(ARDUINO) && defined(__linux__) && defined(MQTT_URING)
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include "MQTTPosix.h"
+
+#define URING_SLOT_SIZE (NETWORK_RX_BUFFER_SIZE + MQTT_URING_TX_BUFFER_SIZE)
+
+static unsigned char* uring_rx(Network* network)
+{
+	return network->uring->buffers + (size_t)network->slot * URING_SLOT_SIZE;
+}
+
+
+static unsigned char* uring_tx(Network* network)
+{
+	return uring_rx(network) + NETWORK_RX_BUFFER_SIZE;
+}
+
+
+/**
+* Queue a read or send for a connection. The entry is visible to the kernel on the next io_uring_enter.
+* @param[in] network Pointer to the Network struct
+* @param[in] send 1 to send the staged data, 0 to read into the receive buffer
+* @return 1 if queued, 0 if the submission queue is full
+*/
+static int uring_queue(Network* network, int send)
+{
+	NetworkUring* uring = network->uring;
+	unsigned int tail = *uring->sqTail;
+	unsigned int head = __atomic_load_n(uring->sqHead, __ATOMIC_ACQUIRE);
+	unsigned int index = tail & *uring->sqMask;
+	struct io_uring_sqe* sqe = &uring->sqes[index];
+
+	if (tail - head > *uring->sqMask)
+		return 0;
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->fd = network->my_socket;
+	sqe->user_data = ((uint64_t)network->generation << 32) | ((uint64_t)network->slot << 1) | (send ? 1 : 0);
+	if (send) {
+		// A plain send, the kernel copies the staged data. Registered buffers are only taken by zero copy sends,
+		// which aren't worth their extra notification completion for packets this small.
+		sqe->opcode = IORING_OP_SEND;
+		sqe->addr = (uint64_t)(uintptr_t)uring_tx(network);
+		sqe->len = network->txlen;
+		sqe->msg_flags = MSG_NOSIGNAL;
+		network->txsent = network->txlen;
+	}
+	else {
+		// Read no more than the ring can take, so the completion can always be copied in.
+		sqe->addr = (uint64_t)(uintptr_t)uring_rx(network);
+		sqe->len = NETWORK_RX_BUFFER_SIZE - NetworkRingAvailable(&network->rx);
+		if (uring->registered) {
+			sqe->opcode = IORING_OP_READ_FIXED;
+			sqe->buf_index = network->slot;
+		}
+		else {
+			sqe->opcode = IORING_OP_RECV;
+		}
+		network->rxpending = 1;
+	}
+	uring->sqArray[index] = index;
+	__atomic_store_n(uring->sqTail, tail + 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+
+/**
+* Handle the completion of a read or send.
+* @param[in] uring Pointer to the NetworkUring struct
+* @param[in] cqe The completion
+*/
+static void uring_complete(NetworkUring* uring, struct io_uring_cqe* cqe)
+{
+	int slot = (int)((cqe->user_data >> 1) & 0x7fffffff);
+	Network* network = (slot < uring->slots) ? uring->networks[slot] : NULL;
+	int res = cqe->res;
+
+	// Completions for a socket that has since been closed or detached are stale.
+	if (network == NULL || (unsigned int)(cqe->user_data >> 32) != network->generation)
+		return;
+
+	if (cqe->user_data & 1) {
+		NetworkStatsWrite(&network->stats, network->txsent, res);
+		network->txsent = 0;
+		if (res > 0) {
+			network->txlen -= res;
+			memmove(uring_tx(network), uring_tx(network) + res, network->txlen);
+		}
+		else if (res != -EINTR && res != -EAGAIN) {
+			__atomic_store_n(&network->closed, 1, __ATOMIC_RELAXED);
+		}
+	}
+	else {
+		NetworkStatsRead(&network->stats, res);
+		network->rxpending = 0;
+		if (res > 0) {
+			unsigned char* data = uring_rx(network);
+			while (res > 0) {
+				unsigned char* space;
+				int len = NetworkRingReserve(&network->rx, &space);
+				if (len > res)
+					len = res;
+				memcpy(space, data, len);
+				NetworkRingCommit(&network->rx, len);
+				data += len;
+				res -= len;
+			}
+		}
+		else if (res != -EINTR && res != -EAGAIN) {
+			// 0 means the peer closed the connection.
+			__atomic_store_n(&network->closed, 1, __ATOMIC_RELAXED);
+		}
+	}
+}
+
+
+/**
+* Submit the queued entries and optionally wait for a completion.
+* @param[in] uring Pointer to the NetworkUring struct
+* @param[in] timeout_ms Time to wait for a completion if none is ready, in milliseconds, 0 to not wait
+* @return 0 if successful, or a negative value if there was an error
+*/
+static int uring_enter(NetworkUring* uring, int timeout_ms)
+{
+	struct io_uring_getevents_arg arg;
+	struct __kernel_timespec ts;
+	unsigned int pending = *uring->sqTail - __atomic_load_n(uring->sqHead, __ATOMIC_ACQUIRE);
+	unsigned int flags = IORING_ENTER_EXT_ARG;
+	unsigned int wait = 0;
+	long rc;
+
+	if (timeout_ms > 0 && *uring->cqHead == __atomic_load_n(uring->cqTail, __ATOMIC_ACQUIRE)) {
+		flags |= IORING_ENTER_GETEVENTS;
+		wait = 1;
+	}
+	if (pending == 0 && !wait)
+		return 0;
+
+	memset(&arg, 0, sizeof(arg));
+	ts.tv_sec = timeout_ms / 1000;
+	ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+	arg.ts = (uint64_t)(uintptr_t)&ts;
+	uring->enters++;
+	rc = syscall(__NR_io_uring_enter, uring->fd, pending, wait, flags, &arg, sizeof(arg));
+	if (rc < 0 && errno != ETIME && errno != EINTR && errno != EBUSY && errno != EAGAIN)
+		return -1;
+	return 0;
+}
+
+
+int NetworkUringSubmit(NetworkUring* uring, int timeout_ms)
+{
+	unsigned int head;
+	unsigned int tail;
+	int count = 0;
+	int slot;
+
+	for (slot = 0; slot < uring->slots; ++slot) {
+		Network* network = uring->networks[slot];
+		if (network == NULL || network->my_socket < 0 || network->closed)
+			continue;
+		if (!network->rxpending && NetworkRingAvailable(&network->rx) < NETWORK_RX_BUFFER_SIZE)
+			uring_queue(network, 0);
+		if (network->txsent == 0 && network->txlen > 0)
+			uring_queue(network, 1);
+	}
+
+	if (uring_enter(uring, timeout_ms) < 0)
+		return -1;
+
+	head = *uring->cqHead;
+	tail = __atomic_load_n(uring->cqTail, __ATOMIC_ACQUIRE);
+	while (head != tail) {
+		uring_complete(uring, &uring->cqes[head & *uring->cqMask]);
+		++head;
+		++count;
+	}
+	__atomic_store_n(uring->cqHead, head, __ATOMIC_RELEASE);
+	uring->completions += count;
+	return count;
+}
+
+
+/**
+* Wait for received data while the receive ring is empty, submitting everything queued on the ring meanwhile.
+* @param[in] network Pointer to the Network struct
+* @param[in] timer Countdown for the wait
+* @return Number of bytes buffered, 0 on timeout, or a negative value if there was an error or the connection was closed
+*/
+static int uring_fill(Network* network, Timer* timer)
+{
+	while (NetworkRingAvailable(&network->rx) == 0)
+	{
+		int left = TimerLeftMS(timer);
+		int rc;
+
+		if (network->closed || network->my_socket < 0)
+			return -1; // the owner closes the socket with NetworkDisconnect
+		rc = NetworkUringSubmit(network->uring, left);
+		network->stats.readWaitMs += left - TimerLeftMS(timer);
+		if (rc < 0)
+			return -1;
+		if (NetworkRingAvailable(&network->rx) == 0 && TimerIsExpired(timer))
+			return 0;
+	}
+	return NetworkRingAvailable(&network->rx);
+}
+
+
+static int uring_read(Network* network, unsigned char* buffer, int len, int timeout_ms)
+{
+	Timer timer;
+	int bytesRead = NetworkRingRead(&network->rx, buffer, len);
+
+	if (bytesRead == len)
+		return bytesRead;
+	if (network->my_socket < 0)
+		return bytesRead ? bytesRead : -1;
+
+	TimerInit(&timer);
+	TimerCountdownMS(&timer, timeout_ms < 0 ? 0 : timeout_ms);
+	while (bytesRead < len)
+	{
+		int rc = uring_fill(network, &timer);
+		if (rc <= 0)
+			return (bytesRead || rc == 0) ? bytesRead : -1;
+		bytesRead += NetworkRingRead(&network->rx, buffer + bytesRead, len - bytesRead);
+	}
+	return bytesRead;
+}
+
+
+static int uring_peek(Network* network, unsigned char** data, int timeout_ms)
+{
+	if (NetworkRingAvailable(&network->rx) == 0) {
+		Timer timer;
+		int rc;
+		if (network->my_socket < 0)
+			return -1;
+		TimerInit(&timer);
+		TimerCountdownMS(&timer, timeout_ms < 0 ? 0 : timeout_ms);
+		if ((rc = uring_fill(network, &timer)) <= 0)
+			return rc;
+	}
+	return NetworkRingPeek(&network->rx, data);
+}
+
+
+/**
+* Stage data in the connection's send buffer. The data goes out on the next NetworkUringSubmit, the write only
+* waits if the send buffer is full.
+*/
+static int uring_writev(Network* network, NetworkVector* vectors, int count, int timeout_ms)
+{
+	Timer timer;
+	int bytesWritten = 0;
+	int index = 0;
+	int offset = 0;
+
+	if (network->my_socket < 0 || network->closed)
+		return -1;
+
+	TimerInit(&timer);
+	TimerCountdownMS(&timer, timeout_ms < 0 ? 0 : timeout_ms);
+	while (index < count)
+	{
+		int space = MQTT_URING_TX_BUFFER_SIZE - network->txlen;
+		if (space > 0) {
+			int chunk = vectors[index].len - offset;
+			if (chunk > space)
+				chunk = space;
+			if (chunk > 0) {
+				memcpy(uring_tx(network) + network->txlen, vectors[index].data + offset, chunk);
+				network->txlen += chunk;
+				bytesWritten += chunk;
+				offset += chunk;
+			}
+			if (offset >= vectors[index].len) {
+				++index;
+				offset = 0;
+			}
+			continue;
+		}
+
+		// The send buffer is full, so submit it and wait for the send to complete.
+		if (NetworkUringSubmit(network->uring, TimerLeftMS(&timer)) < 0 || network->closed)
+			return -1;
+		if (network->txlen == MQTT_URING_TX_BUFFER_SIZE && TimerIsExpired(&timer))
+			break;
+	}
+	return bytesWritten;
+}
+
+
+static int uring_write(Network* network, unsigned char* buffer, int len, int timeout_ms)
+{
+	NetworkVector vector;
+	vector.data = buffer;
+	vector.len = len;
+	return uring_writev(network, &vector, 1, timeout_ms);
+}
+
+
+void uring_connected(Network* network)
+{
+	network->txlen = 0;
+	network->txsent = 0;
+	network->rxpending = 0;
+	network->closed = 0;
+}
+
+
+void uring_disconnect(Network* network)
+{
+	Timer timer;
+
+	// A DISCONNECT packet is usually the last thing staged, give it a chance to go out.
+	TimerInit(&timer);
+	TimerCountdownMS(&timer, MQTT_URING_LINGER_MS);
+	while (network->my_socket >= 0 && network->txlen > 0 && !network->closed && !TimerIsExpired(&timer)) {
+		if (NetworkUringSubmit(network->uring, TimerLeftMS(&timer)) < 0)
+			break;
+	}
+	// Closing the socket doesn't end operations the ring holds on it, shutting it down does.
+	if (network->my_socket >= 0 && (network->rxpending || network->txsent))
+		shutdown(network->my_socket, SHUT_RDWR);
+	network->generation++;
+	uring_connected(network);
+}
+
+
+int NetworkUringInit(NetworkUring* uring, int slots)
+{
+	struct io_uring_params params;
+	struct iovec* iov = NULL;
+	unsigned char* sq;
+	unsigned char* cq;
+	int i;
+
+	memset(uring, 0, sizeof(NetworkUring));
+	uring->fd = -1;
+	if (slots <= 0)
+		goto fail;
+
+	// Each connection has at most one read and one send in flight.
+	memset(&params, 0, sizeof(params));
+	uring->fd = syscall(__NR_io_uring_setup, slots * 2, &params);
+	if (uring->fd < 0 || !(params.features & IORING_FEAT_EXT_ARG))
+		goto fail;
+
+	uring->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+	uring->cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		if (uring->cqRingSize > uring->sqRingSize)
+			uring->sqRingSize = uring->cqRingSize;
+		uring->cqRingSize = uring->sqRingSize;
+	}
+	uring->sqRing = mmap(NULL, uring->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_SQ_RING);
+	if (uring->sqRing == MAP_FAILED) {
+		uring->sqRing = NULL;
+		goto fail;
+	}
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+		uring->cqRing = uring->sqRing;
+	else {
+		uring->cqRing = mmap(NULL, uring->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_CQ_RING);
+		if (uring->cqRing == MAP_FAILED) {
+			uring->cqRing = NULL;
+			goto fail;
+		}
+	}
+	uring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+	uring->sqes = (struct io_uring_sqe*)mmap(NULL, uring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_SQES);
+	if (uring->sqes == MAP_FAILED) {
+		uring->sqes = NULL;
+		goto fail;
+	}
+
+	sq = (unsigned char*)uring->sqRing;
+	cq = (unsigned char*)uring->cqRing;
+	uring->sqHead = (unsigned int*)(sq + params.sq_off.head);
+	uring->sqTail = (unsigned int*)(sq + params.sq_off.tail);
+	uring->sqMask = (unsigned int*)(sq + params.sq_off.ring_mask);
+	uring->sqArray = (unsigned int*)(sq + params.sq_off.array);
+	uring->cqHead = (unsigned int*)(cq + params.cq_off.head);
+	uring->cqTail = (unsigned int*)(cq + params.cq_off.tail);
+	uring->cqMask = (unsigned int*)(cq + params.cq_off.ring_mask);
+	uring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+
+	uring->slots = slots;
+	uring->buffers = (unsigned char*)calloc(slots, URING_SLOT_SIZE);
+	uring->networks = (Network**)calloc(slots, sizeof(Network*));
+	iov = (struct iovec*)calloc(slots, sizeof(struct iovec));
+	if (uring->buffers == NULL || uring->networks == NULL || iov == NULL)
+		goto fail;
+
+	// Registering the buffers saves the kernel mapping them on every read. It is limited by the locked memory
+	// allowance, so carry on with plain reads if it fails.
+	for (i = 0; i < slots; ++i) {
+		iov[i].iov_base = uring->buffers + (size_t)i * URING_SLOT_SIZE;
+		iov[i].iov_len = URING_SLOT_SIZE;
+	}
+	uring->registered = (syscall(__NR_io_uring_register, uring->fd, IORING_REGISTER_BUFFERS, iov, slots) == 0);
+	free(iov);
+	return 1;
+
+fail:
+	free(iov);
+	NetworkUringFree(uring);
+	return 0;
+}
+
+
+void NetworkUringFree(NetworkUring* uring)
+{
+	if (uring->sqes)
+		munmap(uring->sqes, uring->sqesSize);
+	if (uring->cqRing && uring->cqRing != uring->sqRing)
+		munmap(uring->cqRing, uring->cqRingSize);
+	if (uring->sqRing)
+		munmap(uring->sqRing, uring->sqRingSize);
+	if (uring->fd >= 0)
+		close(uring->fd);
+	free(uring->buffers);
+	free(uring->networks);
+	memset(uring, 0, sizeof(NetworkUring));
+	uring->fd = -1;
+}
+
+
+int NetworkUringAttach(NetworkUring* uring, Network* network)
+{
+	int slot;
+
+#if defined(MQTT_TLS)
+	// OpenSSL reads and writes the socket itself, so TLS connections stay on epoll.
+	if (network->ctx)
+		return 0;
+#endif
+	for (slot = 0; slot < uring->slots; ++slot) {
+		if (uring->networks[slot] == NULL) {
+			uring->networks[slot] = network;
+			network->uring = uring;
+			network->slot = slot;
+			network->generation++;
+			network->mqttread = uring_read;
+			network->mqttwrite = uring_write;
+			network->mqttwritev = uring_writev;
+			network->mqttpeek = uring_peek;
+			uring_connected(network);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+
+void NetworkUringDetach(Network* network)
+{
+	if (network->uring == NULL)
+		return;
+	network->uring->networks[network->slot] = NULL;
+	network->uring = NULL;
+	network->generation++;
+	network->mqttread = posix_read;
+	network->mqttwrite = posix_write;
+	network->mqttwritev = posix_writev;
+	network->mqttpeek = posix_peek;
+}
+
+#endif
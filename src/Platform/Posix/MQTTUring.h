@@ -0,0 +1,126 @@
+/*
+The MIT License(MIT)
+
+Cayenne MQTT Client Library
+Copyright (c) 2016 myDevices
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated
+documentation files(the "Software"), to deal in the Software without restriction, including without limitation
+the rights to use, copy, modify, merge, publish, distribute, sublicense, and / or sell copies of the Software,
+and to permit persons to whom the Software is furnished to do so, subject to the following conditions :
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef _MQTTURING_h
+#define _MQTTURING_h
+
+#include <stddef.h>
+
+#if !defined(MQTT_URING_TX_BUFFER_SIZE)
+#define MQTT_URING_TX_BUFFER_SIZE 1024 /* Size of the send buffer each connection stages its writes in */
+#endif
+
+#if !defined(MQTT_URING_LINGER_MS)
+#define MQTT_URING_LINGER_MS 1000 /* Time NetworkDisconnect waits for staged data to be sent before closing */
+#endif
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+	struct Network;
+
+	/**
+	* An io_uring shared by many connections. Writes are copied into a send buffer per connection and sent with plain
+	* sends, which the kernel copies again. Reads complete into a receive buffer per connection, registered with the
+	* kernel if possible, and are copied out to the reader. Nothing goes to the kernel until NetworkUringSubmit, which
+	* submits the reads and writes of every attached connection with one system call and collects their completions.
+	* A gateway serving many clients can publish on all of them and then submit once.
+	*/
+	typedef struct NetworkUring
+	{
+		int fd; /**< The io_uring file descriptor, -1 if not initialized. */
+		unsigned int* sqHead; /**< Submission queue head, advanced by the kernel. */
+		unsigned int* sqTail; /**< Submission queue tail, advanced when entries are queued. */
+		unsigned int* sqMask; /**< Mask applied to submission queue indexes, one less than the number of entries. */
+		unsigned int* sqArray; /**< Submission queue index array. */
+		struct io_uring_sqe* sqes; /**< Submission queue entries. */
+		unsigned int* cqHead; /**< Completion queue head, advanced when completions are handled. */
+		unsigned int* cqTail; /**< Completion queue tail, advanced by the kernel. */
+		unsigned int* cqMask; /**< Mask applied to completion queue indexes. */
+		struct io_uring_cqe* cqes; /**< Completion queue entries. */
+		void* sqRing; /**< Mapping of the submission queue ring. */
+		size_t sqRingSize; /**< Size of the submission queue ring mapping. */
+		void* cqRing; /**< Mapping of the completion queue ring, the same as sqRing if the kernel maps them together. */
+		size_t cqRingSize; /**< Size of the completion queue ring mapping. */
+		size_t sqesSize; /**< Size of the submission queue entries mapping. */
+		unsigned char* buffers; /**< Receive and send buffers of every slot, registered with the kernel if possible. */
+		int registered; /**< 1 if the buffers are registered, so reads use them without mapping them each time. */
+		struct Network** networks; /**< Connection attached to each slot, NULL if the slot is free. */
+		int slots; /**< Number of connections the ring can serve. */
+		unsigned long enters; /**< Number of io_uring_enter calls. */
+		unsigned long completions; /**< Number of completions handled. */
+	} NetworkUring;
+
+	/**
+	* Create an io_uring for up to the specified number of connections.
+	* @param[in] uring Pointer to the NetworkUring struct
+	* @param[in] slots Maximum number of connections attached at once
+	* @return 1 if successful, 0 otherwise
+	*/
+	int NetworkUringInit(NetworkUring* uring, int slots);
+
+	/**
+	* Close the io_uring and free its buffers. All connections must be detached first.
+	* @param[in] uring Pointer to the NetworkUring struct
+	*/
+	void NetworkUringFree(NetworkUring* uring);
+
+	/**
+	* Move a Network onto the io_uring. The Network may already be connected. NetworkConnect and NetworkDisconnect
+	* are used as before, only reads and writes go through the ring.
+	* @param[in] uring Pointer to the NetworkUring struct
+	* @param[in] network Pointer to the Network struct
+	* @return 1 if successful, 0 if all slots are in use
+	*/
+	int NetworkUringAttach(NetworkUring* uring, struct Network* network);
+
+	/**
+	* Move a Network back to epoll. Reads still in flight are abandoned, so data received by them is lost.
+	* @param[in] network Pointer to the Network struct
+	*/
+	void NetworkUringDetach(struct Network* network);
+
+	/**
+	* Submit staged writes and new reads for every attached connection with a single system call, then handle
+	* the completions. This is called while a read waits, so a client blocked in MQTTYield keeps sending, but a
+	* gateway should call it after each round of publishing.
+	* @param[in] uring Pointer to the NetworkUring struct
+	* @param[in] timeout_ms Time to wait for a completion if none is ready, in milliseconds, 0 to not wait
+	* @return Number of completions handled, or a negative value if there was an error
+	*/
+	int NetworkUringSubmit(NetworkUring* uring, int timeout_ms);
+
+	/**
+	* Reset the connection's send buffer and read state for a socket that was just connected. The first read is
+	* queued by the next NetworkUringSubmit. Called by NetworkConnect.
+	* @param[in] network Pointer to the Network struct
+	*/
+	void uring_connected(struct Network* network);
+
+	/**
+	* Send any staged data, then forget the connection's in-flight operations. Called by NetworkDisconnect
+	* before the socket is closed.
+	* @param[in] network Pointer to the Network struct
+	*/
+	void uring_disconnect(struct Network* network);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif